@@ -0,0 +1,98 @@
+// Compares allocator builds on the allocation-heavy stages of a decode
+// (raw2image, demosaic and its scratch buffers, output bitmap) with 1, 4 and
+// 8 sessions decoding concurrently on their own pthreads in one module.
+//
+//   ./compileLibraw.sh && mkdir -p bench/dlmalloc && cp libraw.js libraw.wasm bench/dlmalloc/
+//   MALLOC=mimalloc ./compileLibraw.sh && mkdir -p bench/mimalloc && cp libraw.js libraw.wasm bench/mimalloc/
+//   node bench/allocator.js bench/dlmalloc/libraw.js bench/mimalloc/libraw.js -- a.CR3 b.NEF
+//
+// SETTINGS='{"halfSize":true}' applies settings to every decode, ROUNDS=5 the
+// number of passes over the files (default 3). Times are medians, in ms.
+import { readFile } from 'node:fs/promises';
+import { resolve } from 'node:path';
+import { pathToFileURL } from 'node:url';
+
+const THREADS = [1, 4, 8];
+const ROUNDS = Number(process.env.ROUNDS ?? 3);
+const SETTINGS = JSON.parse(process.env.SETTINGS ?? '{}');
+const STAGES = ['unpack', 'raw2image', 'preprocess', 'demosaic', 'convert', 'finish', 'output'];
+
+function median(values) {
+	const sorted = [...values].sort((a, b) => a - b);
+	const mid = sorted.length >> 1;
+	return sorted.length % 2 ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2;
+}
+
+function decode(raw) {
+	return new Promise((resolve, reject) => {
+		raw.processAsync((code, step) => {
+			if (code === 0) {
+				resolve();
+			} else {
+				reject(new Error(`LibRaw: ${step}() failed with code ${code}`));
+			}
+		});
+	});
+}
+
+async function bench(module, files, threads) {
+	const sessions = Array.from({length: threads}, () => new module.LibRaw());
+	const samples = {wall: []};
+	for (const stage of STAGES) {
+		samples[stage] = [];
+	}
+	try {
+		for (let round = 0; round < ROUNDS; round++) {
+			for (const file of files) {
+				for (const raw of sessions) {
+					raw.open(file, SETTINGS);
+				}
+				const start = performance.now();
+				await Promise.all(sessions.map(async raw => {
+					await decode(raw);
+					raw.imageData();
+				}));
+				samples.wall.push(performance.now() - start);
+				for (const raw of sessions) {
+					const timings = raw.stageTimings();
+					for (const stage of STAGES) {
+						samples[stage].push(timings[stage] ?? 0);
+					}
+				}
+			}
+		}
+	} finally {
+		for (const raw of sessions) {
+			raw.delete();
+		}
+	}
+	const row = {};
+	for (const stage of STAGES) {
+		row[stage] = +median(samples[stage]).toFixed(1);
+	}
+	row.wall = +median(samples.wall).toFixed(1);
+	row['files/s'] = +(threads * 1000 / row.wall).toFixed(2);
+	return row;
+}
+
+const args = process.argv.slice(2);
+const split = args.indexOf('--');
+if (split < 1 || split === args.length - 1) {
+	console.error('usage: node bench/allocator.js <libraw.js>... -- <raw file>...');
+	process.exit(1);
+}
+const modules = args.slice(0, split);
+const files = await Promise.all(args.slice(split + 1).map(async path => new Uint8Array(await readFile(path))));
+
+const table = {};
+for (const path of modules) {
+	const {default: LibRawModule} = await import(pathToFileURL(resolve(path)).href);
+	const module = await LibRawModule();
+	for (const threads of THREADS) {
+		table[`${path} x${threads}`] = await bench(module, files, threads);
+		const heap = module.heapStats();
+		console.error(`${path} x${threads}: heap ${(heap.heapSize / 1048576).toFixed(0)} MB, allocated ${(heap.allocated / 1048576).toFixed(0)} MB`);
+	}
+}
+console.table(table);
+process.exit(0);
@@ -0,0 +1,101 @@
+// Checks that `compactProcessing` renders what the regular pipeline renders
+// with `userQual: 0` (bilinear demosaic), within rounding: one 8-bit step.
+// Runs on synthetic Bayer frames (per-channel black, as-shot white balance,
+// fine texture) and on any raw files given after `--`.
+//
+//   ./compileLibraw.sh && node bench/compact.js libraw.js [-- a.CR2 b.NEF]
+//
+// Prints the largest difference per file and settings; exits with 1 if one
+// is over the tolerance.
+import { readFile } from 'node:fs/promises';
+import { loadModule } from './module.js';
+import { syntheticDng } from './synthetic-dng.js';
+
+// Settings each file is rendered with, on top of {userQual: 0}
+const VARIANTS = [
+	{},
+	{useCameraWb: true},
+	{outputBps: 16},
+	{userFlip: 5},
+	{noAutoBright: true, bright: 2},
+];
+
+// Smooth color ramps plus a texture finer than the CFA, over a black level
+// that differs per channel
+function scene(black) {
+	return (data, width, height) => {
+		for (let row = 0; row < height; row++) {
+			for (let col = 0; col < width; col++) {
+				const c = (row & 1) * 2 + (col & 1);	// RGGB: 0 R, 1/2 G, 3 B
+				const ramp = c === 0 ? 200 + 3000 * col / width :
+					c === 3 ? 300 + 1500 * (row + col) / (width + height) : 400 + 2000 * row / height;
+				const texture = ((row * 7 + col * 13) % 17) * 12;
+				data[row * width + col] = Math.round(black[c] + ramp + texture);
+			}
+		}
+	};
+}
+
+function syntheticFiles() {
+	const files = [];
+	for (const [width, height] of [[640, 426], [301, 203]]) {
+		const black = [64, 60, 62, 70];
+		files.push({name: `synthetic ${width}x${height}`, data: syntheticDng(width, height,
+			{fill: scene(black), black, neutral: [0.48, 1, 0.71]})});
+	}
+	return files;
+}
+
+function render(module, data, settings) {
+	const raw = new module.LibRaw();
+	try {
+		raw.open(data, settings);
+		return raw.imageData();
+	} finally {
+		raw.delete();
+	}
+}
+
+const args = process.argv.slice(2);
+const split = args.indexOf('--');
+const modulePath = split < 0 ? args[0] : args.slice(0, split)[0];
+if (!modulePath || (split >= 0 && split !== 1)) {
+	console.error('usage: node bench/compact.js <libraw.js> [-- <raw file>...]');
+	process.exit(1);
+}
+const module = await loadModule(modulePath);
+const files = syntheticFiles();
+for (const path of split < 0 ? [] : args.slice(split + 1)) {
+	files.push({name: path, data: new Uint8Array(await readFile(path))});
+}
+
+const table = {};
+let failures = 0;
+for (const {name, data} of files) {
+	for (const variant of VARIANTS) {
+		const settings = {userQual: 0, ...variant};
+		const regular = render(module, data, settings);
+		const compact = render(module, data, {...settings, compactProcessing: true});
+		const tolerance = regular.bits === 16 ? 257 : 1;
+		let maxDiff = 0, differing = 0;
+		if (regular.width !== compact.width || regular.height !== compact.height || regular.data.length !== compact.data.length) {
+			maxDiff = Infinity;
+		} else {
+			for (let i = 0; i < regular.data.length; i++) {
+				const diff = Math.abs(regular.data[i] - compact.data[i]);
+				maxDiff = Math.max(maxDiff, diff);
+				differing += diff > 0;
+			}
+		}
+		const ok = maxDiff <= tolerance;
+		failures += !ok;
+		table[`${name} ${JSON.stringify(variant)}`] = {
+			size: `${compact.width}x${compact.height}`,
+			maxDiff,
+			'differing %': +(100 * differing / regular.data.length).toFixed(3),
+			ok,
+		};
+	}
+}
+console.table(table);
+process.exit(failures ? 1 : 0);
@@ -0,0 +1,70 @@
+// Decodes a synthetic 200 MP Bayer frame (uncompressed 16-bit DNG, built in
+// memory) and checks the size and contents of the output. Buffers of that
+// size only fit in the heap if every size/offset computation is 64-bit clean.
+//
+//   MEMORY64=1 ./compileLibraw.sh && node bench/large-frame.js libraw.js
+//
+// MP=120 changes the frame size (megapixels), SETTINGS='{"outputBps":16}'
+// adds settings to the decode. The default wasm32 build may run out of heap
+// at 200 MP unless `streamingRelease`/`compactProcessing` keep the peak down.
+import { loadModule } from './module.js';
+import { syntheticDng } from './synthetic-dng.js';
+
+const MP = Number(process.env.MP ?? 200);
+const SETTINGS = JSON.parse(process.env.SETTINGS ?? '{}');
+const LEVEL = 1000;	// value of every photosite (12-bit data)
+
+const args = process.argv.slice(2);
+if (args.length !== 1) {
+	console.error('usage: node bench/large-frame.js <libraw.js>');
+	process.exit(1);
+}
+const module = await loadModule(args[0]);
+
+// 3:2 frame, even sides (whole CFA cells)
+const height = Math.round(Math.sqrt(MP * 1e6 / 1.5) / 2) * 2;
+const width = Math.round(height * 1.5 / 2) * 2;
+const dng = syntheticDng(width, height, {fill: data => data.fill(LEVEL)});
+console.error(`${width}x${height} (${(width * height / 1e6).toFixed(1)} MP), ${(dng.length / 1048576).toFixed(0)} MB file`);
+
+const raw = new module.LibRaw();
+let failures = 0;
+const check = (ok, message) => {
+	if (!ok) {
+		console.error(`FAIL: ${message}`);
+		failures++;
+	}
+};
+try {
+	const start = performance.now();
+	raw.open(dng, {userQual: 0, streamingRelease: true, ...SETTINGS});
+	const image = raw.imageData();
+	console.error(`decoded in ${((performance.now() - start) / 1000).toFixed(1)} s`);
+
+	const channels = image.colors;
+	const bytes = image.bits / 8;
+	// userFlip 5/6/7 turn the frame by 90 degrees
+	const [outWidth, outHeight] = SETTINGS.userFlip > 0 && SETTINGS.userFlip & 4 ? [height, width] : [width, height];
+	check(image.width === outWidth && image.height === outHeight, `size ${image.width}x${image.height}, expected ${outWidth}x${outHeight}`);
+	check(image.dataSize === width * height * channels * bytes, `dataSize ${image.dataSize}, expected ${width * height * channels * bytes}`);
+	check(image.data.length === width * height * channels, `data.length ${image.data.length}, expected ${width * height * channels}`);
+
+	// A flat frame renders flat: away from the borders, samples from the first
+	// to the last rows (past every 2 and 4 GB offset) match the center pixel
+	const pixel = (row, col) => Array.from(image.data.subarray((row * outWidth + col) * channels, (row * outWidth + col + 1) * channels));
+	const reference = pixel(outHeight >> 1, outWidth >> 1);
+	check(reference.some(v => v > 0), `center pixel is black`);
+	for (const row of [2, outHeight >> 2, outHeight >> 1, outHeight - (outHeight >> 2), outHeight - 3]) {
+		for (const col of [2, outWidth >> 1, outWidth - 3]) {
+			const value = pixel(row, col);
+			check(value.every((v, c) => Math.abs(v - reference[c]) <= 1), `pixel (${col}, ${row}) is ${value}, center is ${reference}`);
+		}
+	}
+	if (module.heapSummary) {
+		console.error(`heap ${(module.heapSummary().heapSize / 1048576).toFixed(0)} MB`);
+	}
+} finally {
+	raw.delete();
+}
+console.error(failures ? `${failures} check(s) failed` : 'ok');
+process.exit(failures ? 1 : 0);
@@ -0,0 +1,36 @@
+// Loads a libraw.js build for the checks in this folder. Fails with a clear
+// message, instead of a result that means nothing, when the build can't run
+// under Node (web-only ENVIRONMENT) or predates libraw_wrapper.cpp.
+import { readFile } from 'node:fs/promises';
+import { resolve } from 'node:path';
+import { fileURLToPath, pathToFileURL } from 'node:url';
+
+const WRAPPER = fileURLToPath(new URL('../libraw_wrapper.cpp', import.meta.url));
+
+// Names declared in EMSCRIPTEN_BINDINGS: [module functions, LibRaw methods]
+async function wrapperBindings() {
+	const wrapper = (await readFile(WRAPPER)).toString();
+	const bindings = wrapper.slice(wrapper.indexOf('EMSCRIPTEN_BINDINGS'));
+	const classStart = bindings.indexOf('class_<WASMLibRaw>');
+	const names = text => [...text.matchAll(/function\("(\w+)"/g)].map(match => match[1]);
+	return [names(bindings.slice(0, classStart)), names(bindings.slice(classStart))];
+}
+
+export async function loadModule(path) {
+	const {default: LibRawModule} = await import(pathToFileURL(resolve(path)).href);
+	let module;
+	try {
+		module = await LibRawModule();
+	} catch (err) {
+		throw new Error(`${path} doesn't load under Node (${err.message ?? err}); rebuild it with compileLibraw.sh, whose ENVIRONMENT includes node`);
+	}
+	const [functions, methods] = await wrapperBindings();
+	const missing = [
+		...functions.filter(name => typeof module[name] !== 'function'),
+		...methods.filter(name => typeof module.LibRaw?.prototype[name] !== 'function'),
+	];
+	if (missing.length) {
+		throw new Error(`${path} is older than libraw_wrapper.cpp (missing ${missing.join(', ')}); rebuild it with compileLibraw.sh`);
+	}
+	return module;
+}
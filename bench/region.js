@@ -0,0 +1,82 @@
+// Checks renderRegion() against imageData() for every userFlip value (0-7):
+// the full frame must render identically, and windows at odd offsets must
+// match the same pixels of the full render. Runs on a synthetic Bayer frame
+// and on any raw files given after `--`.
+//
+//   ./compileLibraw.sh && node bench/region.js libraw.js [-- a.CR2 b.NEF]
+//
+// Prints the largest difference per file, flip and region; exits with 1 if
+// one is over the tolerance (none for the full frame, one step for windows).
+import { readFile } from 'node:fs/promises';
+import { loadModule } from './module.js';
+import { syntheticDng } from './synthetic-dng.js';
+
+// Ramps plus a texture finer than the CFA, so that misplaced pixels show
+function scene(data, width, height) {
+	for (let row = 0; row < height; row++) {
+		for (let col = 0; col < width; col++) {
+			const c = (row & 1) * 2 + (col & 1);
+			const ramp = c === 0 ? 200 + 3000 * col / width :
+				c === 3 ? 300 + 1500 * (row + col) / (width + height) : 400 + 2000 * row / height;
+			data[row * width + col] = Math.round(64 + ramp + ((row * 7 + col * 13) % 17) * 12);
+		}
+	}
+}
+
+// Largest difference between `region` and the window it covers in `image`
+function compare(image, region) {
+	if (region.colors !== image.colors || region.bits !== image.bits) {
+		return Infinity;
+	}
+	const channels = image.colors;
+	let maxDiff = 0;
+	for (let row = 0; row < region.height; row++) {
+		for (let col = 0; col < region.width * channels; col++) {
+			const expected = image.data[((region.y + row) * image.width + region.x) * channels + col];
+			maxDiff = Math.max(maxDiff, Math.abs(region.data[row * region.width * channels + col] - expected));
+		}
+	}
+	return maxDiff;
+}
+
+const args = process.argv.slice(2);
+const split = args.indexOf('--');
+const modulePath = split < 0 ? args[0] : args.slice(0, split)[0];
+if (!modulePath || (split >= 0 && split !== 1)) {
+	console.error('usage: node bench/region.js <libraw.js> [-- <raw file>...]');
+	process.exit(1);
+}
+const module = await loadModule(modulePath);
+const files = [{name: 'synthetic 402x301', data: syntheticDng(402, 301, {fill: scene, black: [64, 64, 64, 64]})}];
+for (const path of split < 0 ? [] : args.slice(split + 1)) {
+	files.push({name: path, data: new Uint8Array(await readFile(path))});
+}
+
+const table = {};
+let failures = 0;
+for (const {name, data} of files) {
+	for (let flip = 0; flip < 8; flip++) {
+		const raw = new module.LibRaw();
+		try {
+			raw.open(data, {userFlip: flip});
+			const image = raw.imageData();
+			const {width, height} = image;
+			const windows = [
+				['full frame', [0, 0, width, height], 0],
+				['window', [37, 53, Math.min(101, width - 37), Math.min(77, height - 53)], 1],
+				['bottom right', [width - 59, height - 43, 59, 43], 1],
+			];
+			for (const [label, [x, y, w, h], tolerance] of windows) {
+				const region = raw.renderRegion(x, y, w, h, 1);
+				const maxDiff = region.width === w && region.height === h ? compare(image, region) : Infinity;
+				const ok = maxDiff <= tolerance;
+				failures += !ok;
+				table[`${name} flip ${flip} ${label}`] = {region: `${x},${y} ${w}x${h}`, maxDiff, ok};
+			}
+		} finally {
+			raw.delete();
+		}
+	}
+}
+console.table(table);
+process.exit(failures ? 1 : 0);
@@ -0,0 +1,82 @@
+// Uncompressed 16-bit RGGB DNGs built in memory, for the checks in this folder.
+// `fill(data, width, height)` writes the photosites (Uint16Array, row major);
+// `black` is the per-channel black level (R, G, G, B), `neutral` the as-shot
+// white balance (R, G, B).
+const TYPES = {BYTE: [1, 1], ASCII: [2, 1], SHORT: [3, 2], LONG: [4, 4], RATIONAL: [5, 8], SRATIONAL: [10, 8]};
+
+export function syntheticDng(width, height, {fill, black = [0, 0, 0, 0], white = 4095, neutral = [1, 1, 1]} = {}) {
+	const entries = [];
+	const tag = (id, type, values) => entries.push({id, type, values});
+	const ascii = text => [...text, '\0'].map(c => c.charCodeAt(0));
+	const rational = value => [Math.round(value * 1e6), 1e6];
+
+	const stripBytes = width * height * 2;
+	tag(254, 'LONG', [0]);
+	tag(256, 'LONG', [width]);
+	tag(257, 'LONG', [height]);
+	tag(258, 'SHORT', [16]);
+	tag(259, 'SHORT', [1]);
+	tag(262, 'SHORT', [32803]);	// CFA
+	tag(271, 'ASCII', ascii('LibRaw-Wasm'));
+	tag(272, 'ASCII', ascii('Synthetic'));
+	tag(273, 'LONG', [0]);	// strip offset, set below
+	tag(274, 'SHORT', [1]);
+	tag(277, 'SHORT', [1]);
+	tag(278, 'LONG', [height]);
+	tag(279, 'LONG', [stripBytes]);
+	tag(284, 'SHORT', [1]);
+	tag(33421, 'SHORT', [2, 2]);
+	tag(33422, 'BYTE', [0, 1, 1, 2]);
+	tag(50706, 'BYTE', [1, 4, 0, 0]);
+	tag(50708, 'ASCII', ascii('LibRaw-Wasm Synthetic'));
+	tag(50713, 'SHORT', [2, 2]);	// BlackLevelRepeatDim
+	tag(50714, 'LONG', black);
+	tag(50717, 'SHORT', [white]);
+	tag(50721, 'SRATIONAL', [1, 1, 0, 1, 0, 1, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1, 1, 1]);
+	tag(50728, 'RATIONAL', neutral.flatMap(rational));
+	tag(50778, 'SHORT', [21]);
+
+	const isRational = type => type === 'RATIONAL' || type === 'SRATIONAL';
+	const valueBytes = ({type, values}) => values.length / (isRational(type) ? 2 : 1) * TYPES[type][1];
+	let extraOffset = 8 + 2 + entries.length * 12 + 4;
+	for (const entry of entries) {
+		const size = valueBytes(entry);
+		if (size > 4) {
+			entry.offset = extraOffset;
+			extraOffset += size + (size & 1);
+		}
+	}
+	const stripOffset = extraOffset;
+	entries.find(e => e.id === 273).values[0] = stripOffset;
+
+	const file = new Uint8Array(stripOffset + stripBytes);
+	const view = new DataView(file.buffer);
+	const write = (offset, type, values) => {
+		const size = TYPES[type][1] / (isRational(type) ? 2 : 1);
+		values.forEach((value, i) => {
+			const at = offset + i * size;
+			if (size === 1) view.setUint8(at, value);
+			else if (size === 2) view.setUint16(at, value, true);
+			else if (type === 'SRATIONAL') view.setInt32(at, value, true);
+			else view.setUint32(at, value, true);
+		});
+	};
+	view.setUint16(0, 0x4949, true);
+	view.setUint16(2, 42, true);
+	view.setUint32(4, 8, true);
+	view.setUint16(8, entries.length, true);
+	entries.forEach((entry, i) => {
+		const at = 10 + i * 12;
+		const [typeCode, unit] = TYPES[entry.type];
+		view.setUint16(at, entry.id, true);
+		view.setUint16(at + 2, typeCode, true);
+		view.setUint32(at + 4, valueBytes(entry) / unit, true);
+		if (entry.offset !== undefined) {
+			view.setUint32(at + 8, entry.offset, true);
+		}
+		write(entry.offset ?? at + 8, entry.type, entry.values);
+	});
+	view.setUint32(10 + entries.length * 12, 0, true);
+	fill?.(new Uint16Array(file.buffer, stripOffset, width * height), width, height);
+	return file;
+}
@@ -2,21 +2,38 @@ import { build } from 'esbuild';
 import { promises as fs } from "fs";
 
 
+// Every binding libraw_wrapper.cpp declares must be in libraw.wasm (Embind
+// keeps the names as strings), so a module older than the wrapper, and
+// the JS calling it, is never bundled
+async function checkBindings() {
+	const wrapper = (await fs.readFile('./libraw_wrapper.cpp')).toString();
+	const bindings = wrapper.slice(wrapper.indexOf('EMSCRIPTEN_BINDINGS'));
+	const wasm = await fs.readFile('./libraw.wasm');
+	const missing = [...bindings.matchAll(/function\("(\w+)"/g)].map(match => match[1])
+		.filter(name => wasm.indexOf(`\0${name}\0`) < 0);
+	if (missing.length) {
+		throw new Error(`libraw.wasm is older than libraw_wrapper.cpp (missing ${missing.join(', ')}), run ./compileLibraw.sh first`);
+	}
+}
+
 (async () => {
 	try {
+		await checkBindings();
 		let librawjs = (await fs.readFile('./libraw.js')).toString();
 		librawjs = librawjs.replace(/var workerOptions=([^]+?);worker=new Worker\(new URL\("([^"]+)",import.meta.url\),workerOptions\);/, `worker=new Worker(new URL("$2",import.meta.url),$1);`); // Correction to make worker options static so that it works with vite
 		await fs.writeFile('./libraw.js', librawjs);
 		await build({
-			entryPoints: ['index.js', 'worker.js', 'libraw.js'], // Entry point of your library
+			entryPoints: ['index.js', 'worker.js', 'sync.js', 'libraw.js'], // Entry point of your library
 			outdir: 'dist', // Output directory
 			bundle: true, // Bundle all files
 			minify: true, // Minify the output
 			sourcemap: true, // Generate source maps
 			format: 'esm', // Output format (ES Module)
+			external: ['node:fs', 'node:path'], // Only loaded by the persistent cache on Node
 		});
 		await fs.copyFile('./libraw.wasm', './dist/libraw.wasm');
 		await fs.copyFile('./index.d.ts', './dist/index.d.ts');
+		await fs.copyFile('./sync.d.ts', './dist/sync.d.ts');
 		console.log('Build successful!');
 	} catch (error) {
 		console.error('Build failed:', error);
@@ -0,0 +1,149 @@
+// Canonical form of a settings object: sorted keys, null/undefined dropped
+// (applySettings() ignores them too) and booleans as 0/1.
+function canonical(value) {
+	if (Array.isArray(value)) {
+		return `[${value.map(canonical).join(',')}]`;
+	}
+	if (value && typeof value === 'object') {
+		return `{${Object.keys(value).filter(k => value[k] != null).sort().map(k => `${JSON.stringify(k)}:${canonical(value[k])}`).join(',')}}`;
+	}
+	if (typeof value === 'boolean') {
+		return String(+value);
+	}
+	return JSON.stringify(value);
+}
+
+// Settings that change how a file is decoded, but not the result
+const NEUTRAL_SETTINGS = ['memoryLimitMB', 'streamingRelease'];
+
+/**
+ * Key for a settings object; equivalent settings give the same key
+ */
+export function settingsKey(settings) {
+	if (settings == null) {
+		return '{}';
+	}
+	const relevant = {...settings};
+	for (const key of NEUTRAL_SETTINGS) {
+		delete relevant[key];
+	}
+	return canonical(relevant);
+}
+
+/**
+ * Approximate retained size of a cached result
+ */
+export function sizeOf(value) {
+	if (value == null) {
+		return 0;
+	}
+	if (ArrayBuffer.isView(value)) {
+		return value.byteLength;
+	}
+	if (typeof value === 'object') {
+		let bytes = 0;
+		for (const key in value) {
+			bytes += key.length + sizeOf(value[key]);
+		}
+		return bytes;
+	}
+	return typeof value === 'string' ? value.length * 2 : 8;
+}
+
+/**
+ * LRU cache under a byte budget. Concurrent requests for the same key are
+ * coalesced into a single producer call.
+ */
+export default class ResultCache {
+	constructor({maxBytes = 0} = {}) {
+		this.entries = new Map(); // key -> {value, bytes}, in LRU order
+		this.inflight = new Map();
+		this.bytes = 0;
+		this.hits = 0;
+		this.misses = 0;
+		this.configure({maxBytes});
+	}
+
+	get enabled() {
+		return this.maxBytes > 0;
+	}
+
+	configure({maxBytes = this.maxBytes} = {}) {
+		this.maxBytes = maxBytes;
+		this.evict();
+	}
+
+	get(key) {
+		const entry = this.entries.get(key);
+		if (!entry) {
+			return undefined;
+		}
+		// Move to the most recently used end
+		this.entries.delete(key);
+		this.entries.set(key, entry);
+		return entry.value;
+	}
+
+	set(key, value) {
+		const bytes = sizeOf(value);
+		if (!this.enabled || bytes > this.maxBytes) {
+			return;
+		}
+		this.delete(key);
+		this.entries.set(key, {value, bytes});
+		this.bytes += bytes;
+		this.evict();
+	}
+
+	delete(key) {
+		const entry = this.entries.get(key);
+		if (entry) {
+			this.bytes -= entry.bytes;
+			this.entries.delete(key);
+		}
+	}
+
+	evict() {
+		for (const [key] of this.entries) {
+			if (this.bytes <= this.maxBytes) {
+				break;
+			}
+			this.delete(key);
+		}
+	}
+
+	/**
+	 * Cached value for `key`, or the result of `producer()` (stored afterwards).
+	 * While a producer runs, other callers for the same key wait for it.
+	 */
+	async getOrCreate(key, producer) {
+		if (!this.enabled) {
+			return await producer();
+		}
+		const hit = this.get(key);
+		if (hit !== undefined) {
+			this.hits++;
+			return hit;
+		}
+		if (this.inflight.has(key)) {
+			this.hits++;
+			return await this.inflight.get(key);
+		}
+		this.misses++;
+		const prom = (async () => {
+			try {
+				const value = await producer();
+				this.set(key, value);
+				return value;
+			} finally {
+				this.inflight.delete(key);
+			}
+		})();
+		this.inflight.set(key, prom);
+		return await prom;
+	}
+
+	stats() {
+		return {entries: this.entries.size, bytes: this.bytes, maxBytes: this.maxBytes, hits: this.hits, misses: this.misses};
+	}
+}
@@ -2,6 +2,33 @@
 
 set -e
 
+# Allocator of the final module: dlmalloc (Emscripten's default, one global
+# lock) or mimalloc (thread-local caches, scales with concurrent decodes):
+#   MALLOC=mimalloc ./compileLibraw.sh
+MALLOC="${MALLOC:-dlmalloc}"
+MALLOC_FLAGS="-s MALLOC=${MALLOC}"
+if [ "$MALLOC" = "mimalloc" ]; then
+  MALLOC_FLAGS="${MALLOC_FLAGS} -DLIBRAW_WASM_MIMALLOC"
+fi
+
+# MEMORY64=1 ./compileLibraw.sh builds everything for wasm64, lifting the
+# 4 GB heap ceiling of wasm32 (100+ MP files, pixel-shift stacks). Needs a
+# runtime with Memory64 (Chrome 133+, Firefox 134+, Node 24+).
+if [ "${MEMORY64:-0}" = "1" ]; then
+  WASM_HOST="wasm64-unknown-emscripten"
+  ARCH_FLAGS="-s MEMORY64=1"
+  MAXIMUM_MEMORY="16GB"
+else
+  WASM_HOST="wasm32-unknown-emscripten"
+  ARCH_FLAGS=""
+  MAXIMUM_MEMORY="4GB"
+fi
+
+# Pthreads started with the module; the wrapper keeps every job (encoder
+# strips, tile helpers) within them:
+#   PTHREAD_POOL=8 ./compileLibraw.sh
+PTHREAD_POOL="${PTHREAD_POOL:-4}"
+
 rm -rf libs includes LibRawSource lcms2 2>/dev/null || true
 mkdir libs
 mkdir includes
@@ -17,8 +44,10 @@ command -v libtoolize >/dev/null 2>&1 && libtoolize || glibtoolize # MacOS fallb
 
 autoreconf -fi
 # 2) Configure and make with Emscripten
-emconfigure ./configure --host=wasm32-unknown-emscripten \
-  --disable-shared
+emconfigure ./configure --host=${WASM_HOST} \
+  --disable-shared \
+  CFLAGS="-O2 ${ARCH_FLAGS}" \
+  LDFLAGS="${ARCH_FLAGS}"
 emmake make -j8
 
 cp -R src/.libs/* ../libs/
@@ -35,6 +64,12 @@ git clone https://github.com/LibRaw/LibRaw.git LibRawSource
 
 pushd LibRawSource
 
+echo -e "\n==> Applying libraw-wasm patches..."
+# Pooled allocator behind libraw_memmgr (see patches/libraw_alloc.h). It
+# changes the layout of LibRaw, so the wrapper must see the same header as
+# libraw_r.a: includes/ only gets it with the rebuilt library (copy below).
+cp ../patches/libraw_alloc.h libraw/libraw_alloc.h
+
 echo -e "\n==> Generating configure script from configure.ac..."
 # Generate ./configure from configure.ac
 command -v libtoolize >/dev/null 2>&1 && libtoolize || glibtoolize # MacOS fallback
@@ -45,14 +80,14 @@ autoreconf -i
 #---------------------------------------------------------------------------------
 echo -e "\n==> Configuring LibRaw with Emscripten..."
 emconfigure ./configure \
-  --host=wasm32-unknown-emscripten \
+  --host=${WASM_HOST} \
   --enable-openmp \
   --enable-lcms \
   --disable-shared \
   --disable-examples \
-  CFLAGS="-O3 -flto -ffast-math -msimd128 -DNDEBUG -DUSE_LCMS2 -I../includes" \
-  CXXFLAGS="-O3 -flto -ffast-math -msimd128 -DNDEBUG -DUSE_LCMS2 -I../includes" \
-  LDFLAGS="-s USE_PTHREADS=1 -lpthread -L../libs/ -llcms2"
+  CFLAGS="-O3 -flto -ffast-math -msimd128 -DNDEBUG -DUSE_LCMS2 -I../includes ${ARCH_FLAGS}" \
+  CXXFLAGS="-O3 -flto -ffast-math -msimd128 -DNDEBUG -DUSE_LCMS2 -I../includes ${ARCH_FLAGS}" \
+  LDFLAGS="-s USE_PTHREADS=1 -lpthread -L../libs/ -llcms2 ${ARCH_FLAGS}"
 
 echo -e "\n==> Building LibRaw..."
 emmake make -j8
@@ -65,11 +100,13 @@ popd  # out of LibRawSource
 #---------------------------------------------------------------------------------
 # 3) Build the final WASM from libraw_wrapper.cpp
 #---------------------------------------------------------------------------------
-echo -e "\n==> Building libraw.js + libraw.wasm..."
+echo -e "\n==> Building libraw.js + libraw.wasm (${MALLOC})..."
 emcc \
   --bind \
   -I./includes \
-  -s USE_LIBPNG=1 \
+  ${MALLOC_FLAGS} \
+  ${ARCH_FLAGS} \
+  -DLIBRAW_WASM_PTHREAD_POOL=${PTHREAD_POOL} \
   -s USE_LIBJPEG=1 \
   -s USE_ZLIB=1 \
   -s MODULARIZE=1 \
@@ -77,13 +114,15 @@ emcc \
   -s DISABLE_EXCEPTION_CATCHING=0 \
   -s ALLOW_MEMORY_GROWTH=1 \
   -s INITIAL_MEMORY=256MB \
+  -s MAXIMUM_MEMORY=${MAXIMUM_MEMORY} \
   -s USE_PTHREADS=1 \
-  -s ENVIRONMENT="web,worker" \
+  -s PTHREAD_POOL_SIZE=${PTHREAD_POOL} \
+  -s ENVIRONMENT="web,worker,node" \
   -msimd128 \
   -O3 -flto -pthread \
   libraw_wrapper.cpp \
   ./libs/liblcms2.a \
-  ./libs/libraw.a \
+  ./libs/libraw_r.a \
   -o libraw.js
 
 
@@ -31,6 +31,34 @@ export interface LibRawOptions {
   expCorrec?: boolean;
   noAutoScale?: boolean;
   noInterpolation?: boolean;
+  /** Refuse files whose raw data alone needs more than this (default 2048) */
+  memoryLimitMB?: number;
+  /**
+   * Free the file once unpacked and the raw data once copied for processing
+   * (lower peak heap). thumbnailData() must then be called before imageData().
+   * Applies to this open() only; default in processBatch().
+   */
+  streamingRelease?: boolean;
+  /**
+   * Render Bayer files through a 3-channel working image (25% less memory)
+   * with userQual 0. Ignored for other demosaics and when a setting needs
+   * LibRaw's full pipeline.
+   */
+  compactProcessing?: boolean;
+  /**
+   * Bounds of the returned image, in oriented pixels (aspect ratio kept, never
+   * enlarged). Small enough targets render at half size before resampling.
+   * Apply to this open() only.
+   */
+  targetWidth?: number;
+  targetHeight?: number;
+  maxDimension?: number;
+  /**
+   * Render with the best quality predicted to fit in this time (halfSize,
+   * userQual, dcbIterations, fbddNoiserd, downscale), see budgetChoices().
+   * Applies to this open() only.
+   */
+  timeBudgetMs?: number;
 
   greybox?: [number, number, number, number] | null;
   cropbox?: [number, number, number, number] | null;
@@ -83,6 +111,165 @@ export interface RawImageData {
   height: number;
 }
 
+export interface PyramidOptions {
+  /** Tile width and height in pixels (default 256) */
+  tileSize?: number;
+  /** Number of levels, from full size down (default: until one tile holds the image) */
+  levels?: number;
+}
+
+export interface PyramidLevel {
+  /** 0 is full size, each level is half the previous one */
+  level: number;
+  width: number;
+  height: number;
+  /** Number of tiles across and down */
+  columns: number;
+  rows: number;
+}
+
+export interface PyramidTile {
+  level: number;
+  column: number;
+  row: number;
+  /** Edge tiles are smaller than tileSize */
+  width: number;
+  height: number;
+  data: Uint8Array | Uint16Array;
+}
+
+export interface Pyramid {
+  tileSize: number;
+  colors: number;
+  bits: number;
+  levels: PyramidLevel[];
+  tiles: PyramidTile[];
+}
+
+export interface EncodeOptions {
+  /** Default 'jpeg', or 'tiff' with outputTiff */
+  format?: 'jpeg' | 'png' | 'tiff';
+  /** JPEG quality, 1..100 (default 90) */
+  quality?: number;
+  /** JPEG: progressive scans */
+  progressive?: boolean;
+  /** JPEG: optimized Huffman tables (a few % smaller, slower) */
+  optimize?: boolean;
+  /** PNG/TIFF zlib level, 0..9 (default 6) */
+  compression?: number;
+  /** PNG/TIFF: pthreads compressing strips (default: cores, up to the pthread pool, 4; fewer while other sessions hold pool threads) */
+  threads?: number;
+}
+
+export interface EncodedImage {
+  format: string;
+  width: number;
+  height: number;
+  /** The encoded file */
+  data: Uint8Array;
+}
+
+export interface TileExportOptions extends EncodeOptions {
+  format?: 'jpeg' | 'png';
+  /** Tile size without overlap (default 254) */
+  tileSize?: number;
+  /** Pixels shared with neighbour tiles (default 1) */
+  overlap?: number;
+  /** Pthreads of the export, the one forwarding tiles included (default: cores, up to the pthread pool, 4; fewer while other sessions hold pool threads) */
+  threads?: number;
+}
+
+export interface EncodedTile {
+  /** DZI level: 0 is 1x1, the highest is full size */
+  level: number;
+  column: number;
+  row: number;
+  width: number;
+  height: number;
+  /** JPEG or PNG file */
+  data: Uint8Array;
+}
+
+export interface TileSet {
+  width: number;
+  height: number;
+  tileSize: number;
+  overlap: number;
+  format: 'jpeg' | 'png';
+  levels: number;
+  /** Number of tiles */
+  tiles: number;
+  /** Content of the .dzi file */
+  descriptor: string;
+}
+
+/** Settings the last render picked for timeBudgetMs */
+export interface BudgetChoices {
+  timeBudgetMs: number;
+  /** Predicted processing and output time */
+  predictedMs: number;
+  halfSize: boolean;
+  userQual: number;
+  dcbIterations: number;
+  fbddNoiserd: number;
+  /** Output size divider relative to the full size (2 for half size) */
+  downscale: number;
+}
+
+export interface ProgressiveOptions extends LibRawOptions {
+  /** First pass: a half-size render (default) or the embedded thumbnail */
+  preview?: 'half' | 'thumb';
+}
+
+/** First result of renderProgressive() */
+export interface ProgressivePreview {
+  source: 'half' | 'thumb';
+  /** 'jpeg' for a JPEG thumbnail, else raw pixels */
+  format: 'bitmap' | 'jpeg';
+  width: number;
+  height: number;
+  /** Bitmaps only */
+  colors?: number;
+  bits?: number;
+  data: Uint8Array | Uint16Array;
+}
+
+export interface StreamRowsOptions {
+  /** Rows per band (default 256) */
+  rows?: number;
+}
+
+/** Horizontal band of the output, from streamRows() */
+export interface RowBand {
+  /** First row of the band */
+  y: number;
+  width: number;
+  height: number;
+  colors: number;
+  bits: number;
+  data: Uint8Array | Uint16Array;
+}
+
+export interface StreamedImage {
+  width: number;
+  height: number;
+  colors: number;
+  bits: number;
+  bands: number;
+}
+
+export interface BinnedPreviewOptions {
+  /** CFA cells (2x2 Bayer, 3x3 X-Trans) per output pixel side (default 1) */
+  factor?: number;
+}
+
+/** Window rendered by renderRegion() */
+export interface RegionImageData extends RawImageData {
+  /** Position of the window in the oriented full-size image (clamped) */
+  x: number;
+  y: number;
+}
+
 export interface ThumbnailImageData {
   data: Uint8Array; 
   width: number; 
@@ -90,10 +277,167 @@ export interface ThumbnailImageData {
   format: 'jpeg' | 'bitmap' | 'unknown' 
 }
 
+export type BatchOutput = 'metadata' | 'thumb' | 'image';
+
+export interface BatchOptions {
+  /** What to extract for every file (default: metadata and image) */
+  outputs?: BatchOutput[];
+  fullMetadata?: boolean;
+}
+
+export interface BatchResult {
+  /** Position of the file in the input list */
+  index: number;
+  metadata?: unknown;
+  thumb?: ThumbnailImageData;
+  image?: RawImageData;
+  error?: string;
+}
+
+export interface BatchSummary {
+  processed: number;
+  failed: number;
+}
+
+export interface HeapSummary {
+  /** Current size of the worker's WASM heap, in bytes (it never shrinks) */
+  heapSize: number;
+  /** Size the heap may grow to, in bytes */
+  heapMax: number;
+}
+
+export interface HeapStats extends HeapSummary {
+  /** Bytes currently allocated by malloc */
+  allocated: number;
+  /** Bytes of the heap malloc holds but has not handed out */
+  free: number;
+  /** Allocation high-water mark, sampled at each memoryStats() call */
+  peakAllocated: number;
+  /** Bytes of large LibRaw blocks kept for reuse (included in `allocated`) */
+  pooled: number;
+  pooledBlocks: number;
+  /** Byte budget of the pool, see configurePool() */
+  poolMax: number;
+  /** Allocations served from the pool so far */
+  poolReuses: number;
+}
+
+export interface MemoryStats extends HeapStats {
+  /** Largest heap seen, across recycled workers */
+  peakHeapSize: number;
+  /** Number of times the worker was recycled */
+  recycles: number;
+}
+
+/** Bytes needed by a render, see estimateMemory() */
+export interface MemoryEstimate {
+  /** Copy of the file kept by open() */
+  input: number;
+  /** Unpacked raw data */
+  raw: number;
+  /** 4-channel working image(s) */
+  image: number;
+  /** Largest temporary buffer (demosaic, denoise, rotation) */
+  scratch: number;
+  /** Rendered bitmap */
+  output: number;
+  /** Heap to budget for the whole render */
+  peak: number;
+  /** Current memoryLimitMB */
+  limitMB: number;
+}
+
+export interface LibRawConstructorOptions {
+  /** Replace the worker once its heap exceeds this many bytes (0 = never) */
+  recycleHeapAbove?: number;
+}
+
+export interface PoolProcessOptions extends BatchOptions {
+  settings?: LibRawOptions;
+  /** Files being decoded plus results not yet consumed (default: 2 per worker) */
+  maxInFlight?: number;
+  /** Bytes of inputs in flight plus unconsumed results (default: 512 MB) */
+  maxBytesInFlight?: number;
+  /** Heap a worker must have left to be given a new file (default: 256 MB) */
+  minHeapHeadroom?: number;
+}
+
+export type PoolInput = Uint8Array | ArrayBuffer | ArrayBufferView | Blob;
+
+export declare class LibRawPool {
+  constructor(options?: { size?: number; recycleHeapAbove?: number });
+  process(files: Iterable<PoolInput> | AsyncIterable<PoolInput>, options?: PoolProcessOptions): AsyncGenerator<BatchResult>;
+  close(): Promise<void>;
+}
+
+export interface CacheStats {
+  entries: number;
+  bytes: number;
+  maxBytes: number;
+  hits: number;
+  misses: number;
+}
+
+export type Priority = 'high' | 'normal' | 'low';
+
 declare class LibRaw {
+  constructor(options?: LibRawConstructorOptions);
+  /**
+   * Queue priority of this session's calls. null (default): metadata and
+   * thumbnails are 'high', imageData/processBatch 'low', the rest 'normal'.
+   */
+  priority: Priority | null;
+  /** Enables/resizes the worker's result cache; 0 disables it */
+  configureCache(options: { maxBytes: number }): Promise<CacheStats>;
+  cacheStats(): Promise<CacheStats>;
+  /** Persists previews/metadata in an OPFS directory; null disables it */
+  configurePersistentCache(options?: { directory?: string } | null): Promise<void>;
+  clearPersistentCache(): Promise<void>;
+  /** Budget of the worker's pool of large LibRaw blocks; 0 empties it */
+  configurePool(options: { maxBytes: number }): Promise<HeapStats>;
+  /** Last heap size/limit reported by this session's worker */
+  readonly heap: HeapSummary | null;
+  memoryStats(options?: { resetPeak?: boolean }): Promise<MemoryStats>;
+  /** Replaces the worker by a fresh one now; opened images are lost */
+  recycle(): void;
+  /** Creates another independent session in the same worker/WASM module */
+  createSession(): Promise<LibRaw>;
+  /** Frees this session; closing the first session terminates the worker */
+  close(): Promise<void>;
   open(data: Uint8Array, options?: LibRawOptions): Promise<void>;
+  /** Pre-flight estimate for a render of the opened file with `options` */
+  estimateMemory(options?: LibRawOptions): Promise<MemoryEstimate>;
   metadata(fullOutput?: boolean): Promise<unknown>;
   imageData(): Promise<RawImageData>;
+  /** What the last render chose for timeBudgetMs (undefined without a budget) */
+  budgetChoices(): Promise<BudgetChoices | undefined>;
+  /** Sends a quick preview to `onPreview`, then resolves with the full-quality render */
+  renderProgressive(settings?: ProgressiveOptions, handlers?: { onPreview?: (preview: ProgressivePreview) => void }): Promise<RawImageData>;
+  /** Renders the image and passes its rows to `onBand`, one band of `rows` rows at a time */
+  streamRows(options: StreamRowsOptions | undefined, handlers: { onBand: (band: RowBand) => void }): Promise<StreamedImage>;
+  /** Renders the image and cuts it into mip levels of tiles for deep-zoom viewers */
+  pyramid(options?: PyramidOptions): Promise<Pyramid>;
+  /** Renders the image and encodes it in the worker; only the file bytes are transferred */
+  encode(options?: EncodeOptions): Promise<EncodedImage>;
+  /** Renders a Deep Zoom tile set, encoded in the worker; tiles are streamed to `onTile` */
+  exportTiles(options: TileExportOptions | undefined, handlers: { onTile: (tile: EncodedTile) => void }): Promise<TileSet>;
+  /** Resolves with every encoded tile */
+  exportTiles(options?: TileExportOptions): Promise<TileSet & { tiles: EncodedTile[] }>;
+  /**
+   * Renders only the (x, y, width, height) window of the oriented full-size
+   * image, `scale` (0..1] times smaller. Needs the raw data: not available
+   * with streamingRelease.
+   */
+  renderRegion(x: number, y: number, width: number, height: number, scale?: number): Promise<RegionImageData>;
+  /**
+   * Culling preview binned straight from the raw mosaic (Bayer, X-Trans): no
+   * demosaic, 1/2 (Bayer) or 1/3 (X-Trans) of the full size divided by `factor`
+   */
+  binnedPreview(options?: BinnedPreviewOptions): Promise<RawImageData>;
   thumbnailData(): Promise<ThumbnailImageData | undefined>;
+  /** Processes every file inside the worker; resolves with all results in input order */
+  processBatch(files: Uint8Array[], options?: LibRawOptions, batch?: BatchOptions): Promise<BatchResult[]>;
+  /** Streams each result to `onResult` as soon as it is ready */
+  processBatch(files: Uint8Array[], options: LibRawOptions | undefined, batch: BatchOptions & { onResult: (result: BatchResult) => void }): Promise<BatchSummary>;
 }
 export default LibRaw;
@@ -1,33 +1,301 @@
-export default class LibRaw {
-	constructor() {
+import { formatMetadata } from './utils.js';
+
+export { default as LibRawPool } from './pool.js';
+
+const TRANSFERABLE_TYPES = [ArrayBuffer, Uint8Array, Int8Array, Uint16Array, Int16Array, Uint32Array, Int32Array, Float32Array, Float64Array];
+
+function transferableOf(a) {
+	if(TRANSFERABLE_TYPES.some(b=>a instanceof b)) { // Transfer buffer
+		return a instanceof ArrayBuffer ? a : a.buffer;
+	}
+}
+
+// Transfer typed-array arguments, including the ones inside array arguments
+function transferablesOf(args) {
+	const buffers = args.flatMap(a=>Array.isArray(a) ? a.map(transferableOf) : [transferableOf(a)]).filter(a=>a);
+	return [...new Set(buffers)];
+}
+
+// Calls after which a session holds decoded state the caller may still use,
+// and calls that discard that state (making the worker safe to recycle)
+const STATEFUL_CALLS = ['open'];
+const STATE_RESETTING_CALLS = ['open', 'processBatch'];
+
+/**
+ * One Web Worker (one WASM module) and the requests in flight to it. Shared by
+ * every session created from the same LibRaw instance.
+ */
+class WorkerClient {
+	constructor({recycleHeapAbove = 0} = {}) {
+		this.pending = new Map();
+		this.nextId = 0;
+		this.heap = null; // last heap figures reported by the worker
+		this.peakHeapSize = 0;
+		this.recycles = 0;
+		// Heap size after which the worker is replaced by a fresh one, as soon as
+		// no session holds state that would be lost (0 = never)
+		this.recycleHeapAbove = recycleHeapAbove;
+		this.sessions = new Map([[0, {stateful: false}]]);
+		this.config = new Map(); // worker-level settings replayed after a recycle
+		this.spawn();
+	}
+
+	spawn() {
 		this.worker = new Worker(new URL('./worker.js', import.meta.url), {type:"module"});
-		this.waitForWorker = false;
 		this.worker.onmessage = ({data}) => {
-			if(this.waitForWorker) {
-				let {"return": ret, "throw": thr} = this.waitForWorker;
-				this.waitForWorker = false;
-				if(data?.error) {
-					thr(data.error);
-				} else {
-					ret(data?.out);
-				}
+			if(data?.heap) {
+				this.heap = data.heap;
+				this.peakHeapSize = Math.max(this.peakHeapSize, data.heap.heapSize);
+			}
+			const request = this.pending.get(data?.id);
+			if(!request) {
+				return;
+			}
+			if(data.partial) {
+				request.onPartial?.(data.partial);
+				return;
+			}
+			this.pending.delete(data.id);
+			if(data.error) {
+				request.reject(new Error(data.error));
+			} else {
+				request.resolve(data.out);
 			}
+			this.maybeRecycle();
 		};
 	}
-	
-	async runFn(fn, ...args) {
-		let prom = new Promise((res, err)=>{
-			this.waitForWorker = {
-				error: err,
-				return: res,
-			};
+
+	call(session, fn, args, {onPartial, priority} = {}) {
+		const state = this.sessions.get(session);
+		if (state && STATE_RESETTING_CALLS.includes(fn)) {
+			state.stateful = false;
+			this.maybeRecycle();
+		}
+		if (state && STATEFUL_CALLS.includes(fn)) {
+			state.stateful = true;
+		}
+		const id = this.nextId++;
+		let prom = new Promise((resolve, reject)=>{
+			this.pending.set(id, {resolve, reject, onPartial});
 		});
-		this.worker.postMessage({fn, args}, args.map(a=>{
-			if([ArrayBuffer, Uint8Array, Int8Array, Uint16Array, Int16Array, Uint32Array, Int32Array, Float32Array, Float64Array].some(b=>a instanceof b)) { // Transfer buffer
-				return a.buffer;
+		this.worker.postMessage({id, session, fn, args, priority}, transferablesOf(args));
+		return prom;
+	}
+
+	// Send a worker-level setting now and again to every recycled worker
+	configure(fn, args) {
+		this.config.set(fn, args);
+		return this.call(0, fn, args);
+	}
+
+	async createSession() {
+		const session = await this.call(0, 'createSession', []);
+		this.sessions.set(session, {stateful: false});
+		return session;
+	}
+
+	async deleteSession(session) {
+		this.sessions.delete(session);
+		await this.call(0, 'deleteSession', [session]);
+	}
+
+	maybeRecycle() {
+		if (!this.recycleHeapAbove || !this.heap || this.pending.size) {
+			return;
+		}
+		if (this.heap.heapSize <= this.recycleHeapAbove) {
+			return;
+		}
+		if ([...this.sessions.values()].some(s => s.stateful)) {
+			return;
+		}
+		this.recycle();
+	}
+
+	/**
+	 * Replace the worker by a fresh one (new, small heap). Sessions keep their
+	 * ids; their opened files, if any, are lost.
+	 */
+	recycle() {
+		this.terminate();
+		this.heap = null;
+		this.recycles++;
+		this.spawn();
+		const ids = [...this.sessions.keys()].filter(id => id !== 0);
+		if (ids.length) {
+			this.call(0, 'restoreSessions', [ids]);
+		}
+		for (const [fn, args] of this.config) {
+			this.call(0, fn, args);
+		}
+		for (const state of this.sessions.values()) {
+			state.stateful = false;
+		}
+	}
+
+	terminate() {
+		this.worker.terminate();
+		for (const {reject} of this.pending.values()) {
+			reject(new Error('LibRaw: worker terminated'));
+		}
+		this.pending.clear();
+	}
+}
+
+// Interactive calls go ahead of full renders unless `priority` is set
+const DEFAULT_PRIORITIES = {
+	metadata: 'high',
+	thumbnailData: 'high',
+	renderRegion: 'high',
+	binnedPreview: 'high',
+	budgetChoices: 'high',
+	imageData: 'low',
+	renderProgressive: 'normal',
+	streamRows: 'low',
+	pyramid: 'low',
+	exportTiles: 'low',
+	encode: 'low',
+	processBatch: 'low',
+};
+
+export default class LibRaw {
+	/**
+	 * `recycleHeapAbove`: once the worker's heap has grown past this many bytes,
+	 * it is transparently replaced by a fresh worker at the next point where no
+	 * opened image would be lost (after a job, or before the next open()).
+	 */
+	constructor({recycleHeapAbove = 0} = {}, client = null, session = 0) {
+		this.client = client || new WorkerClient({recycleHeapAbove});
+		this.session = session;
+		/**
+		 * Priority of this session's calls in the worker queue: 'high', 'normal'
+		 * or 'low'. When null, metadata/thumbnails are 'high', renders are 'low'
+		 * and everything else 'normal'. Lower priority renders yield to higher
+		 * priority work at LibRaw processing stage boundaries.
+		 */
+		this.priority = null;
+	}
+
+	/**
+	 * Create another independent session in the same worker/WASM module.
+	 * Sessions share one heap and one compiled module, and decode concurrently
+	 * on their own pthreads.
+	 */
+	async createSession() {
+		const session = await this.client.createSession();
+		return new LibRaw({}, this.client, session);
+	}
+
+	/**
+	 * Free this session. Closing the first session terminates the worker, and
+	 * with it every session created from it.
+	 */
+	async close() {
+		if (this.session === 0) {
+			this.client.terminate();
+		} else {
+			await this.client.deleteSession(this.session);
+		}
+	}
+
+	/**
+	 * Enable/resize the worker's result cache (shared by all its sessions).
+	 * Metadata, thumbnails and rendered images are cached under `maxBytes`,
+	 * keyed by an xxHash64 of the file content plus the canonicalized settings;
+	 * concurrent identical requests are coalesced into one decode. 0 disables it.
+	 */
+	async configureCache({maxBytes}) {
+		return await this.client.configure('configureCache', [{maxBytes}]);
+	}
+
+	/**
+	 * Enable a persistent tier for previews and metadata, kept in the Origin
+	 * Private File System directory `directory` (default 'libraw-previews').
+	 * Entries are keyed by the camera's RawDataUniqueID/ImageUniqueID when the
+	 * file has one, by its content hash otherwise. Pass null to disable it.
+	 */
+	async configurePersistentCache(options = {}) {
+		return await this.client.configure('configurePersistentCache', [options]);
+	}
+
+	/**
+	 * Remove every entry of the persistent cache
+	 */
+	async clearPersistentCache() {
+		return await this.client.call(0, 'clearPersistentCache', []);
+	}
+
+	/**
+	 * Entries, bytes, hits and misses of the worker's result cache
+	 */
+	async cacheStats() {
+		return await this.client.call(0, 'cacheStats', []);
+	}
+
+	/**
+	 * Byte budget of the worker's pool of large LibRaw blocks (raw data,
+	 * working image...), kept after each file for the next one instead of
+	 * fragmenting the heap. Default 256 MB; 0 releases every pooled block.
+	 */
+	async configurePool({maxBytes}) {
+		return await this.client.configure('configurePool', [{maxBytes}]);
+	}
+
+	/**
+	 * Last WASM heap size/limit reported by this session's worker, or null
+	 */
+	get heap() {
+		return this.client.heap;
+	}
+
+	/**
+	 * Fresh heap figures of the worker: current heap size and limit, bytes
+	 * allocated/free in it, allocation high-water mark, plus the largest heap
+	 * seen across recycled workers and how many recycles happened.
+	 * `resetPeak` restarts the allocation high-water mark.
+	 */
+	async memoryStats({resetPeak = false} = {}) {
+		const heap = await this.client.call(0, resetPeak ? 'resetHeapPeak' : 'heapStats', []);
+		return {...heap, peakHeapSize: this.client.peakHeapSize, recycles: this.client.recycles};
+	}
+
+	/**
+	 * Replace the worker by a fresh one right away, releasing its heap. Opened
+	 * images of every session of the worker are lost.
+	 */
+	recycle() {
+		this.client.recycle();
+	}
+
+	priorityOf(fn) {
+		return this.priority ?? DEFAULT_PRIORITIES[fn] ?? 'normal';
+	}
+
+	async runFn(fn, ...args) {
+		return await this.client.call(this.session, fn, args, {priority: this.priorityOf(fn)});
+	}
+
+	/**
+	 * Process a whole list of files inside the worker in a single call.
+	 * `outputs` picks what is extracted per file ('metadata', 'thumb', 'image').
+	 * Results are passed to `onResult(result)` as each file finishes; without
+	 * `onResult` they are collected and returned in input order. File buffers
+	 * are transferred to the worker.
+	 */
+	async processBatch(files, settings, {outputs = ['metadata', 'image'], fullMetadata = false, onResult} = {}) {
+		const results = [];
+		const onPartial = result=>{
+			if (result.metadata) {
+				formatMetadata(result.metadata);
 			}
-		}).filter(a=>a));
-		return await prom;
+			if (onResult) {
+				onResult(result);
+			} else {
+				results[result.index] = result;
+			}
+		};
+		const summary = await this.client.call(this.session, 'processBatch', [files, settings, {outputs, fullMetadata}], {onPartial, priority: this.priorityOf('processBatch')});
+		return onResult ? summary : results;
 	}
 	/**
 	 * Open/parse the RAW data with optional settings
@@ -36,41 +304,102 @@ export default class LibRaw {
 		return await this.runFn('open', buffer, settings);
 	}
 
+	/**
+	 * Estimate the heap, in bytes, a render of the opened file needs with
+	 * `settings` applied on top of the current ones. Nothing is decoded.
+	 */
+	async estimateMemory(settings) {
+		return await this.runFn('estimateMemory', settings ?? null);
+	}
+
 	/**
 	 * Retrieve metadata
 	 */
 	async metadata(fullOutput) {
-		let metadata = await this.runFn('metadata', !!fullOutput);
-		// Example: convert numeric thumb_format to a string
-		if (metadata?.hasOwnProperty('thumb_format')) {
-			metadata.thumb_format = [
-				'unknown',
-				'jpeg',
-				'bitmap',
-				'bitmap16',
-				'layer',
-				'rollei',
-				'h265'
-			][metadata.thumb_format] || 'unknown';
-		}
-		// Trim desc if present
-		if (metadata?.hasOwnProperty('desc')) {
-			metadata.desc = String(metadata.desc).trim();
-		}
-		if (metadata?.hasOwnProperty('timestamp')) {
-			metadata.timestamp = new Date(metadata.timestamp);
-		}
-		return metadata;
+		return formatMetadata(await this.runFn('metadata', !!fullOutput));
 	}
 
 	/**
-	 * Retrieve processed image data (synchronously from the perspective of C++,
-	 * but we've already awaited the module & instance.)
+	 * Retrieve processed image data (decoded on a pthread inside the worker, so
+	 * other sessions of the same worker are not blocked meanwhile)
 	 */
 	async imageData() {
 		return await this.runFn('imageData');
 	}
 
+	/**
+	 * Settings the last render chose to fit in timeBudgetMs, with its
+	 * predicted time (undefined without a budget)
+	 */
+	async budgetChoices() {
+		return await this.runFn('budgetChoices');
+	}
+
+	/**
+	 * Render twice from raw data unpacked once: a quick preview passed to
+	 * `onPreview` (half size, or the embedded thumbnail with {preview: 'thumb'}),
+	 * then the full-quality image this resolves with. `settings` apply on top
+	 * of the open() ones.
+	 */
+	async renderProgressive(settings, {onPreview} = {}) {
+		return await this.client.call(this.session, 'renderProgressive', [settings ?? null], {onPartial: onPreview, priority: this.priorityOf('renderProgressive')});
+	}
+
+	/**
+	 * Render the image and pass it to `onBand` in horizontal bands of `rows`
+	 * rows ({rows}), as they are converted, so the full bitmap never has to
+	 * be held at once. Resolves with the image's size once the last band went.
+	 */
+	async streamRows(options, {onBand}) {
+		return await this.client.call(this.session, 'streamRows', [options ?? null], {onPartial: onBand, priority: this.priorityOf('streamRows')});
+	}
+
+	/**
+	 * Render the image and cut it into mip levels of tiles for deep-zoom
+	 * viewers ({levels, tileSize}); tile buffers are transferred, not copied
+	 */
+	async pyramid(options) {
+		return await this.runFn('pyramid', options ?? null);
+	}
+
+	/**
+	 * Render the image and encode it inside the worker ({format: 'jpeg',
+	 * quality, progressive, optimize} or {format: 'png'|'tiff', compression,
+	 * threads}); only the file bytes are transferred
+	 */
+	async encode(options) {
+		return await this.runFn('encode', options ?? null);
+	}
+
+	/**
+	 * Render the image as a Deep Zoom tile set encoded inside the worker
+	 * ({format: 'jpeg'|'png', quality, tileSize, overlap, threads}). Tiles are
+	 * passed to `onTile` as each is encoded; without it they are collected in
+	 * `tiles`. Resolves with the set's description, including the .dzi XML.
+	 */
+	async exportTiles(options, {onTile} = {}) {
+		const tiles = [];
+		const onPartial = tile => onTile ? onTile(tile) : tiles.push(tile);
+		const info = await this.client.call(this.session, 'exportTiles', [options ?? null], {onPartial, priority: this.priorityOf('exportTiles')});
+		return onTile ? info : {...info, tiles};
+	}
+
+	/**
+	 * Render the (x, y, width, height) window of the oriented full-size image,
+	 * `scale` times smaller, from the raw data kept since the first render
+	 */
+	async renderRegion(x, y, width, height, scale = 1) {
+		return await this.runFn('renderRegion', x, y, width, height, scale);
+	}
+
+	/**
+	 * Fast culling preview binned straight from the raw mosaic: one pixel per
+	 * 2x2 Bayer / 3x3 X-Trans cell, or per `factor` x `factor` cells ({factor})
+	 */
+	async binnedPreview(options) {
+		return await this.runFn('binnedPreview', options ?? null);
+	}
+
 	/**
      * Retrieve the embedded JPEG preview (Fast extraction)
      */
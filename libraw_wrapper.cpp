@@ -1,697 +1,2193 @@
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 #include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <functional>
 
 // Emscripten Embind
+#include <emscripten/emscripten.h>
 #include <emscripten/bind.h>
+#include <emscripten/heap.h>
+#include <emscripten/proxying.h>
+#include <emscripten/threading.h>
+
+#ifdef LIBRAW_WASM_MIMALLOC
+// mimalloc has no mallinfo(); its committed bytes stand in for "allocated"
+extern "C" void mi_process_info(size_t* elapsed_msecs, size_t* user_msecs, size_t* system_msecs,
+	size_t* current_rss, size_t* peak_rss, size_t* current_commit, size_t* peak_commit, size_t* page_faults);
+#else
+#include <malloc.h>
+#endif
 
 // LibRaw includes
 #include "libraw/libraw.h"
 
+// Encoders (-s USE_LIBJPEG=1 -s USE_ZLIB=1)
+#include <csetjmp>
+#include <jpeglib.h>
+#include <zlib.h>
+
 using namespace emscripten;
 
-class WASMLibRaw {
-public:
-	WASMLibRaw() {
-		processor_ = new LibRaw();
+// High-water mark of allocated heap bytes, sampled whenever heapStats() is
+// queried. mallinfo() walks the whole heap under malloc's lock, so it is kept
+// off the hot paths (replies, stage boundaries), which use heapSummary()
+static std::atomic<size_t> peakAllocated{0};
+
+static void notePeakAllocated(size_t used) {
+	size_t peak = peakAllocated.load();
+	while (used > peak && !peakAllocated.compare_exchange_weak(peak, used)) {
 	}
+}
 
-	~WASMLibRaw() {
-		if (processor_) {
-			cleanupParamsStrings();
-            processor_->recycle();
-			delete processor_;
-			processor_ = nullptr;
-		}
+// Bytes handed out by malloc, and bytes it holds without handing them out
+static void heapUsage(size_t& allocated, size_t& free) {
+#ifdef LIBRAW_WASM_MIMALLOC
+	size_t elapsed, user, system, rss, peakRss, commit, peakCommit, faults;
+	mi_process_info(&elapsed, &user, &system, &rss, &peakRss, &commit, &peakCommit, &faults);
+	allocated = commit;
+	free = 0;
+#else
+	const struct mallinfo info = mallinfo();
+	allocated = info.uordblks;
+	free = info.fordblks;
+#endif
+}
+
+// xxHash64 (https://github.com/Cyan4973/xxHash), used to content-address the
+// opened file for result caching. WASM is little-endian, so lanes are read as is.
+namespace xxh64 {
+	static const uint64_t P1 = 11400714785074694791ULL;
+	static const uint64_t P2 = 14029467366897019727ULL;
+	static const uint64_t P3 = 1609587929392839161ULL;
+	static const uint64_t P4 = 9650029242287828579ULL;
+	static const uint64_t P5 = 2870177450012600261ULL;
+
+	static inline uint64_t rotl(uint64_t x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+	static inline uint64_t read64(const uint8_t* p) {
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	static inline uint32_t read32(const uint8_t* p) {
+		uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+	static inline uint64_t round(uint64_t acc, uint64_t input) {
+		acc += input * P2;
+		acc = rotl(acc, 31);
+		return acc * P1;
+	}
+	static inline uint64_t mergeRound(uint64_t acc, uint64_t v) {
+		acc ^= round(0, v);
+		return acc * P1 + P4;
 	}
 
-	void open(val jsBuffer, val settings) {
-		if (!processor_) {
-			throw std::runtime_error("LibRaw not initialized");
+	static uint64_t hash(const uint8_t* p, size_t len, uint64_t seed = 0) {
+		const uint8_t* end = p + len;
+		uint64_t h;
+		if (len >= 32) {
+			const uint8_t* limit = end - 32;
+			uint64_t v1 = seed + P1 + P2;
+			uint64_t v2 = seed + P2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - P1;
+			do {
+				v1 = round(v1, read64(p));
+				v2 = round(v2, read64(p + 8));
+				v3 = round(v3, read64(p + 16));
+				v4 = round(v4, read64(p + 24));
+				p += 32;
+			} while (p <= limit);
+			h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+			h = mergeRound(h, v1);
+			h = mergeRound(h, v2);
+			h = mergeRound(h, v3);
+			h = mergeRound(h, v4);
+		} else {
+			h = seed + P5;
 		}
-        // Release previous values, if any
-        processor_->recycle();
+		h += (uint64_t)len;
+		for (; p + 8 <= end; p += 8) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * P1 + P4;
+		}
+		if (p + 4 <= end) {
+			h ^= (uint64_t)read32(p) * P1;
+			h = rotl(h, 23) * P2 + P3;
+			p += 4;
+		}
+		for (; p < end; p++) {
+			h ^= (*p) * P5;
+			h = rotl(h, 11) * P1;
+		}
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+}
 
-		applySettings(settings);
+// Area-average downscale of an interleaved 8 or 16-bit image: each output
+// pixel is the mean of the source area it covers, source pixels on its edges
+// weighted by their coverage. Rows are accumulated in floats, so the inner
+// loops vectorize (-msimd128).
+template <typename T>
+static void areaResample(const T* src, int srcWidth, int srcHeight, size_t srcRowLength,
+		T* dst, int dstWidth, int dstHeight, int channels) {
+	// Source pixels, and their weights, contributing to each output column/row
+	struct Axis {
+		std::vector<int> first, count, offset;
+		std::vector<float> weights;
 
-        buffer = toNativeVector(jsBuffer);
-		int ret = processor_->open_buffer((void*)buffer.data(), buffer.size());
-		if (ret != LIBRAW_SUCCESS) {
-			throw std::runtime_error("LibRaw: open_buffer() failed with code " + std::to_string(ret));
+		Axis(int srcSize, int dstSize) : first(dstSize), count(dstSize), offset(dstSize) {
+			const double scale = double(srcSize) / dstSize;
+			for (int i = 0; i < dstSize; i++) {
+				const double start = i * scale, end = std::min<double>(srcSize, (i + 1) * scale);
+				first[i] = int(start);
+				count[i] = std::max(1, std::min(srcSize, int(std::ceil(end))) - first[i]);
+				offset[i] = weights.size();
+				for (int s = first[i]; s < first[i] + count[i]; s++) {
+					const double coverage = std::min<double>(s + 1, end) - std::max<double>(s, start);
+					weights.push_back(float(coverage / (end - start)));
+				}
+			}
 		}
-	}
+	};
+	const Axis columns(srcWidth, dstWidth), rows(srcHeight, dstHeight);
+	const float maxValue = float((1u << (8 * sizeof(T))) - 1);
+	std::vector<float> resampledRow(size_t(dstWidth) * channels), sum(size_t(dstWidth) * channels);
 
-	val metadata(bool fullOutput=false) {
-		if (!processor_) {
-			return val::undefined();
+	for (int y = 0; y < dstHeight; y++) {
+		std::fill(sum.begin(), sum.end(), 0.0f);
+		for (int i = 0; i < rows.count[y]; i++) {
+			const T* in = src + size_t(rows.first[y] + i) * srcRowLength;
+			for (int x = 0; x < dstWidth; x++) {
+				float* out = &resampledRow[size_t(x) * channels];
+				for (int c = 0; c < channels; c++) {
+					out[c] = 0.0f;
+				}
+				const float* weight = &columns.weights[columns.offset[x]];
+				const T* pix = in + size_t(columns.first[x]) * channels;
+				for (int j = 0; j < columns.count[x]; j++, pix += channels) {
+					for (int c = 0; c < channels; c++) {
+						out[c] += weight[j] * pix[c];
+					}
+				}
+			}
+			const float weight = rows.weights[rows.offset[y] + i];
+			for (size_t k = 0; k < sum.size(); k++) {
+				sum[k] += weight * resampledRow[k];
+			}
 		}
+		T* out = dst + size_t(y) * dstWidth * channels;
+		for (size_t k = 0; k < sum.size(); k++) {
+			out[k] = T(std::min(maxValue, sum[k] + 0.5f));
+		}
+	}
+}
 
-		val meta = val::object();
-		// --------------------------------------------------------------------
-		// 1) Basic fields: sizes, camera info, etc.
-		// --------------------------------------------------------------------
-		unsigned orientedWidth  = processor_->imgdata.sizes.width;
-		unsigned orientedHeight = processor_->imgdata.sizes.height;
-		int flipCode = processor_->imgdata.sizes.flip;  // 0..7
-		if (flipCode == 5 || flipCode == 6 || flipCode == 7) {// rotations of 90/270:
-			std::swap(orientedWidth, orientedHeight);
+// 2x2 box downscale to ((width + 1) / 2, (height + 1) / 2), repeating the last
+// column/row of odd sizes
+template <typename T>
+static void boxHalve(const T* src, int width, int height, T* dst, int channels) {
+	const int dstWidth = (width + 1) / 2, dstHeight = (height + 1) / 2;
+	const size_t rowLength = size_t(width) * channels;
+	for (int y = 0; y < dstHeight; y++) {
+		const T* row0 = src + size_t(2 * y) * rowLength;
+		const T* row1 = 2 * y + 1 < height ? row0 + rowLength : row0;
+		T* out = dst + size_t(y) * dstWidth * channels;
+		for (int x = 0; x < width / 2; x++, row0 += 2 * channels, row1 += 2 * channels, out += channels) {
+			for (int c = 0; c < channels; c++) {
+				out[c] = T((unsigned(row0[c]) + row0[c + channels] + row1[c] + row1[c + channels] + 2) >> 2);
+			}
 		}
-		meta.set("width",       orientedWidth);
-		meta.set("height",      orientedHeight);
-		meta.set("raw_width",   processor_->imgdata.sizes.raw_width);
-		meta.set("raw_height",  processor_->imgdata.sizes.raw_height);
-		meta.set("top_margin",  processor_->imgdata.sizes.top_margin);
-		meta.set("left_margin", processor_->imgdata.sizes.left_margin);
+		if (width & 1) {
+			for (int c = 0; c < channels; c++) {
+				out[c] = T((unsigned(row0[c]) + row1[c] + 1) >> 1);
+			}
+		}
+	}
+}
 
-		// Basic camera info
-		meta.set("camera_make",  std::string(processor_->imgdata.idata.make));
-		meta.set("camera_model", std::string(processor_->imgdata.idata.model));
+//---------------------------------------------------------------------------
+// Image encoders, writing to memory. Input is interleaved 8 or 16-bit
+// gray/RGB rows `rowBytes` apart. JPEG goes through Emscripten's libjpeg port
+// and keeps the 8 high bits of 16-bit samples; its errors longjmp back out of
+// the library. PNG and TIFF are written here on top of zlib: their rows are
+// deflated in horizontal chunks that don't depend on each other, so large
+// (16-bit) images are compressed on several pthreads.
+//---------------------------------------------------------------------------
+enum class ImageFormat { JPEG, PNG, TIFF };
 
-		// EXIF-like data
-		meta.set("iso_speed",  processor_->imgdata.other.iso_speed);
-		meta.set("shutter",	processor_->imgdata.other.shutter);
-		meta.set("aperture",   processor_->imgdata.other.aperture);
-		meta.set("focal_len",  processor_->imgdata.other.focal_len);
-		meta.set("timestamp",  double(processor_->imgdata.other.timestamp));
-		meta.set("shot_order", processor_->imgdata.other.shot_order);
-		meta.set("desc",	   std::string(processor_->imgdata.other.desc));
-		meta.set("artist",	 std::string(processor_->imgdata.other.artist));
+static const char* formatName(ImageFormat format) {
+	return format == ImageFormat::PNG ? "png" : format == ImageFormat::TIFF ? "tiff" : "jpeg";
+}
 
-		// GPS data
-		val gpsData = val::object();
+struct EncodeOptions {
+	ImageFormat format = ImageFormat::JPEG;
+	int quality = 90;		// JPEG, 1..100
+	bool progressive = false;	// JPEG, progressive scans
+	bool optimize = false;		// JPEG, optimized Huffman tables (smaller, slower)
+	int compression = 6;	// PNG/TIFF zlib level, 0..9
+	int threads = 1;		// PNG/TIFF, pthreads compressing chunks (caller included)
+};
 
-		val latitudeArr = val::array();
-		for (int i = 0; i < 3; i++) {
-			latitudeArr.set(i, processor_->imgdata.other.parsed_gps.latitude[i]);
-		}
-		gpsData.set("latitude", latitudeArr);
+// Uncompressed bytes per PNG chunk / TIFF strip compressed on its own
+static const size_t ENCODE_CHUNK_BYTES = 256 << 10;
 
-		val longitudeArr = val::array();
-		for (int i = 0; i < 3; i++) {
-			longitudeArr.set(i, processor_->imgdata.other.parsed_gps.longitude[i]);
+// Pthreads the build preallocates (compileLibraw.sh, -s PTHREAD_POOL_SIZE).
+// Background jobs run on one of them; helpers beyond the pool would wait for
+// a new Worker to start, or never start while the pool is held.
+#ifndef LIBRAW_WASM_PTHREAD_POOL
+#define LIBRAW_WASM_PTHREAD_POOL 4
+#endif
+
+// Pool threads in use by every session of the module: running background
+// jobs, and the helpers they were granted
+static std::atomic<int> poolThreadsInUse{0};
+
+// Threads a background job asks for, itself included: `requested`, one per
+// core by default, within the pthread pool. Its helpers are then granted
+// from what other jobs leave (PoolThreads).
+static int jobThreads(int requested) {
+	return std::max(1, std::min(requested, LIBRAW_WASM_PTHREAD_POOL));
+}
+
+// Counts the calling background job's thread while in scope. Jobs always
+// run (there is one per busy session), so they may hold more than the pool.
+struct PoolJob {
+	PoolJob() { poolThreadsInUse++; }
+	~PoolJob() { poolThreadsInUse--; }
+};
+
+// Up to `wanted` helper threads, as many as the pool has free (maybe none),
+// held while in scope
+struct PoolThreads {
+	int count = 0;
+
+	explicit PoolThreads(int wanted) {
+		int inUse = poolThreadsInUse.load();
+		do {
+			count = std::max(0, std::min(wanted, LIBRAW_WASM_PTHREAD_POOL - inUse));
+		} while (count > 0 && !poolThreadsInUse.compare_exchange_weak(inUse, inUse + count));
+	}
+	~PoolThreads() { poolThreadsInUse -= count; }
+};
+
+// Calls fn(0) .. fn(count - 1) from up to `threads` threads, this one included
+template <typename Fn>
+static void parallelFor(int count, int threads, const Fn& fn) {
+	std::atomic<int> next{0};
+	auto work = [&]() {
+		for (int i; (i = next++) < count;) {
+			fn(i);
 		}
-		gpsData.set("longitude", longitudeArr);
-		gpsData.set("altitude", processor_->imgdata.other.parsed_gps.altitude);
-			
-		meta.set("gps_data", gpsData);
+	};
+	const PoolThreads granted(std::min(threads, count) - 1);
+	std::vector<std::thread> helpers;
+	for (int i = 0; i < granted.count; i++) {
+		helpers.emplace_back(work);
+	}
+	work();
+	for (std::thread& helper : helpers) {
+		helper.join();
+	}
+}
 
-		// Thumbnail info
-		meta.set("thumb_width",  processor_->imgdata.thumbnail.twidth);
-		meta.set("thumb_height", processor_->imgdata.thumbnail.theight);
-		// Cast enum to int so we don't need to register it
-		meta.set("thumb_format",
-				static_cast<int>(processor_->imgdata.thumbnail.tformat));
+// Deflate `size` bytes into `out`: a zlib stream (windowBits 15), or raw
+// deflate data (-15) that `flush` = Z_SYNC_FLUSH leaves open and byte
+// aligned, to be followed by the next chunk's data
+static bool deflateBuffer(const uint8_t* data, size_t size, int level, int windowBits, int flush,
+		std::vector<uint8_t>& out) {
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+	out.resize(deflateBound(&stream, size) + 16);	// + the sync flush marker
+	stream.next_in = const_cast<Bytef*>(data);
+	stream.avail_in = uInt(size);
+	stream.next_out = out.data();
+	stream.avail_out = uInt(out.size());
+	const int ret = deflate(&stream, flush);
+	const bool ok = flush == Z_FINISH ? ret == Z_STREAM_END : ret == Z_OK && stream.avail_out > 0;
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+	return ok;
+}
 
-		if(fullOutput) {
-			// --------------------------------------------------------------------
-			// 2) Color data (imgdata.color)
-			// --------------------------------------------------------------------
-			const libraw_colordata_t &c = processor_->imgdata.color;
-			val colorData = val::object();
-			
-			colorData.set("black",		 c.black);
-			colorData.set("data_maximum",  c.data_maximum);
-			colorData.set("maximum",	   c.maximum);
-			colorData.set("fmaximum",	  c.fmaximum);
-			colorData.set("fnorm",		 c.fnorm);
+static void putBE32(std::vector<uint8_t>& out, uint32_t value) {
+	const uint8_t bytes[4] = {uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value)};
+	out.insert(out.end(), bytes, bytes + 4);
+}
 
-			{
-				val camMulArr = val::array();
-				for (int i = 0; i < 4; i++) {
-					camMulArr.set(i, c.cam_mul[i]);
-				}
-				colorData.set("cam_mul", camMulArr);
-			}
-			{
-				val preMulArr = val::array();
-				for (int i = 0; i < 4; i++) {
-					preMulArr.set(i, c.pre_mul[i]);
-				}
-				colorData.set("pre_mul", preMulArr);
-			}
+static void putLE16(std::vector<uint8_t>& out, uint16_t value) {
+	out.push_back(uint8_t(value));
+	out.push_back(uint8_t(value >> 8));
+}
 
-			// c.rgb_cam[3][4], c.cam_xyz[4][3], etc. can also be copied if needed.
-			colorData.set("flash_used",   c.flash_used);
-			colorData.set("canon_ev",	 c.canon_ev);
-			colorData.set("model2",	   std::string(c.model2));
-			colorData.set("UniqueCameraModel", std::string(c.UniqueCameraModel));
-			colorData.set("LocalizedCameraModel",
-						std::string(c.LocalizedCameraModel));
-			colorData.set("ImageUniqueID",	  std::string(c.ImageUniqueID));
-			colorData.set("RawDataUniqueID",	std::string(c.RawDataUniqueID));
-			colorData.set("raw_bps",	 (int)c.raw_bps);
-			colorData.set("ExifColorSpace", c.ExifColorSpace);
-			// dng_color, dng_levels, etc. also here if needed
+static void putLE32(std::vector<uint8_t>& out, uint32_t value) {
+	putLE16(out, uint16_t(value));
+	putLE16(out, uint16_t(value >> 16));
+}
 
-			meta.set("color_data", colorData);
+struct JpegDestination {
+	jpeg_destination_mgr manager;
+	std::vector<uint8_t>* out;
+	JOCTET buffer[16384];
+};
 
-			// --------------------------------------------------------------------
-			// 3) Common metadata (imgdata.metadata)
-			// --------------------------------------------------------------------
-			const libraw_metadata_common_t &mcom = processor_->imgdata.makernotes.common;
-			val metaCommon = val::object();
+struct JpegErrorHandler {
+	jpeg_error_mgr manager;
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+};
 
-			metaCommon.set("FlashEC",				mcom.FlashEC);
-			metaCommon.set("FlashGN",				mcom.FlashGN);
-			metaCommon.set("CameraTemperature",	  mcom.CameraTemperature);
-			metaCommon.set("SensorTemperature",	  mcom.SensorTemperature);
-			metaCommon.set("SensorTemperature2",	 mcom.SensorTemperature2);
-			metaCommon.set("LensTemperature",		mcom.LensTemperature);
-			metaCommon.set("AmbientTemperature",	 mcom.AmbientTemperature);
-			metaCommon.set("BatteryTemperature",	 mcom.BatteryTemperature);
-			metaCommon.set("exifAmbientTemperature", mcom.exifAmbientTemperature);
-			metaCommon.set("exifHumidity",		   mcom.exifHumidity);
-			metaCommon.set("exifPressure",		   mcom.exifPressure);
-			metaCommon.set("exifWaterDepth",		 mcom.exifWaterDepth);
-			metaCommon.set("exifAcceleration",	   mcom.exifAcceleration);
-			metaCommon.set("exifCameraElevationAngle", mcom.exifCameraElevationAngle);
-			metaCommon.set("real_ISO", mcom.real_ISO);
-			metaCommon.set("exifExposureIndex", mcom.exifExposureIndex);
-			metaCommon.set("ColorSpace", (int)mcom.ColorSpace);
-			metaCommon.set("firmware",   std::string(mcom.firmware));
-			metaCommon.set("ExposureCalibrationShift", mcom.ExposureCalibrationShift);
+static void jpegInitDestination(j_compress_ptr cinfo) {
+	JpegDestination* dest = reinterpret_cast<JpegDestination*>(cinfo->dest);
+	dest->manager.next_output_byte = dest->buffer;
+	dest->manager.free_in_buffer = sizeof(dest->buffer);
+}
 
-			// AF info data
-			{
-				val afArray = val::array();
-				for (int i = 0; i < mcom.afcount; i++) {
-					val afItem = val::object();
-					const libraw_afinfo_item_t &afdata = mcom.afdata[i];
-					afItem.set("AFInfoData_tag",	 afdata.AFInfoData_tag);
-					afItem.set("AFInfoData_order",   afdata.AFInfoData_order);
-					afItem.set("AFInfoData_version", afdata.AFInfoData_version);
-					afItem.set("AFInfoData_length",  afdata.AFInfoData_length);
-					// afdata.AFInfoData is a raw pointer
-					// We skip showing contents unless you want to copy them.
-					afArray.set(i, afItem);
-				}
-				metaCommon.set("afdata", afArray);
+static boolean jpegEmptyBuffer(j_compress_ptr cinfo) {
+	JpegDestination* dest = reinterpret_cast<JpegDestination*>(cinfo->dest);
+	dest->out->insert(dest->out->end(), dest->buffer, dest->buffer + sizeof(dest->buffer));
+	dest->manager.next_output_byte = dest->buffer;
+	dest->manager.free_in_buffer = sizeof(dest->buffer);
+	return TRUE;
+}
+
+static void jpegTermDestination(j_compress_ptr cinfo) {
+	JpegDestination* dest = reinterpret_cast<JpegDestination*>(cinfo->dest);
+	dest->out->insert(dest->out->end(), dest->buffer, dest->buffer + (sizeof(dest->buffer) - dest->manager.free_in_buffer));
+}
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+	JpegErrorHandler* err = reinterpret_cast<JpegErrorHandler*>(cinfo->err);
+	(*cinfo->err->format_message)(cinfo, err->message);
+	longjmp(err->jump, 1);
+}
+
+static bool encodeJpeg(const uint8_t* pixels, int width, int height, size_t rowBytes, int colors, int bps,
+		const EncodeOptions& options, std::vector<uint8_t>& out, std::string& error) {
+	jpeg_compress_struct cinfo;
+	JpegErrorHandler err;
+	JpegDestination dest;
+	std::vector<JSAMPLE> row(bps == 16 ? size_t(width) * colors : 0);
+	out.clear();
+
+	cinfo.err = jpeg_std_error(&err.manager);
+	err.manager.error_exit = jpegErrorExit;
+	if (setjmp(err.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		error = std::string("JPEG: ") + err.message;
+		return false;
+	}
+	jpeg_create_compress(&cinfo);
+	dest.out = &out;
+	dest.manager.init_destination = jpegInitDestination;
+	dest.manager.empty_output_buffer = jpegEmptyBuffer;
+	dest.manager.term_destination = jpegTermDestination;
+	cinfo.dest = &dest.manager;
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = colors;
+	cinfo.in_color_space = colors == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, options.quality, TRUE);
+	cinfo.optimize_coding = options.optimize ? TRUE : FALSE;
+	if (options.progressive) {
+		jpeg_simple_progression(&cinfo);
+	}
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		const uint8_t* line = pixels + size_t(cinfo.next_scanline) * rowBytes;
+		JSAMPROW rowPointer;
+		if (bps == 16) {
+			const uint16_t* samples = reinterpret_cast<const uint16_t*>(line);
+			for (size_t i = 0; i < row.size(); i++) {
+				row[i] = samples[i] >> 8;
 			}
+			rowPointer = row.data();
+		} else {
+			rowPointer = const_cast<JSAMPROW>(line);
+		}
+		jpeg_write_scanlines(&cinfo, &rowPointer, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	return true;
+}
 
-			meta.set("metadata_common", metaCommon);
+// PNG chunk: length, type, data appended by the caller, then CRC
+static size_t pngBeginChunk(std::vector<uint8_t>& out, const char* type) {
+	putBE32(out, 0);
+	out.insert(out.end(), type, type + 4);
+	return out.size() - 8;
+}
 
-			// --------------------------------------------------------------------
-			// 4) MakerNotes for the brand (conditional)
-			//	We store them in a property named after the brand, e.g. `canon`,
-			//	`nikon`, `sony`, etc.
-			// --------------------------------------------------------------------
-			std::string makeStr(processor_->imgdata.idata.make);
-			std::string makeLower = makeStr;
-			std::transform(makeLower.begin(), makeLower.end(), makeLower.begin(), [](unsigned char c){ return std::tolower(c); });
+static void pngEndChunk(std::vector<uint8_t>& out, size_t start) {
+	const uint32_t length = uint32_t(out.size() - start - 8);
+	for (int i = 0; i < 4; i++) {
+		out[start + i] = uint8_t(length >> (24 - 8 * i));
+	}
+	putBE32(out, uint32_t(crc32(0, out.data() + start + 4, length + 4)));
+}
 
-			// ================ CANON ================
-			if (makeLower.find("canon") != std::string::npos)
-			{
-				val canonObj = val::object();
-				const libraw_canon_makernotes_t &cCanon =
-					processor_->imgdata.makernotes.canon;
+static inline uint8_t paeth(int a, int b, int c) {
+	const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+	return uint8_t(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
 
-				canonObj.set("ColorDataVer",		cCanon.ColorDataVer);
-				canonObj.set("ColorDataSubVer",	 cCanon.ColorDataSubVer);
-				canonObj.set("SpecularWhiteLevel",  cCanon.SpecularWhiteLevel);
-				canonObj.set("NormalWhiteLevel",	cCanon.NormalWhiteLevel);
+// Filter one row against the row above (`prior`, zeros for the first row) into
+// out[0] (filter type) and out[1..length]: the filter whose output has the
+// smallest sum of absolute (signed) values, libpng's default heuristic
+static void pngFilterRow(const uint8_t* row, const uint8_t* prior, size_t length, int bpp,
+		uint8_t* out, std::vector<uint8_t>& scratch) {
+	scratch.resize(4 * length);
+	uint8_t* filtered[5] = {const_cast<uint8_t*>(row), &scratch[0], &scratch[length], &scratch[2 * length], &scratch[3 * length]};
+	for (size_t i = 0; i < length; i++) {
+		const int a = i >= size_t(bpp) ? row[i - bpp] : 0, b = prior[i], c = i >= size_t(bpp) ? prior[i - bpp] : 0;
+		filtered[1][i] = uint8_t(row[i] - a);
+		filtered[2][i] = uint8_t(row[i] - b);
+		filtered[3][i] = uint8_t(row[i] - ((a + b) >> 1));
+		filtered[4][i] = uint8_t(row[i] - paeth(a, b, c));
+	}
+	int best = 0;
+	uint64_t bestSum = UINT64_MAX;
+	for (int type = 0; type < 5; type++) {
+		uint64_t sum = 0;
+		for (size_t i = 0; i < length; i++) {
+			const uint8_t v = filtered[type][i];
+			sum += v < 128 ? v : 256 - v;
+		}
+		if (sum < bestSum) {
+			best = type;
+			bestSum = sum;
+		}
+	}
+	out[0] = uint8_t(best);
+	std::memcpy(out + 1, filtered[best], length);
+}
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, cCanon.ChannelBlackLevel[i]);
-					}
-					canonObj.set("ChannelBlackLevel", arr);
-				}
-				canonObj.set("AverageBlackLevel", cCanon.AverageBlackLevel);
+static bool encodePng(const uint8_t* pixels, int width, int height, size_t rowBytes, int colors, int bps,
+		const EncodeOptions& options, std::vector<uint8_t>& out, std::string& error) {
+	out.clear();
+	if (width <= 0 || height <= 0) {
+		error = "PNG: empty image";
+		return false;
+	}
+	const int bpp = colors * bps / 8;
+	const size_t length = size_t(width) * bpp;
+	const int chunkRows = int(std::max<size_t>(1, ENCODE_CHUNK_BYTES / (length + 1)));
+	const int chunks = (height + chunkRows - 1) / chunkRows;
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, cCanon.multishot[i]);
-					}
-					canonObj.set("multishot", arr);
+	// Every chunk of rows is filtered and deflated on its own: filters only
+	// look at the unfiltered row above, and sync-flushed raw deflate data of
+	// consecutive chunks concatenates into one stream
+	std::vector<std::vector<uint8_t>> compressed(chunks);
+	std::vector<uLong> checksums(chunks);
+	std::atomic<bool> failed{false};
+	parallelFor(chunks, options.threads, [&](int chunk) {
+		const int y0 = chunk * chunkRows, y1 = std::min(height, y0 + chunkRows);
+		std::vector<uint8_t> filtered(size_t(y1 - y0) * (length + 1)), scratch;
+		std::vector<uint8_t> rows[2] = {std::vector<uint8_t>(length, 0), std::vector<uint8_t>(length)};
+		for (int y = y0 - 1; y < y1; y++) {
+			if (y < 0) {
+				continue;
+			}
+			// PNG samples are big-endian
+			std::vector<uint8_t>& row = rows[(y - y0 + 1) & 1];
+			const uint8_t* line = pixels + size_t(y) * rowBytes;
+			if (bps == 16) {
+				for (size_t i = 0; i < length; i += 2) {
+					row[i] = line[i + 1];
+					row[i + 1] = line[i];
 				}
+			} else {
+				std::memcpy(row.data(), line, length);
+			}
+			if (y < y0) {
+				continue;
+			}
+			uint8_t* dst = &filtered[size_t(y - y0) * (length + 1)];
+			if (options.compression == 0) {
+				dst[0] = 0;
+				std::memcpy(dst + 1, row.data(), length);
+			} else {
+				pngFilterRow(row.data(), rows[(y - y0) & 1].data(), length, bpp, dst, scratch);
+			}
+		}
+		checksums[chunk] = adler32(adler32(0, Z_NULL, 0), filtered.data(), uInt(filtered.size()));
+		if (!deflateBuffer(filtered.data(), filtered.size(), options.compression, -15,
+				chunk == chunks - 1 ? Z_FINISH : Z_SYNC_FLUSH, compressed[chunk])) {
+			failed = true;
+		}
+	});
+	if (failed) {
+		error = "PNG: deflate failed";
+		return false;
+	}
 
-				canonObj.set("MeteringMode",		  cCanon.MeteringMode);
-				canonObj.set("SpotMeteringMode",	  cCanon.SpotMeteringMode);
-				canonObj.set("FlashMeteringMode",	 (int)cCanon.FlashMeteringMode);
-				canonObj.set("FlashExposureLock",	 cCanon.FlashExposureLock);
-				canonObj.set("ExposureMode",		  cCanon.ExposureMode);
-				canonObj.set("AESetting",			 cCanon.AESetting);
-				canonObj.set("ImageStabilization",	cCanon.ImageStabilization);
-				canonObj.set("FlashMode",			 cCanon.FlashMode);
-				canonObj.set("FlashActivity",		 cCanon.FlashActivity);
-				canonObj.set("FlashBits",			 cCanon.FlashBits);
-				canonObj.set("ManualFlashOutput",	 cCanon.ManualFlashOutput);
-				canonObj.set("FlashOutput",		   cCanon.FlashOutput);
-				canonObj.set("FlashGuideNumber",	  cCanon.FlashGuideNumber);
-				canonObj.set("ContinuousDrive",	   cCanon.ContinuousDrive);
-				canonObj.set("SensorWidth",		   cCanon.SensorWidth);
-				canonObj.set("SensorHeight",		  cCanon.SensorHeight);
-				canonObj.set("AFMicroAdjMode",		cCanon.AFMicroAdjMode);
-				canonObj.set("AFMicroAdjValue",	   cCanon.AFMicroAdjValue);
-				canonObj.set("MakernotesFlip",		cCanon.MakernotesFlip);
-				canonObj.set("RecordMode",			cCanon.RecordMode);
-				canonObj.set("SRAWQuality",		   cCanon.SRAWQuality);
-				canonObj.set("wbi",				   (unsigned)cCanon.wbi);
-				canonObj.set("RF_lensID",			 cCanon.RF_lensID);
-				canonObj.set("AutoLightingOptimizer", cCanon.AutoLightingOptimizer);
-				canonObj.set("HighlightTonePriority", cCanon.HighlightTonePriority);
-				canonObj.set("Quality",			   cCanon.Quality);
-				canonObj.set("CanonLog",			  cCanon.CanonLog);
-
-				
-				{
-					val arr = val::array();
-					for (int i = 0; i < 2; i++) {
-						arr.set(i, cCanon.ISOgain[i]);
-					}
-					canonObj.set("ISOgain", arr);
-				}
+	static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	out.insert(out.end(), signature, signature + 8);
+	size_t start = pngBeginChunk(out, "IHDR");
+	putBE32(out, width);
+	putBE32(out, height);
+	const uint8_t header[5] = {uint8_t(bps), uint8_t(colors == 1 ? 0 : 2), 0, 0, 0};	// gray/RGB, deflate, adaptive, no interlace
+	out.insert(out.end(), header, header + 5);
+	pngEndChunk(out, start);
 
-				meta.set("canon", canonObj);
-			}
-			// ================ NIKON ================
-			else if (makeLower.find("nikon") != std::string::npos)
-			{
-				val nikonObj = val::object();
-				const libraw_nikon_makernotes_t &cNikon =
-					processor_->imgdata.makernotes.nikon;
+	// One IDAT per chunk, the first starting with the zlib header and the
+	// last ending with the Adler-32 of all the filtered rows
+	const int level = options.compression < 2 ? 0 : options.compression < 6 ? 1 : options.compression == 6 ? 2 : 3;
+	uint16_t zlibHeader = 0x7800 | (level << 6);
+	zlibHeader += 31 - zlibHeader % 31;
+	uLong checksum = adler32(0, Z_NULL, 0);
+	for (int chunk = 0; chunk < chunks; chunk++) {
+		const size_t filteredSize = size_t(std::min(height - chunk * chunkRows, chunkRows)) * (length + 1);
+		checksum = adler32_combine(checksum, checksums[chunk], z_off_t(filteredSize));
+		start = pngBeginChunk(out, "IDAT");
+		if (chunk == 0) {
+			out.push_back(uint8_t(zlibHeader >> 8));
+			out.push_back(uint8_t(zlibHeader));
+		}
+		out.insert(out.end(), compressed[chunk].begin(), compressed[chunk].end());
+		std::vector<uint8_t>().swap(compressed[chunk]);
+		if (chunk == chunks - 1) {
+			putBE32(out, uint32_t(checksum));
+		}
+		pngEndChunk(out, start);
+	}
+	pngEndChunk(out, pngBeginChunk(out, "IEND"));
+	return true;
+}
 
-				nikonObj.set("ExposureBracketValue", cNikon.ExposureBracketValue);
-				nikonObj.set("ActiveDLighting",	  cNikon.ActiveDLighting);
-				nikonObj.set("ShootingMode",		 (int)cNikon.ShootingMode);
+// Baseline TIFF, little-endian, in strips that are separate zlib streams
+// (Adobe Deflate) after horizontal differencing (Predictor 2)
+static bool encodeTiff(const uint8_t* pixels, int width, int height, size_t rowBytes, int colors, int bps,
+		const EncodeOptions& options, std::vector<uint8_t>& out, std::string& error) {
+	out.clear();
+	if (width <= 0 || height <= 0) {
+		error = "TIFF: empty image";
+		return false;
+	}
+	const size_t length = size_t(width) * colors * (bps / 8);
+	const int stripRows = int(std::max<size_t>(1, ENCODE_CHUNK_BYTES / length));
+	const int strips = (height + stripRows - 1) / stripRows;
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 7; i++) {
-						arr.set(i, cNikon.ImageStabilization[i]);
-					}
-					nikonObj.set("ImageStabilization", arr);
+	std::vector<std::vector<uint8_t>> compressed(strips);
+	std::atomic<bool> failed{false};
+	parallelFor(strips, options.threads, [&](int strip) {
+		const int y0 = strip * stripRows, y1 = std::min(height, y0 + stripRows);
+		std::vector<uint8_t> data(size_t(y1 - y0) * length);
+		for (int y = y0; y < y1; y++) {
+			uint8_t* row = &data[size_t(y - y0) * length];
+			std::memcpy(row, pixels + size_t(y) * rowBytes, length);
+			// Each sample minus the same sample of the pixel on its left, in
+			// the file's (= WASM's) byte order
+			if (bps == 16) {
+				uint16_t* samples = reinterpret_cast<uint16_t*>(row);
+				for (size_t i = length / 2 - 1; i >= size_t(colors); i--) {
+					samples[i] -= samples[i - colors];
+				}
+			} else {
+				for (size_t i = length - 1; i >= size_t(colors); i--) {
+					row[i] -= row[i - colors];
 				}
+			}
+		}
+		if (!deflateBuffer(data.data(), data.size(), options.compression, 15, Z_FINISH, compressed[strip])) {
+			failed = true;
+		}
+	});
+	if (failed) {
+		error = "TIFF: deflate failed";
+		return false;
+	}
 
-				nikonObj.set("VibrationReduction",   (int)cNikon.VibrationReduction);
-				nikonObj.set("FlashSetting",		 std::string(cNikon.FlashSetting));
-				nikonObj.set("FlashType",		   std::string(cNikon.FlashType));
+	// Header, IFD, values that don't fit in their entry, then the strips
+	const int entries = 14;
+	const uint32_t ifdOffset = 8;
+	uint32_t extraOffset = ifdOffset + 2 + 12 * entries + 4;
+	const uint32_t bitsOffset = extraOffset;
+	extraOffset += colors > 2 ? 2 * colors : 0;
+	const uint32_t offsetsOffset = extraOffset;
+	extraOffset += strips > 1 ? 4 * strips : 0;
+	const uint32_t countsOffset = extraOffset;
+	extraOffset += strips > 1 ? 4 * strips : 0;
+	const uint32_t resolutionOffset = extraOffset;
+	extraOffset += 8;
+	size_t dataSize = 0;
+	for (const std::vector<uint8_t>& strip : compressed) {
+		dataSize += strip.size();
+	}
+	if (extraOffset + dataSize > UINT32_MAX) {
+		error = "TIFF: image too large";
+		return false;
+	}
+	out.reserve(extraOffset + dataSize);
+	static const uint8_t header[4] = {'I', 'I', 42, 0};
+	out.insert(out.end(), header, header + 4);
+	putLE32(out, ifdOffset);
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, cNikon.FlashExposureCompensation[i]);
-					}
-					nikonObj.set("FlashExposureCompensation", arr);
-				}
+	enum { SHORT = 3, LONG = 4, RATIONAL = 5 };
+	auto entry = [&](uint16_t tag, uint16_t type, uint32_t count, uint32_t value) {
+		putLE16(out, tag);
+		putLE16(out, type);
+		putLE32(out, count);
+		putLE32(out, value);	// SHORTs are stored in the low bytes (little-endian)
+	};
+	putLE16(out, entries);
+	entry(256, LONG, 1, width);							// ImageWidth
+	entry(257, LONG, 1, height);						// ImageLength
+	entry(258, SHORT, colors, colors > 2 ? bitsOffset : bps);	// BitsPerSample
+	entry(259, SHORT, 1, 8);							// Compression: Deflate
+	entry(262, SHORT, 1, colors == 1 ? 1 : 2);			// Photometric: BlackIsZero/RGB
+	entry(273, LONG, strips, strips > 1 ? offsetsOffset : extraOffset);	// StripOffsets
+	entry(277, SHORT, 1, colors);						// SamplesPerPixel
+	entry(278, LONG, 1, stripRows);						// RowsPerStrip
+	entry(279, LONG, strips, strips > 1 ? countsOffset : uint32_t(compressed[0].size()));	// StripByteCounts
+	entry(282, RATIONAL, 1, resolutionOffset);			// XResolution
+	entry(283, RATIONAL, 1, resolutionOffset);			// YResolution
+	entry(284, SHORT, 1, 1);							// PlanarConfiguration: chunky
+	entry(296, SHORT, 1, 2);							// ResolutionUnit: inch
+	entry(317, SHORT, 1, 2);							// Predictor: horizontal
+	putLE32(out, 0);									// no next IFD
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, cNikon.ExternalFlashExposureComp[i]);
-					}
-					nikonObj.set("ExternalFlashExposureComp", arr);
-				}
+	if (colors > 2) {
+		for (int c = 0; c < colors; c++) {
+			putLE16(out, bps);
+		}
+	}
+	if (strips > 1) {
+		uint32_t offset = extraOffset;
+		for (const std::vector<uint8_t>& strip : compressed) {
+			putLE32(out, offset);
+			offset += uint32_t(strip.size());
+		}
+		for (const std::vector<uint8_t>& strip : compressed) {
+			putLE32(out, uint32_t(strip.size()));
+		}
+	}
+	putLE32(out, 72);	// 72 dpi
+	putLE32(out, 1);
+	for (std::vector<uint8_t>& strip : compressed) {
+		out.insert(out.end(), strip.begin(), strip.end());
+		std::vector<uint8_t>().swap(strip);
+	}
+	return true;
+}
 
-				nikonObj.set("FlashExposureBracketValue0",
-							cNikon.FlashExposureBracketValue[0]);
-				nikonObj.set("FlashExposureBracketValue1",
-							cNikon.FlashExposureBracketValue[1]);
-				nikonObj.set("FlashExposureBracketValue2",
-							cNikon.FlashExposureBracketValue[2]);
-				nikonObj.set("FlashExposureBracketValue3",
-							cNikon.FlashExposureBracketValue[3]);
+static bool encodeImage(const uint8_t* pixels, int width, int height, size_t rowBytes, int colors, int bps,
+		const EncodeOptions& options, std::vector<uint8_t>& out, std::string& error) {
+	if (colors != 1 && colors != 3) {
+		error = "LibRaw: only gray and RGB images can be encoded";
+		return false;
+	}
+	switch (options.format) {
+	case ImageFormat::PNG:
+		return encodePng(pixels, width, height, rowBytes, colors, bps, options, out, error);
+	case ImageFormat::TIFF:
+		return encodeTiff(pixels, width, height, rowBytes, colors, bps, options, out, error);
+	default:
+		return encodeJpeg(pixels, width, height, rowBytes, colors, bps, options, out, error);
+	}
+}
 
-				nikonObj.set("FlashMode",				(int)cNikon.FlashMode);
-				nikonObj.set("FlashExposureCompensation2", 
-													(int)cNikon.FlashExposureCompensation2);
-				nikonObj.set("FlashExposureCompensation3", 
-													(int)cNikon.FlashExposureCompensation3);
-				nikonObj.set("FlashExposureCompensation4", 
-													(int)cNikon.FlashExposureCompensation4);
-				nikonObj.set("FlashSource",			 (int)cNikon.FlashSource);
-				nikonObj.set("FlashFirmware0",		  (int)cNikon.FlashFirmware[0]);
-				nikonObj.set("FlashFirmware1",		  (int)cNikon.FlashFirmware[1]);
-				nikonObj.set("ExternalFlashFlags",	  (int)cNikon.ExternalFlashFlags);
-				nikonObj.set("FlashControlCommanderMode",(int)cNikon.FlashControlCommanderMode);
-				nikonObj.set("FlashOutputAndCompensation",(int)cNikon.FlashOutputAndCompensation);
-				nikonObj.set("FlashFocalLength",		(int)cNikon.FlashFocalLength);
-				nikonObj.set("FlashGNDistance",		 (int)cNikon.FlashGNDistance);
+// LibRaw plus the wrapper's hooks into the dcraw_process() stages
+class WASMProcessor : public LibRaw {
+public:
+	// Free the raw data as soon as raw2image_ex() has copied it into `image`:
+	// dcraw_process() doesn't read it afterwards, but it can't run again
+	bool releaseRawAfterCopy = false;
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, (int)cNikon.FlashGroupOutputAndCompensation[i]);
-					}
-					nikonObj.set("FlashGroupOutputAndCompensation", arr);
-				}
+	// Wall time (ms) of each stage of the last decode, in pipeline order
+	std::vector<std::pair<const char*, double>> timings;
 
-				nikonObj.set("FlashGroupControlMode0", (int)cNikon.FlashGroupControlMode[0]);
-				nikonObj.set("FlashGroupControlMode1", (int)cNikon.FlashGroupControlMode[1]);
-				nikonObj.set("FlashGroupControlMode2", (int)cNikon.FlashGroupControlMode[2]);
-				nikonObj.set("FlashGroupControlMode3", (int)cNikon.FlashGroupControlMode[3]);
+	WASMProcessor() {
+		callbacks.pre_subtractblack_cb = &WASMProcessor::onRawCopied;
+		callbacks.pre_interpolate_cb = &WASMProcessor::onInterpolate;
+		callbacks.pre_converttorgb_cb = &WASMProcessor::onConvertToRgb;
+		callbacks.post_converttorgb_cb = &WASMProcessor::onConvertedToRgb;
+	}
 
-				nikonObj.set("FlashColorFilter",	 (int)cNikon.FlashColorFilter);
-				nikonObj.set("NEFCompression",	   (int)cNikon.NEFCompression);
-				nikonObj.set("ExposureMode",		 cNikon.ExposureMode);
-				nikonObj.set("ExposureProgram",	  cNikon.ExposureProgram);
-				nikonObj.set("nMEshots",			 cNikon.nMEshots);
-				nikonObj.set("MEgainOn",			 (int)cNikon.MEgainOn);
+	void startTimings() {
+		timings.clear();
+		stageStart = timingsStart = emscripten_get_now();
+	}
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, cNikon.ME_WB[i]);
-					}
-					nikonObj.set("ME_WB", arr);
-				}
+	// Wall time (ms) since startTimings()
+	double elapsed() const {
+		return emscripten_get_now() - timingsStart;
+	}
 
-				nikonObj.set("AFFineTune",	   (int)cNikon.AFFineTune);
-				nikonObj.set("AFFineTuneIndex",  (int)cNikon.AFFineTuneIndex);
-				nikonObj.set("AFFineTuneAdj",	(int)cNikon.AFFineTuneAdj);
-				nikonObj.set("LensDataVersion",  cNikon.LensDataVersion);
-				nikonObj.set("FlashInfoVersion", cNikon.FlashInfoVersion);
-				nikonObj.set("ColorBalanceVersion", cNikon.ColorBalanceVersion);
-				nikonObj.set("key", (int)cNikon.key);
+	// Close the stage running since the previous call
+	void endStage(const char* name) {
+		const double now = emscripten_get_now();
+		timings.emplace_back(name, now - stageStart);
+		stageStart = now;
+	}
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 4; i++) {
-						arr.set(i, cNikon.NEFBitDepth[i]);
-					}
-					nikonObj.set("NEFBitDepth", arr);
-				}
+	bool hasRawData() const {
+		return imgdata.rawdata.raw_alloc != nullptr;
+	}
 
-				nikonObj.set("HighSpeedCropFormat",  (int)cNikon.HighSpeedCropFormat);
-				val hsc = val::object();
-				hsc.set("cleft",   cNikon.SensorHighSpeedCrop.cleft);
-				hsc.set("ctop",	cNikon.SensorHighSpeedCrop.ctop);
-				hsc.set("cwidth",  cNikon.SensorHighSpeedCrop.cwidth);
-				hsc.set("cheight", cNikon.SensorHighSpeedCrop.cheight);
-				nikonObj.set("SensorHighSpeedCrop", hsc);
+	void releaseRawData() {
+		if (imgdata.rawdata.raw_alloc) {
+			free(imgdata.rawdata.raw_alloc);
+		}
+		imgdata.rawdata.raw_alloc = nullptr;
+		imgdata.rawdata.raw_image = nullptr;
+		imgdata.rawdata.color4_image = nullptr;
+		imgdata.rawdata.color3_image = nullptr;
+		imgdata.rawdata.float_image = nullptr;
+		imgdata.rawdata.float3_image = nullptr;
+		imgdata.rawdata.float4_image = nullptr;
+	}
 
-				nikonObj.set("SensorWidth",  (int)cNikon.SensorWidth);
-				nikonObj.set("SensorHeight", (int)cNikon.SensorHeight);
-				nikonObj.set("Active_D_Lighting", (int)cNikon.Active_D_Lighting);
-				nikonObj.set("ShotInfoVersion",   cNikon.ShotInfoVersion);
-				nikonObj.set("MakernotesFlip",	cNikon.MakernotesFlip);
-				nikonObj.set("RollAngle",		 cNikon.RollAngle);
-				nikonObj.set("PitchAngle",		cNikon.PitchAngle);
-				nikonObj.set("YawAngle",		  cNikon.YawAngle);
+	// Render through the compact pipeline when compactSupported() allows it
+	bool compactRequested = false;
 
-				meta.set("nikon", nikonObj);
-			}
-			// ================ FUJI ================
-			else if (makeLower.find("fuji") != std::string::npos ||
-					makeLower.find("fujifilm") != std::string::npos)
-			{
-				val fujiObj = val::object();
-				const libraw_fuji_info_t &cFuji =
-					processor_->imgdata.makernotes.fuji;
+	/**
+	 * Whether the compact pipeline can render the opened file with the current
+	 * parameters and `userQual`: 3-color 2x2 Bayer data, the bilinear demosaic
+	 * (userQual 0; LibRaw's default -1 means AHD), and none of the stages that need
+	 * LibRaw's 4-channel image (denoise, aberration, bad pixels/dark frame,
+	 * auto WB, highlight recovery, median filter, crop, Fuji rotate, stretch).
+	 */
+	bool compactSupported(int userQual) {
+		const libraw_output_params_t &O = imgdata.params;
+		const libraw_internal_output_params_t &IO = libraw_internal_data.internal_output_params;
+		return imgdata.idata.filters > 1000 && imgdata.idata.colors == 3 && !is_floating_point() &&
+			imgdata.sizes.width >= 3 && imgdata.sizes.height >= 3 && imgdata.sizes.pixel_aspect == 1 &&
+			!IO.fuji_width && !IO.zero_is_bad &&
+			userQual == 0 && !O.half_size && !O.four_color_rgb && !O.no_interpolation && O.threshold == 0 &&
+			O.aber[0] == 1 && O.aber[2] == 1 && !O.bad_pixels && !O.dark_frame && !O.green_matching &&
+			O.med_passes <= 0 && O.highlight == 0 && !O.exp_correc && !O.no_auto_scale && !O.use_auto_wb &&
+			!(O.use_camera_wb && imgdata.color.cam_mul[0] == -1) && !(~O.cropbox[2] && ~O.cropbox[3]);
+	}
 
-				fujiObj.set("ExpoMidPointShift",		cFuji.ExpoMidPointShift);
-				fujiObj.set("DynamicRange",			 cFuji.DynamicRange);
-				fujiObj.set("FilmMode",				 cFuji.FilmMode);
-				fujiObj.set("DynamicRangeSetting",	  cFuji.DynamicRangeSetting);
-				fujiObj.set("DevelopmentDynamicRange",  cFuji.DevelopmentDynamicRange);
-				fujiObj.set("AutoDynamicRange",		 cFuji.AutoDynamicRange);
-				fujiObj.set("DRangePriority",		   cFuji.DRangePriority);
-				fujiObj.set("DRangePriorityAuto",	   cFuji.DRangePriorityAuto);
-				fujiObj.set("DRangePriorityFixed",	  cFuji.DRangePriorityFixed);
-				fujiObj.set("BrightnessCompensation",   cFuji.BrightnessCompensation);
-				fujiObj.set("FocusMode",				cFuji.FocusMode);
-				fujiObj.set("AFMode",				   cFuji.AFMode);
+	// dcraw_process(), or the compact pipeline when requested and possible
+	int process() {
+		compactActive = deferredConvert = false;
+		whitePoint = 0;
+		if (compactRequested && imgdata.rawdata.raw_image && !imgdata.rawdata.ph1_cblack && compactSupported(imgdata.params.user_qual)) {
+			return compactProcess();
+		}
+		std::vector<ushort>().swap(compact);
+		return dcraw_process();
+	}
 
-				{
-					val arr = val::array();
-					arr.set(0, cFuji.FocusPixel[0]);
-					arr.set(1, cFuji.FocusPixel[1]);
-					fujiObj.set("FocusPixel", arr);
-				}
+	// get_mem_image_format() of the last process()
+	void outputFormat(int* width, int* height, int* colors, int* bps) {
+		if (!compactActive) {
+			get_mem_image_format(width, height, colors, bps);
+			return;
+		}
+		*width = imgdata.sizes.width;
+		*height = imgdata.sizes.height;
+		if (imgdata.sizes.flip & 4) {
+			std::swap(*width, *height);
+		}
+		*colors = 3;
+		*bps = imgdata.params.output_bps;
+	}
 
-				fujiObj.set("PrioritySettings",		 cFuji.PrioritySettings);
-				fujiObj.set("FocusSettings",			cFuji.FocusSettings);
-				fujiObj.set("AF_C_Settings",			cFuji.AF_C_Settings);
-				fujiObj.set("FocusWarning",			 cFuji.FocusWarning);
+	// Auto-brightness white point (histogram level) of the last deferred
+	// output, and one to use instead of the histogram's (0: none)
+	int whitePoint = 0;
+	int forcedWhitePoint = 0;
 
-				{
-					val arr = val::array();
-					arr.set(0, cFuji.ImageStabilization[0]);
-					arr.set(1, cFuji.ImageStabilization[1]);
-					arr.set(2, cFuji.ImageStabilization[2]);
-					fujiObj.set("ImageStabilization", arr);
-				}
+	// copy_mem_image() (RGB order) of the last process()
+	int copyOutput(void* scan0, int stride) {
+		if (!deferredConvert) {
+			return copy_mem_image(scan0, stride, 0);
+		}
+		beginRows();
+		int width, height, colors, bps;
+		outputFormat(&width, &height, &colors, &bps);
+		copyRows(static_cast<uint8_t*>(scan0), stride, 0, height);
+		return LIBRAW_SUCCESS;
+	}
 
-				fujiObj.set("FlashMode",		cFuji.FlashMode);
-				fujiObj.set("WB_Preset",		cFuji.WB_Preset);
-				fujiObj.set("ShutterType",	  cFuji.ShutterType);
-				fujiObj.set("ExrMode",		  cFuji.ExrMode);
-				fujiObj.set("Macro",		   (int)cFuji.Macro);
-				fujiObj.set("Rating",		 (int)cFuji.Rating);
-				fujiObj.set("CropMode",	   (int)cFuji.CropMode);
+	// Whether copyRows() can produce the output of the last process() a few
+	// rows at a time, straight from the working image (deferred conversion)
+	bool rowsOnDemand() const {
+		return deferredConvert;
+	}
 
-				fujiObj.set("SerialSignature", std::string(cFuji.SerialSignature));
-				fujiObj.set("SensorID",		std::string(cFuji.SensorID));
-				fujiObj.set("RAFVersion",	  std::string(cFuji.RAFVersion));
-				fujiObj.set("RAFDataGeneration", cFuji.RAFDataGeneration);
-				fujiObj.set("RAFDataVersion",	cFuji.RAFDataVersion);
-				fujiObj.set("isTSNERDTS",		cFuji.isTSNERDTS);
-				fujiObj.set("DriveMode",		 (int)cFuji.DriveMode);
+	// Output rows [rowBegin, rowEnd) into scan0 (which holds row rowBegin),
+	// once beginRows() has set the white point and gamma curve
+	void beginRows() {
+		deferredWhitePoint();
+	}
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 9; i++) {
-						arr.set(i, cFuji.BlackLevel[i]);
+	void copyRows(uint8_t* scan0, int stride, int rowBegin, int rowEnd) {
+		deferredCopy(scan0, stride, rowBegin, rowEnd);
+	}
+
+	// Whether binnedPreview() can read the unpacked raw data: one sample per
+	// pixel in a Bayer or X-Trans pattern
+	bool binnable() {
+		const unsigned filters = imgdata.idata.filters;
+		return imgdata.rawdata.raw_image && (filters >= 1000 || filters == 9) &&
+			!libraw_internal_data.internal_output_params.fuji_width && !imgdata.rawdata.ph1_cblack;
+	}
+
+	// "Super-pixel" preview straight from raw_image, without raw2image_ex(),
+	// `image` or demosaic: every block of `factor` x `factor` CFA cells (2x2
+	// Bayer, 3x3 X-Trans: both hold every color) becomes one RGB pixel, its
+	// per-color averages black-subtracted, white balanced and converted with
+	// rgb_cam (sRGB) in the same pass. Auto-brightness, gamma, flip and bit
+	// depth then apply as in copy_mem_image(). Leaves imgdata.sizes and
+	// imgdata.color as raw2image_start() sets them.
+	void binnedPreview(int factor, std::vector<uint8_t>& out, int* outWidth, int* outHeight) {
+		raw2image_start();
+		const libraw_output_params_t &O = imgdata.params;
+		const libraw_colordata_t &C = imgdata.color;
+		const int colors = imgdata.idata.colors;
+		const int cell = imgdata.idata.filters == 9 ? 3 : 2;
+		const int block = cell * std::max(1, factor);
+		const int width = imgdata.sizes.width / block, height = imgdata.sizes.height / block;
+		if (width < 1 || height < 1) {
+			throw std::runtime_error("LibRaw: image too small for this binning");
+		}
+		const int pitch = imgdata.sizes.raw_pitch / 2;
+		const ushort* raw = imgdata.rawdata.raw_image + size_t(imgdata.sizes.top_margin) * pitch + imgdata.sizes.left_margin;
+		const int rawRows = std::min<int>(height * block, imgdata.sizes.raw_height - imgdata.sizes.top_margin);
+		const int rawCols = std::min<int>(width * block, imgdata.sizes.raw_width - imgdata.sizes.left_margin);
+		const BlackLevels levels = blackLevels();
+		float scaleMul[4];
+		compactScaleMul(levels, 0, scaleMul);
+		const bool rawColor = libraw_internal_data.internal_output_params.raw_color;
+
+		// CFA colors repeat every 8 (Bayer) or 6 (X-Trans) rows and 2 or 6
+		// columns: one row of colors per row phase, second green folded
+		// into green for 3-color files
+		const int phases = imgdata.idata.filters == 9 ? 6 : 8;
+		std::vector<uint8_t> cfa(size_t(phases) * rawCols);
+		for (int phase = 0; phase < phases; phase++) {
+			for (int col = 0; col < rawCols; col++) {
+				const int c = fcol(phase, col);
+				cfa[size_t(phase) * rawCols + col] = uint8_t(colors == 3 && c == 3 ? 1 : c);
+			}
+		}
+
+		std::vector<ushort> rgb(size_t(width) * height * 3);
+		std::vector<float> sums(size_t(width) * 4);
+		std::vector<int> counts(size_t(width) * 4);
+		std::vector<int> histogramData(3 * LIBRAW_HISTOGRAM_SIZE);	// too large for the stack
+		int (*histogram)[LIBRAW_HISTOGRAM_SIZE] = reinterpret_cast<int(*)[LIBRAW_HISTOGRAM_SIZE]>(histogramData.data());
+		for (int y = 0; y < height; y++) {
+			std::fill(sums.begin(), sums.end(), 0.0f);
+			std::fill(counts.begin(), counts.end(), 0);
+			for (int row = y * block; row < std::min(rawRows, (y + 1) * block); row++) {
+				const ushort* line = raw + size_t(row) * pitch;
+				const uint8_t* color = &cfa[size_t(row % phases) * rawCols];
+				for (int x = 0, col = 0; x < width; x++) {
+					float* sum = &sums[size_t(x) * 4];
+					int* count = &counts[size_t(x) * 4];
+					for (const int end = std::min(rawCols, col + block); col < end; col++) {
+						const int c = color[col];
+						const unsigned black = levels.at(row, col, c);
+						sum[c] += line[col] > black ? line[col] - black : 0;
+						count[c]++;
 					}
-					fujiObj.set("BlackLevel", arr);
 				}
-
-				{
-					val arr = val::array();
-					for (int i = 0; i < 32; i++) {
-						arr.set(i, cFuji.RAFData_ImageSizeTable[i]);
+			}
+			ushort* pix = &rgb[size_t(y) * width * 3];
+			for (int x = 0; x < width; x++, pix += 3) {
+				float cam[4] = {0, 0, 0, 0};
+				for (int c = 0; c < colors; c++) {
+					const size_t bin = size_t(x) * 4 + c;
+					cam[c] = counts[bin] ? sums[bin] / counts[bin] * scaleMul[c] : 0.0f;
+				}
+				for (int k = 0; k < 3; k++) {
+					float value = cam[k];
+					if (!rawColor) {
+						value = 0.0f;
+						for (int c = 0; c < colors; c++) {
+							value += C.rgb_cam[k][c] * cam[c];
+						}
 					}
-					fujiObj.set("RAFData_ImageSizeTable", arr);
+					const int clipped = value < 0 ? 0 : (value > 65535 ? 65535 : int(value));
+					pix[k] = ushort(clipped);
+					histogram[k][clipped >> 3]++;
 				}
-				fujiObj.set("AutoBracketing",	cFuji.AutoBracketing);
-				fujiObj.set("SequenceNumber",	cFuji.SequenceNumber);
-				fujiObj.set("SeriesLength",	  cFuji.SeriesLength);
+			}
+		}
 
-				{
-					val arr = val::array();
-					arr.set(0, cFuji.PixelShiftOffset[0]);
-					arr.set(1, cFuji.PixelShiftOffset[1]);
-					fujiObj.set("PixelShiftOffset", arr);
+		int white = 0x2000;
+		if (autoBright()) {
+			white = histogramWhitePoint(histogram, int(width * height * O.auto_bright_thr));
+		}
+		gamma_curve(O.gamm[0], O.gamm[1], 2, (white << 3) / O.bright);
+		const ushort* curve = imgdata.color.curve;
+
+		// Flip while writing the output, as flip_index()
+		const int flip = imgdata.sizes.flip;
+		*outWidth = flip & 4 ? height : width;
+		*outHeight = flip & 4 ? width : height;
+		const int bytes = O.output_bps == 16 ? 2 : 1;
+		out.resize(size_t(width) * height * 3 * bytes);
+		for (int row = 0; row < *outHeight; row++) {
+			for (int col = 0; col < *outWidth; col++) {
+				int y = row, x = col;
+				if (flip & 4) {
+					std::swap(y, x);
+				}
+				if (flip & 2) {
+					y = height - 1 - y;
+				}
+				if (flip & 1) {
+					x = width - 1 - x;
+				}
+				const ushort* src = &rgb[(size_t(y) * width + x) * 3];
+				const size_t index = (size_t(row) * *outWidth + col) * 3;
+				for (int k = 0; k < 3; k++) {
+					if (bytes == 2) {
+						reinterpret_cast<ushort*>(out.data())[index + k] = curve[src[k]];
+					} else {
+						out[index + k] = curve[src[k]] >> 8;
+					}
 				}
+			}
+		}
+	}
 
-				fujiObj.set("ImageCount", cFuji.ImageCount);
+private:
+	double stageStart = 0, timingsStart = 0;
 
-				meta.set("fuji", fujiObj);
-			}
-			// ================ SONY ================
-			else if (makeLower.find("sony") != std::string::npos)
-			{
-				val sonyObj = val::object();
-				const libraw_sony_info_t &cSony =
-					processor_->imgdata.makernotes.sony;
+	//-----------------------------------------------------------------------
+	// Compact pipeline: Bayer data goes from raw_image straight into a
+	// 3-channel working image (6 bytes per pixel instead of the 8 of LibRaw's
+	// `image`): black subtraction and white balance scaling are applied while
+	// demosaicing (bilinear, as lin_interpolate()), and its color conversion
+	// is always deferred to the output (see deferredConvert).
+	//-----------------------------------------------------------------------
+	std::vector<ushort> compact;
+	bool compactActive = false;
 
-				sonyObj.set("CameraType",		 (int)cSony.CameraType);
-				sonyObj.set("Sony0x9400_version", (int)cSony.Sony0x9400_version);
-				sonyObj.set("Sony0x9400_ReleaseMode2",
-							(int)cSony.Sony0x9400_ReleaseMode2);
-				sonyObj.set("Sony0x9400_SequenceImageNumber",
-							cSony.Sony0x9400_SequenceImageNumber);
-				sonyObj.set("Sony0x9400_SequenceLength1",
-							(int)cSony.Sony0x9400_SequenceLength1);
-				sonyObj.set("Sony0x9400_SequenceFileNumber",
-							cSony.Sony0x9400_SequenceFileNumber);
-				sonyObj.set("Sony0x9400_SequenceLength2",
-							(int)cSony.Sony0x9400_SequenceLength2);
-				sonyObj.set("AFAreaModeSetting",	 (int)cSony.AFAreaModeSetting);
-				sonyObj.set("AFAreaMode",			(int)cSony.AFAreaMode);
-				{
-					val arr = val::array();
-					arr.set(0, cSony.FlexibleSpotPosition[0]);
-					arr.set(1, cSony.FlexibleSpotPosition[1]);
-					sonyObj.set("FlexibleSpotPosition", arr);
-				}
-				sonyObj.set("AFPointSelected",	  (int)cSony.AFPointSelected);
-				sonyObj.set("AFPointSelected_0x201e",(int)cSony.AFPointSelected_0x201e);
-				sonyObj.set("AFType",			   (int)cSony.AFType);
+	// Black of a pixel: black + cblack[color] + the cblack[6+] pattern
+	struct BlackLevels {
+		unsigned base[4];
+		const unsigned* pattern;	// null if none
+		unsigned rows, cols;
 
-				{
-					val arr = val::array();
-					arr.set(0, cSony.FocusLocation[0]);
-					arr.set(1, cSony.FocusLocation[1]);
-					arr.set(2, cSony.FocusLocation[2]);
-					arr.set(3, cSony.FocusLocation[3]);
-					sonyObj.set("FocusLocation", arr);
-				}
+		unsigned at(int row, int col, int c) const {
+			return base[c] + (pattern ? pattern[(row % rows) * cols + col % cols] : 0);
+		}
+	};
 
-				sonyObj.set("FocusPosition",	  (int)cSony.FocusPosition);
-				sonyObj.set("AFMicroAdjValue",	(int)cSony.AFMicroAdjValue);
-				sonyObj.set("AFMicroAdjOn",	   (int)cSony.AFMicroAdjOn);
-				sonyObj.set("AFMicroAdjRegisteredLenses",
-							(int)cSony.AFMicroAdjRegisteredLenses);
-				sonyObj.set("VariableLowPassFilter",
-							(int)cSony.VariableLowPassFilter);
-				sonyObj.set("LongExposureNoiseReduction",
-							cSony.LongExposureNoiseReduction);
-				sonyObj.set("HighISONoiseReduction",
-							(int)cSony.HighISONoiseReduction);
+	// Neighbours lin_interpolate() averages for one position of the CFA
+	struct InterpolationCode {
+		int color;	// color of the pixel itself
+		int dy[8], dx[8], shift[8], neighbourColor[8];
+		int mult[3];	// 256 / sum of weights, per color
+	};
 
-				{
-					val arr = val::array();
-					arr.set(0, cSony.HDR[0]);
-					arr.set(1, cSony.HDR[1]);
-					sonyObj.set("HDR", arr);
-				}
+	void progress(enum LibRaw_progress stage) {
+		if (callbacks.progress_cb) {
+			callbacks.progress_cb(callbacks.progresscb_data, stage, 0, 1);
+		}
+	}
 
-				sonyObj.set("group2010",		(int)cSony.group2010);
-				sonyObj.set("group9050",		(int)cSony.group9050);
-				sonyObj.set("real_iso_offset",  (int)cSony.real_iso_offset);
-				sonyObj.set("MeteringMode_offset",(int)cSony.MeteringMode_offset);
-				sonyObj.set("ExposureProgram_offset",(int)cSony.ExposureProgram_offset);
-				sonyObj.set("ReleaseMode2_offset",(int)cSony.ReleaseMode2_offset);
-				sonyObj.set("MinoltaCamID",	  cSony.MinoltaCamID);
-				sonyObj.set("firmware",		  cSony.firmware);
-				sonyObj.set("ImageCount3_offset",(int)cSony.ImageCount3_offset);
-				sonyObj.set("ImageCount3",	   cSony.ImageCount3);
-				sonyObj.set("ElectronicFrontCurtainShutter",
-							cSony.ElectronicFrontCurtainShutter);
-				sonyObj.set("MeteringMode2",	 (int)cSony.MeteringMode2);
-				sonyObj.set("SonyDateTime",	  std::string(cSony.SonyDateTime));
-				sonyObj.set("ShotNumberSincePowerUp",
-							cSony.ShotNumberSincePowerUp);
-				sonyObj.set("PixelShiftGroupPrefix",   cSony.PixelShiftGroupPrefix);
-				sonyObj.set("PixelShiftGroupID",	   cSony.PixelShiftGroupID);
-				sonyObj.set("nShotsInPixelShiftGroup", (int)cSony.nShotsInPixelShiftGroup);
-				sonyObj.set("numInPixelShiftGroup",	(int)cSony.numInPixelShiftGroup);
-				sonyObj.set("prd_ImageHeight",		 cSony.prd_ImageHeight);
-				sonyObj.set("prd_ImageWidth",		  cSony.prd_ImageWidth);
-				sonyObj.set("prd_Total_bps",		   cSony.prd_Total_bps);
-				sonyObj.set("prd_Active_bps",		  cSony.prd_Active_bps);
-				sonyObj.set("prd_StorageMethod",	   cSony.prd_StorageMethod);
-				sonyObj.set("prd_BayerPattern",		cSony.prd_BayerPattern);
-				sonyObj.set("SonyRawFileType",		 (int)cSony.SonyRawFileType);
-				sonyObj.set("RAWFileType",			 (int)cSony.RAWFileType);
-				sonyObj.set("RawSizeType",			 (int)cSony.RawSizeType);
-				sonyObj.set("Quality",				 cSony.Quality);
-				sonyObj.set("FileFormat",			  cSony.FileFormat);
-				sonyObj.set("MetaVersion",			 std::string(cSony.MetaVersion));
+	// Color of a CFA position once the second green is folded into green
+	int cfaColor(int row, int col) {
+		const int c = FC(row, col);
+		return c == 3 ? 1 : c;
+	}
 
-				meta.set("sony", sonyObj);
-			}
-			// ================ PANASONIC ================
-			else if (makeLower.find("panasonic") != std::string::npos)
-			{
-				val panObj = val::object();
-				const libraw_panasonic_makernotes_t &cPan =
-					processor_->imgdata.makernotes.panasonic;
+	BlackLevels blackLevels() {
+		const libraw_colordata_t &C = imgdata.color;
+		const libraw_output_params_t &O = imgdata.params;
+		BlackLevels levels;
+		const unsigned black = O.user_black >= 0 ? O.user_black : C.black;
+		bool userLevels = O.user_black >= 0;
+		for (int c = 0; c < 4; c++) {
+			userLevels |= O.user_cblack[c] > -1000000;
+			levels.base[c] = black + (O.user_cblack[c] > -1000000 ? O.user_cblack[c] : C.cblack[c]);
+		}
+		// User levels replace the pattern too, as in adjust_bl()
+		const bool hasPattern = !userLevels && C.cblack[4] && C.cblack[5] &&
+			C.cblack[4] * C.cblack[5] <= LIBRAW_CBLACK_SIZE - 6;
+		levels.pattern = hasPattern ? C.cblack + 6 : nullptr;
+		levels.rows = hasPattern ? C.cblack[4] : 1;
+		levels.cols = hasPattern ? C.cblack[5] : 1;
+		return levels;
+	}
 
-				panObj.set("Compression",	   (int)cPan.Compression);
-				panObj.set("BlackLevelDim",	 (int)cPan.BlackLevelDim);
+	// White balance multipliers, as scale_colors() computes them for the
+	// parameters compactSupported() accepts
+	void compactScaleMul(const BlackLevels& levels, unsigned dataMaximum, float scaleMul[4]) {
+		const libraw_colordata_t &C = imgdata.color;
+		const libraw_output_params_t &O = imgdata.params;
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 8; i++) {
-						arr.set(i, cPan.BlackLevel[i]);
+		unsigned common = std::min(std::min(levels.base[0], levels.base[1]), std::min(levels.base[2], levels.base[3]));
+		if (levels.pattern) {
+			common += *std::min_element(levels.pattern, levels.pattern + levels.rows * levels.cols);
+		}
+		double maximum = C.maximum > common ? C.maximum - common : C.maximum;
+		libraw_decoder_info_t decoder;
+		get_decoder_info(&decoder);
+		if (!(decoder.decoder_flags & LIBRAW_DECODER_FIXEDMAXC) && O.adjust_maximum_thr >= 0.00001) {
+			// adjust_maximum()
+			const double threshold = O.adjust_maximum_thr > 0.99999 ? LIBRAW_DEFAULT_ADJUST_MAXIMUM_THRESHOLD : O.adjust_maximum_thr;
+			if (dataMaximum > 0 && dataMaximum < maximum && dataMaximum > maximum * threshold) {
+				maximum = dataMaximum;
+			}
+		}
+		if (O.user_sat > 0) {
+			maximum = O.user_sat;
+		}
+
+		float preMul[4];
+		memcpy(preMul, O.user_mul[0] ? O.user_mul : C.pre_mul, sizeof(preMul));
+		if (O.use_camera_wb && C.cam_mul[0] != -1) {
+			unsigned sum[8] = {0};
+			for (int row = 0; row < 8; row++) {
+				for (int col = 0; col < 8; col++) {
+					const int c = FC(row, col);
+					const int val = int(C.white[row][col]) - int(C.cblack[c]);
+					if (val > 0) {
+						sum[c] += val;
 					}
-					panObj.set("BlackLevel", arr);
+					sum[c + 4]++;
 				}
+			}
+			if (C.as_shot_wb_applied) {
+				preMul[0] = preMul[1] = preMul[2] = preMul[3] = 1.0f;
+			} else if (sum[0] && sum[1] && sum[2] && sum[3]) {
+				for (int c = 0; c < 4; c++) {
+					preMul[c] = (float)sum[c + 4] / sum[c];
+				}
+			} else if (C.cam_mul[0] && C.cam_mul[2]) {
+				memcpy(preMul, C.cam_mul, sizeof(preMul));
+			}
+		}
+		if (preMul[1] == 0) {
+			preMul[1] = 1;
+		}
+		if (preMul[3] == 0) {
+			preMul[3] = imgdata.idata.colors < 4 ? preMul[1] : 1;
+		}
+		double dmin = preMul[0], dmax = preMul[0];
+		for (int c = 1; c < 4; c++) {
+			dmin = std::min<double>(dmin, preMul[c]);
+			dmax = std::max<double>(dmax, preMul[c]);
+		}
+		dmax = dmin;	// highlight == 0: clip
+		for (int c = 0; c < 4; c++) {
+			if (dmax > 0.00001 && maximum > 0) {
+				// Rounded through float in between, as (pre_mul[c] /= dmax)
+				preMul[c] = float(preMul[c] / dmax);
+				scaleMul[c] = float(preMul[c] * 65535.0 / maximum);
+			} else {
+				scaleMul[c] = 1.0f;
+			}
+		}
+	}
 
-				panObj.set("Multishot",	  cPan.Multishot);
-				panObj.set("gamma",		  cPan.gamma);
+	int compactProcess() {
+		try {
+			raw2image_start();
+			const int width = imgdata.sizes.width, height = imgdata.sizes.height;
+			const int pitch = imgdata.sizes.raw_pitch / 2;
+			const ushort* raw = imgdata.rawdata.raw_image + size_t(imgdata.sizes.top_margin) * pitch + imgdata.sizes.left_margin;
+			// Visible pixels that lie outside the raw data are black, as in copy_bayer()
+			const int rawRows = std::min<int>(height, imgdata.sizes.raw_height - imgdata.sizes.top_margin);
+			const int rawCols = std::min<int>(width, imgdata.sizes.raw_width - imgdata.sizes.left_margin);
+			const BlackLevels levels = blackLevels();
 
-				{
-					val arr = val::array();
-					arr.set(0, cPan.HighISOMultiplier[0]);
-					arr.set(1, cPan.HighISOMultiplier[1]);
-					arr.set(2, cPan.HighISOMultiplier[2]);
-					panObj.set("HighISOMultiplier", arr);
+			unsigned dataMaximum = 0;
+			for (int row = 0; row < rawRows; row++) {
+				for (int col = 0; col < rawCols; col++) {
+					const unsigned value = raw[size_t(row) * pitch + col];
+					const unsigned black = levels.at(row, col, FC(row, col));
+					if (value > black && value - black > dataMaximum) {
+						dataMaximum = value - black;
+					}
 				}
+			}
+			float scaleMul[4];
+			compactScaleMul(levels, dataMaximum, scaleMul);
+			endStage("raw2image");
+			progress(LIBRAW_PROGRESS_SCALE_COLORS);
 
-				panObj.set("FocusStepNear",	 cPan.FocusStepNear);
-				panObj.set("FocusStepCount",	cPan.FocusStepCount);
-				panObj.set("ZoomPosition",	  cPan.ZoomPosition);
-				panObj.set("LensManufacturer",  cPan.LensManufacturer);
+			compact.resize(size_t(width) * height * 3);
+			compactInterpolate(raw, pitch, rawRows, rawCols, levels, scaleMul);
+			endStage("demosaic");
+			progress(LIBRAW_PROGRESS_INTERPOLATE);
+			if (releaseRawAfterCopy) {
+				releaseRawData();
+			}
 
-				meta.set("panasonic", panObj);
+			if (!libraw_internal_data.output_data.histogram) {
+				libraw_internal_data.output_data.histogram =
+					(int(*)[LIBRAW_HISTOGRAM_SIZE])malloc(sizeof(*libraw_internal_data.output_data.histogram) * 4);
 			}
-			// ================ OLYMPUS ================
-			else if (makeLower.find("olympus") != std::string::npos)
-			{
-				val olyObj = val::object();
-				const libraw_olympus_makernotes_t &cOly =
-					processor_->imgdata.makernotes.olympus;
+			compactActive = true;
+			convert_to_rgb();	// histogram only, see convert_to_rgb_loop()
+			endStage("convert");
+			return LIBRAW_SUCCESS;
+		} catch (const std::bad_alloc&) {
+			compactActive = false;
+			return LIBRAW_UNSUFFICIENT_MEMORY;
+		} catch (...) {
+			compactActive = false;
+			return LIBRAW_UNSPECIFIED_ERROR;
+		}
+	}
 
-				{
-					val arr = val::array();
-					arr.set(0, cOly.CameraType2[0]);
-					arr.set(1, cOly.CameraType2[1]);
-					arr.set(2, cOly.CameraType2[2]);
-					arr.set(3, cOly.CameraType2[3]);
-					arr.set(4, cOly.CameraType2[4]);
-					arr.set(5, cOly.CameraType2[5]);
-					olyObj.set("CameraType2", arr);
-				}
-				olyObj.set("ValidBits",		(int)cOly.ValidBits);
+	// Demosaic into `compact`, three rows of scaled CFA values at a time
+	void compactInterpolate(const ushort* raw, int pitch, int rawRows, int rawCols,
+			const BlackLevels& levels, const float scaleMul[4]) {
+		const int width = imgdata.sizes.width, height = imgdata.sizes.height;
 
-				{
-					val arr = val::array();
-					arr.set(0, cOly.DriveMode[0]);
-					arr.set(1, cOly.DriveMode[1]);
-					arr.set(2, cOly.DriveMode[2]);
-					arr.set(3, cOly.DriveMode[3]);
-					arr.set(4, cOly.DriveMode[4]);
-					olyObj.set("DriveMode", arr);
+		// The Bayer pattern repeats every 8 rows and 2 columns (see FC())
+		InterpolationCode codes[8][2];
+		for (int row = 0; row < 8; row++) {
+			for (int col = 0; col < 2; col++) {
+				InterpolationCode &code = codes[row][col];
+				code.color = cfaColor(row, col);
+				int weights[3] = {0, 0, 0};
+				int i = 0;
+				for (int y = -1; y <= 1; y++) {
+					for (int x = -1; x <= 1; x++) {
+						if (!y && !x) {
+							continue;
+						}
+						code.dy[i] = y;
+						code.dx[i] = x;
+						code.shift[i] = (y == 0) + (x == 0);
+						code.neighbourColor[i] = cfaColor(row + y + 8, col + x + 2);
+						weights[code.neighbourColor[i]] += 1 << code.shift[i];
+						i++;
+					}
+				}
+				for (int c = 0; c < 3; c++) {
+					code.mult[c] = weights[c] ? 256 / weights[c] : 0;
 				}
+			}
+		}
 
-				olyObj.set("ColorSpace",  (int)cOly.ColorSpace);
-				{
-					val arr = val::array();
-					arr.set(0, cOly.FocusMode[0]);
-					arr.set(1, cOly.FocusMode[1]);
-					olyObj.set("FocusMode", arr);
+		std::vector<ushort> rowBuffer(size_t(width) * 3);
+		auto scaledRow = [&](int row) -> const ushort* {
+			ushort* out = &rowBuffer[size_t(row % 3) * width];
+			for (int col = 0; col < width; col++) {
+				unsigned value = row < rawRows && col < rawCols ? raw[size_t(row) * pitch + col] : 0;
+				const int c = FC(row, col);
+				const unsigned black = levels.at(row, col, c);
+				if (value > black) {
+					const int scaled = int((value - black) * scaleMul[c]);
+					value = scaled > 65535 ? 65535 : scaled;
+				} else {
+					value = 0;
 				}
-				olyObj.set("AutoFocus",		(int)cOly.AutoFocus);
-				olyObj.set("AFPoint",		 (int)cOly.AFPoint);
-				{
-					val arr = val::array();
-					for (int i = 0; i < 64; i++) {
-						arr.set(i, cOly.AFAreas[i]);
+				out[col] = value;
+			}
+			return out;
+		};
+
+		// rows[0..2]: rows row-1, row and row+1 (null outside the image)
+		const ushort* rows[3] = {nullptr, nullptr, scaledRow(0)};
+		for (int row = 0; row < height; row++) {
+			rows[0] = rows[1];
+			rows[1] = rows[2];
+			rows[2] = row + 1 < height ? scaledRow(row + 1) : nullptr;
+			ushort* pix = &compact[size_t(row) * width * 3];
+			for (int col = 0; col < width; col++, pix += 3) {
+				const InterpolationCode &code = codes[row & 7][col & 1];
+				if (row == 0 || row == height - 1 || col == 0 || col == width - 1) {
+					// border_interpolate(1): plain average of the 3x3 neighbourhood
+					unsigned sum[3] = {0, 0, 0}, count[3] = {0, 0, 0};
+					for (int y = -1; y <= 1; y++) {
+						if (row + y < 0 || row + y >= height) {
+							continue;
+						}
+						for (int x = -1; x <= 1; x++) {
+							if (col + x < 0 || col + x >= width) {
+								continue;
+							}
+							const int c = cfaColor(row + y, col + x);
+							sum[c] += rows[y + 1][col + x];
+							count[c]++;
+						}
 					}
-					olyObj.set("AFAreas", arr);
+					for (int c = 0; c < 3; c++) {
+						pix[c] = c == code.color ? rows[1][col] : (count[c] ? sum[c] / count[c] : 0);
+					}
+					continue;
 				}
-				{
-					val arr = val::array();
-					arr.set(0, cOly.AFPointSelected[0]);
-					arr.set(1, cOly.AFPointSelected[1]);
-					olyObj.set("AFPointSelected", arr);
+				int sum[3] = {0, 0, 0};
+				for (int i = 0; i < 8; i++) {
+					sum[code.neighbourColor[i]] += rows[code.dy[i] + 1][col + code.dx[i]] << code.shift[i];
+				}
+				for (int c = 0; c < 3; c++) {
+					pix[c] = c == code.color ? rows[1][col] : sum[c] * code.mult[c] >> 8;
 				}
+			}
+		}
+	}
 
-				olyObj.set("AFResult", (int)cOly.AFResult);
-				olyObj.set("AFFineTune", (int)cOly.AFFineTune);
+	//-----------------------------------------------------------------------
+	// Deferred color conversion: when nothing reads the working image after
+	// convert_to_rgb() (3 output colors, no stretch()), convert_to_rgb_loop()
+	// doesn't write it back. It only builds the histogram, and only when
+	// auto-brightness needs it; copyOutput() then applies the camera-to-output
+	// matrix, gamma curve, bit depth and flip in a single tiled sweep.
+	//-----------------------------------------------------------------------
+	bool deferredConvert = false;
+	float deferredCam[3][4];
+	int deferredColors = 3;	// channels the matrix reads (3, or 4 for CMYG/RGBE)
 
-				{
-					val arr = val::array();
-					arr.set(0, (int)cOly.AFFineTuneAdj[0]);
-					arr.set(1, (int)cOly.AFFineTuneAdj[1]);
-					arr.set(2, (int)cOly.AFFineTuneAdj[2]);
-					olyObj.set("AFFineTuneAdj", arr);
-				}
+	bool deferrable() {
+		const libraw_output_params_t &O = imgdata.params;
+		const int colors = imgdata.idata.colors;
+		return (compactActive || imgdata.image) && (colors == 3 || (colors == 4 && O.output_color)) &&
+			!(O.use_fuji_rotate && imgdata.sizes.pixel_aspect != 1);
+	}
 
-				// Many more fields exist in the struct if you want them all.
-				olyObj.set("AspectFrameLeft",  (int)cOly.AspectFrame[0]);
-				olyObj.set("AspectFrameTop",   (int)cOly.AspectFrame[1]);
-				olyObj.set("AspectFrameWidth", (int)cOly.AspectFrame[2]);
-				olyObj.set("AspectFrameHeight",(int)cOly.AspectFrame[3]);
-				olyObj.set("Panorama_mode",	cOly.Panorama_mode);
-				olyObj.set("Panorama_frameNum",cOly.Panorama_frameNum);
+	bool autoBright() {
+		return !((imgdata.params.highlight & ~2) || imgdata.params.no_auto_bright);
+	}
 
-				meta.set("olympus", olyObj);
-			}
-			// ================ PENTAX ================
-			else if (makeLower.find("pentax") != std::string::npos)
-			{
-				val pentaxObj = val::object();
-				const libraw_pentax_makernotes_t &cPent =
-					processor_->imgdata.makernotes.pentax;
+	// The working image: `compact` (3 channels) or LibRaw's `image` (4)
+	const ushort* workingImage(int* channels) {
+		*channels = compactActive ? 3 : 4;
+		return compactActive ? compact.data() : imgdata.image[0];
+	}
+
+	// One pixel of convert_to_rgb_loop(), same arithmetic
+	void convertPixel(const ushort* img, ushort out[3]) {
+		if (libraw_internal_data.internal_output_params.raw_color) {
+			out[0] = img[0];
+			out[1] = img[1];
+			out[2] = img[2];
+			return;
+		}
+		float rgb[3] = {0, 0, 0};
+		for (int c = 0; c < deferredColors; c++) {
+			rgb[0] += deferredCam[0][c] * img[c];
+			rgb[1] += deferredCam[1][c] * img[c];
+			rgb[2] += deferredCam[2][c] * img[c];
+		}
+		for (int c = 0; c < 3; c++) {
+			const int v = int(rgb[c]);
+			out[c] = v < 0 ? 0 : (v > 65535 ? 65535 : v);
+		}
+	}
+
+	void convert_to_rgb_loop(float out_cam[3][4]) override {
+		if (!deferrable()) {
+			LibRaw::convert_to_rgb_loop(out_cam);
+			return;
+		}
+		memcpy(deferredCam, out_cam, sizeof(deferredCam));
+		deferredColors = imgdata.idata.colors;
+		deferredConvert = true;
+
+		int (*histogram)[LIBRAW_HISTOGRAM_SIZE] = libraw_internal_data.output_data.histogram;
+		memset(histogram, 0, sizeof(int) * LIBRAW_HISTOGRAM_SIZE * 4);
+		if (!autoBright()) {
+			return;	// copy_mem_image() wouldn't look at it
+		}
+		int channels;
+		const ushort* img = workingImage(&channels);
+		const size_t pixels = size_t(imgdata.sizes.width) * imgdata.sizes.height;
+		ushort rgb[3];
+		for (size_t i = 0; i < pixels; i++, img += channels) {
+			convertPixel(img, rgb);
+			histogram[0][rgb[0] >> 3]++;
+			histogram[1][rgb[1] >> 3]++;
+			histogram[2][rgb[2] >> 3]++;
+		}
+	}
+
+	// copy_mem_image() of a deferred conversion, first part: auto-brightness
+	// white point from the histogram, and the gamma curve
+	void deferredWhitePoint() {
+		const libraw_output_params_t &O = imgdata.params;
+		const int width = imgdata.sizes.width, height = imgdata.sizes.height;
+		int (*histogram)[LIBRAW_HISTOGRAM_SIZE] = libraw_internal_data.output_data.histogram;
+
+		whitePoint = 0x2000;
+		if (autoBright() && forcedWhitePoint > 0) {
+			whitePoint = forcedWhitePoint;
+		} else if (autoBright()) {
+			int perc = width * height * O.auto_bright_thr;
+			if (libraw_internal_data.internal_output_params.fuji_width) {
+				perc /= 2;
+			}
+			whitePoint = histogramWhitePoint(histogram, perc);
+		}
+		gamma_curve(O.gamm[0], O.gamm[1], 2, (whitePoint << 3) / O.bright);
+	}
+
+	// Level (>> 3) above which no channel has more than `perc` pixels, as
+	// copy_mem_image()'s auto-brightness
+	static int histogramWhitePoint(const int (*histogram)[LIBRAW_HISTOGRAM_SIZE], int perc) {
+		int whitePoint = 0;
+		for (int c = 0; c < 3; c++) {
+			int val, total = 0;
+			for (val = 0x2000; --val > 32;) {
+				if ((total += histogram[c][val]) > perc) {
+					break;
+				}
+			}
+			whitePoint = std::max(whitePoint, val);
+		}
+		return whitePoint;
+	}
+
+	// Second part, for output rows [rowBegin, rowEnd): matrix, gamma curve,
+	// flip and bit depth per pixel. Transposing flips go through 64x64 tiles,
+	// so that the reads from the working image stay within a few cache lines
+	// per output row.
+	void deferredCopy(uint8_t* scan0, int stride, int rowBegin, int rowEnd) {
+		const libraw_output_params_t &O = imgdata.params;
+		const int width = imgdata.sizes.width, height = imgdata.sizes.height;
+		const ushort* curve = imgdata.color.curve;
+
+		int channels;
+		const ushort* image = workingImage(&channels);
+		const int flip = imgdata.sizes.flip;
+		const int outWidth = flip & 4 ? height : width;
+		const int outHeight = flip & 4 ? width : height;
+		// Index in the working image of output pixel (row, col), as flip_index()
+		auto sourceIndex = [&](int row, int col) -> ptrdiff_t {
+			if (flip & 4) {
+				std::swap(row, col);
+			}
+			if (flip & 2) {
+				row = height - 1 - row;
+			}
+			if (flip & 1) {
+				col = width - 1 - col;
+			}
+			return ptrdiff_t(row) * width + col;
+		};
+		const int tileWidth = flip & 4 ? 64 : outWidth;
+		const int tileHeight = flip & 4 ? 64 : outHeight;
+		rowEnd = std::min(rowEnd, outHeight);
+		ushort rgb[3];
+		for (int tileRow = rowBegin; tileRow < rowEnd; tileRow += tileHeight) {
+			const int tileEnd = std::min(rowEnd, tileRow + tileHeight);
+			for (int tileCol = 0; tileCol < outWidth; tileCol += tileWidth) {
+				const int colEnd = std::min(outWidth, tileCol + tileWidth);
+				for (int row = tileRow; row < tileEnd; row++) {
+					const ptrdiff_t start = sourceIndex(row, tileCol);
+					const ptrdiff_t step = (colEnd - tileCol > 1 ? sourceIndex(row, tileCol + 1) - start : 0) * channels;
+					const ushort* src = image + start * channels;
+					if (O.output_bps == 8) {
+						uint8_t* out = scan0 + size_t(row - rowBegin) * stride + size_t(tileCol) * 3;
+						for (int col = tileCol; col < colEnd; col++, src += step, out += 3) {
+							convertPixel(src, rgb);
+							out[0] = curve[rgb[0]] >> 8;
+							out[1] = curve[rgb[1]] >> 8;
+							out[2] = curve[rgb[2]] >> 8;
+						}
+					} else {
+						ushort* out = reinterpret_cast<ushort*>(scan0 + size_t(row - rowBegin) * stride) + size_t(tileCol) * 3;
+						for (int col = tileCol; col < colEnd; col++, src += step, out += 3) {
+							convertPixel(src, rgb);
+							out[0] = curve[rgb[0]];
+							out[1] = curve[rgb[1]];
+							out[2] = curve[rgb[2]];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	static WASMProcessor* self(void* ctx) {
+		return static_cast<WASMProcessor*>(static_cast<LibRaw*>(ctx));
+	}
+
+	// Called by dcraw_process() right after raw2image_ex()
+	static void onRawCopied(void* ctx) {
+		self(ctx)->endStage("raw2image");
+		if (self(ctx)->releaseRawAfterCopy) {
+			self(ctx)->releaseRawData();
+		}
+	}
+
+	static void onInterpolate(void* ctx) {
+		self(ctx)->endStage("preprocess");	// black, scale_colors, pre_interpolate
+	}
+
+	static void onConvertToRgb(void* ctx) {
+		self(ctx)->endStage("demosaic");	// plus median filter and highlights
+	}
+
+	static void onConvertedToRgb(void* ctx) {
+		self(ctx)->endStage("convert");
+	}
+};
+
+// Render settings timeBudgetMs chooses, and their predicted cost
+struct RenderChoice {
+	int halfSize, userQual, dcbIterations, fbddNoiserd;
+	int downscale;	// output size divider, relative to the full size
+	double predictedMs;
+};
+
+// Render cost model of timeBudgetMs: nanoseconds per sensor pixel of a
+// process() with given settings (per camera), and per pixel of output. Every
+// render of the module feeds it. Settings never measured on this machine are
+// predicted from rough WASM SIMD figures, scaled by how fast this machine
+// turned out to be on the measured ones.
+class RenderCosts {
+public:
+	static RenderCosts& instance() {
+		// never destroyed: sessions may outlive static destructors
+		static RenderCosts* costs = new RenderCosts();
+		return *costs;
+	}
+
+	double perPixel(const std::string& key, double prior) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto it = costs.find(key);
+		return it != costs.end() ? it->second : prior * speed;
+	}
+
+	void learn(const std::string& key, double prior, double ms, double pixels) {
+		if (ms <= 0 || pixels <= 0) {
+			return;
+		}
+		const double ns = ms * 1e6 / pixels;
+		std::lock_guard<std::mutex> lock(mutex);
+		const auto it = costs.find(key);
+		if (it == costs.end()) {
+			costs[key] = ns;
+		} else {
+			it->second += LEARNING_RATE * (ns - it->second);	// follows load changes
+		}
+		speed += LEARNING_RATE * (ns / prior - speed);
+	}
+
+private:
+	static constexpr double LEARNING_RATE = 0.3;
+	std::mutex mutex;
+	std::map<std::string, double> costs;
+	double speed = 1.0;	// measured / prior
+};
+
+class WASMLibRaw {
+public:
+	WASMLibRaw() {
+		processor_ = new WASMProcessor();
+		processor_->set_progress_handler(&WASMLibRaw::onProgress, this);
+	}
+
+	~WASMLibRaw() {
+		joinProcessThread();
+		if (processor_) {
+			cleanupParamsStrings();
+            processor_->recycle();
+			delete processor_;
+			processor_ = nullptr;
+		}
+	}
+
+	void open(val jsBuffer, val settings) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+        // Release previous values, if any
+        processor_->recycle();
+
+		// Per file, unlike the LibRaw parameters
+		streamingRelease = processor_->releaseRawAfterCopy = false;
+		targetWidth = targetHeight = maxDimension = 0;
+		scaledWidth = scaledHeight = 0;
+		timeBudgetMs = 0;
+		budgetApplied = false;
+		fullWhitePoint = 0;
+		applySettings(settings);
+
+        copyToNativeVector(jsBuffer, buffer);
+		isUnpacked = isProcessed = false;
+		inputReleased = false;
+		contentHashHex.clear();
+		int ret = processor_->open_buffer((void*)buffer.data(), buffer.size());
+		if (ret != LIBRAW_SUCCESS) {
+			throw std::runtime_error("LibRaw: open_buffer() failed with code " + std::to_string(ret));
+		}
+	}
+
+	val metadata(bool fullOutput=false) {
+		if (!processor_) {
+			return val::undefined();
+		}
+		ensureIdle();
+
+		val meta = val::object();
+		// --------------------------------------------------------------------
+		// 1) Basic fields: sizes, camera info, etc.
+		// --------------------------------------------------------------------
+		const libraw_image_sizes_t &sizes = fileSizes();
+		unsigned orientedWidth  = sizes.width;
+		unsigned orientedHeight = sizes.height;
+		int flipCode = processor_->imgdata.sizes.flip;  // 0..7
+		if (flipCode == 5 || flipCode == 6 || flipCode == 7) {// rotations of 90/270:
+			std::swap(orientedWidth, orientedHeight);
+		}
+		meta.set("width",       orientedWidth);
+		meta.set("height",      orientedHeight);
+		meta.set("raw_width",   sizes.raw_width);
+		meta.set("raw_height",  sizes.raw_height);
+		meta.set("top_margin",  sizes.top_margin);
+		meta.set("left_margin", sizes.left_margin);
+
+		// Basic camera info
+		meta.set("camera_make",  std::string(processor_->imgdata.idata.make));
+		meta.set("camera_model", std::string(processor_->imgdata.idata.model));
+
+		// EXIF-like data
+		meta.set("iso_speed",  processor_->imgdata.other.iso_speed);
+		meta.set("shutter",	processor_->imgdata.other.shutter);
+		meta.set("aperture",   processor_->imgdata.other.aperture);
+		meta.set("focal_len",  processor_->imgdata.other.focal_len);
+		meta.set("timestamp",  double(processor_->imgdata.other.timestamp));
+		meta.set("shot_order", processor_->imgdata.other.shot_order);
+		meta.set("desc",	   std::string(processor_->imgdata.other.desc));
+		meta.set("artist",	 std::string(processor_->imgdata.other.artist));
+
+		// GPS data
+		val gpsData = val::object();
+
+		val latitudeArr = val::array();
+		for (int i = 0; i < 3; i++) {
+			latitudeArr.set(i, processor_->imgdata.other.parsed_gps.latitude[i]);
+		}
+		gpsData.set("latitude", latitudeArr);
+
+		val longitudeArr = val::array();
+		for (int i = 0; i < 3; i++) {
+			longitudeArr.set(i, processor_->imgdata.other.parsed_gps.longitude[i]);
+		}
+		gpsData.set("longitude", longitudeArr);
+		gpsData.set("altitude", processor_->imgdata.other.parsed_gps.altitude);
+			
+		meta.set("gps_data", gpsData);
+
+		// Thumbnail info
+		meta.set("thumb_width",  processor_->imgdata.thumbnail.twidth);
+		meta.set("thumb_height", processor_->imgdata.thumbnail.theight);
+		// Cast enum to int so we don't need to register it
+		meta.set("thumb_format",
+				static_cast<int>(processor_->imgdata.thumbnail.tformat));
+
+		if(fullOutput) {
+			// --------------------------------------------------------------------
+			// 2) Color data (imgdata.color)
+			// --------------------------------------------------------------------
+			const libraw_colordata_t &c = processor_->imgdata.color;
+			val colorData = val::object();
+			
+			colorData.set("black",		 c.black);
+			colorData.set("data_maximum",  c.data_maximum);
+			colorData.set("maximum",	   c.maximum);
+			colorData.set("fmaximum",	  c.fmaximum);
+			colorData.set("fnorm",		 c.fnorm);
+
+			{
+				val camMulArr = val::array();
+				for (int i = 0; i < 4; i++) {
+					camMulArr.set(i, c.cam_mul[i]);
+				}
+				colorData.set("cam_mul", camMulArr);
+			}
+			{
+				val preMulArr = val::array();
+				for (int i = 0; i < 4; i++) {
+					preMulArr.set(i, c.pre_mul[i]);
+				}
+				colorData.set("pre_mul", preMulArr);
+			}
+
+			// c.rgb_cam[3][4], c.cam_xyz[4][3], etc. can also be copied if needed.
+			colorData.set("flash_used",   c.flash_used);
+			colorData.set("canon_ev",	 c.canon_ev);
+			colorData.set("model2",	   std::string(c.model2));
+			colorData.set("UniqueCameraModel", std::string(c.UniqueCameraModel));
+			colorData.set("LocalizedCameraModel",
+						std::string(c.LocalizedCameraModel));
+			colorData.set("ImageUniqueID",	  std::string(c.ImageUniqueID));
+			colorData.set("RawDataUniqueID",	std::string(c.RawDataUniqueID));
+			colorData.set("raw_bps",	 (int)c.raw_bps);
+			colorData.set("ExifColorSpace", c.ExifColorSpace);
+			// dng_color, dng_levels, etc. also here if needed
+
+			meta.set("color_data", colorData);
+
+			// --------------------------------------------------------------------
+			// 3) Common metadata (imgdata.metadata)
+			// --------------------------------------------------------------------
+			const libraw_metadata_common_t &mcom = processor_->imgdata.makernotes.common;
+			val metaCommon = val::object();
+
+			metaCommon.set("FlashEC",				mcom.FlashEC);
+			metaCommon.set("FlashGN",				mcom.FlashGN);
+			metaCommon.set("CameraTemperature",	  mcom.CameraTemperature);
+			metaCommon.set("SensorTemperature",	  mcom.SensorTemperature);
+			metaCommon.set("SensorTemperature2",	 mcom.SensorTemperature2);
+			metaCommon.set("LensTemperature",		mcom.LensTemperature);
+			metaCommon.set("AmbientTemperature",	 mcom.AmbientTemperature);
+			metaCommon.set("BatteryTemperature",	 mcom.BatteryTemperature);
+			metaCommon.set("exifAmbientTemperature", mcom.exifAmbientTemperature);
+			metaCommon.set("exifHumidity",		   mcom.exifHumidity);
+			metaCommon.set("exifPressure",		   mcom.exifPressure);
+			metaCommon.set("exifWaterDepth",		 mcom.exifWaterDepth);
+			metaCommon.set("exifAcceleration",	   mcom.exifAcceleration);
+			metaCommon.set("exifCameraElevationAngle", mcom.exifCameraElevationAngle);
+			metaCommon.set("real_ISO", mcom.real_ISO);
+			metaCommon.set("exifExposureIndex", mcom.exifExposureIndex);
+			metaCommon.set("ColorSpace", (int)mcom.ColorSpace);
+			metaCommon.set("firmware",   std::string(mcom.firmware));
+			metaCommon.set("ExposureCalibrationShift", mcom.ExposureCalibrationShift);
+
+			// AF info data
+			{
+				val afArray = val::array();
+				for (int i = 0; i < mcom.afcount; i++) {
+					val afItem = val::object();
+					const libraw_afinfo_item_t &afdata = mcom.afdata[i];
+					afItem.set("AFInfoData_tag",	 afdata.AFInfoData_tag);
+					afItem.set("AFInfoData_order",   afdata.AFInfoData_order);
+					afItem.set("AFInfoData_version", afdata.AFInfoData_version);
+					afItem.set("AFInfoData_length",  afdata.AFInfoData_length);
+					// afdata.AFInfoData is a raw pointer
+					// We skip showing contents unless you want to copy them.
+					afArray.set(i, afItem);
+				}
+				metaCommon.set("afdata", afArray);
+			}
+
+			meta.set("metadata_common", metaCommon);
+
+			// --------------------------------------------------------------------
+			// 4) MakerNotes for the brand (conditional)
+			//	We store them in a property named after the brand, e.g. `canon`,
+			//	`nikon`, `sony`, etc.
+			// --------------------------------------------------------------------
+			std::string makeStr(processor_->imgdata.idata.make);
+			std::string makeLower = makeStr;
+			std::transform(makeLower.begin(), makeLower.end(), makeLower.begin(), [](unsigned char c){ return std::tolower(c); });
+
+			// ================ CANON ================
+			if (makeLower.find("canon") != std::string::npos)
+			{
+				val canonObj = val::object();
+				const libraw_canon_makernotes_t &cCanon =
+					processor_->imgdata.makernotes.canon;
+
+				canonObj.set("ColorDataVer",		cCanon.ColorDataVer);
+				canonObj.set("ColorDataSubVer",	 cCanon.ColorDataSubVer);
+				canonObj.set("SpecularWhiteLevel",  cCanon.SpecularWhiteLevel);
+				canonObj.set("NormalWhiteLevel",	cCanon.NormalWhiteLevel);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, cCanon.ChannelBlackLevel[i]);
+					}
+					canonObj.set("ChannelBlackLevel", arr);
+				}
+				canonObj.set("AverageBlackLevel", cCanon.AverageBlackLevel);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, cCanon.multishot[i]);
+					}
+					canonObj.set("multishot", arr);
+				}
+
+				canonObj.set("MeteringMode",		  cCanon.MeteringMode);
+				canonObj.set("SpotMeteringMode",	  cCanon.SpotMeteringMode);
+				canonObj.set("FlashMeteringMode",	 (int)cCanon.FlashMeteringMode);
+				canonObj.set("FlashExposureLock",	 cCanon.FlashExposureLock);
+				canonObj.set("ExposureMode",		  cCanon.ExposureMode);
+				canonObj.set("AESetting",			 cCanon.AESetting);
+				canonObj.set("ImageStabilization",	cCanon.ImageStabilization);
+				canonObj.set("FlashMode",			 cCanon.FlashMode);
+				canonObj.set("FlashActivity",		 cCanon.FlashActivity);
+				canonObj.set("FlashBits",			 cCanon.FlashBits);
+				canonObj.set("ManualFlashOutput",	 cCanon.ManualFlashOutput);
+				canonObj.set("FlashOutput",		   cCanon.FlashOutput);
+				canonObj.set("FlashGuideNumber",	  cCanon.FlashGuideNumber);
+				canonObj.set("ContinuousDrive",	   cCanon.ContinuousDrive);
+				canonObj.set("SensorWidth",		   cCanon.SensorWidth);
+				canonObj.set("SensorHeight",		  cCanon.SensorHeight);
+				canonObj.set("AFMicroAdjMode",		cCanon.AFMicroAdjMode);
+				canonObj.set("AFMicroAdjValue",	   cCanon.AFMicroAdjValue);
+				canonObj.set("MakernotesFlip",		cCanon.MakernotesFlip);
+				canonObj.set("RecordMode",			cCanon.RecordMode);
+				canonObj.set("SRAWQuality",		   cCanon.SRAWQuality);
+				canonObj.set("wbi",				   (unsigned)cCanon.wbi);
+				canonObj.set("RF_lensID",			 cCanon.RF_lensID);
+				canonObj.set("AutoLightingOptimizer", cCanon.AutoLightingOptimizer);
+				canonObj.set("HighlightTonePriority", cCanon.HighlightTonePriority);
+				canonObj.set("Quality",			   cCanon.Quality);
+				canonObj.set("CanonLog",			  cCanon.CanonLog);
+
+				
+				{
+					val arr = val::array();
+					for (int i = 0; i < 2; i++) {
+						arr.set(i, cCanon.ISOgain[i]);
+					}
+					canonObj.set("ISOgain", arr);
+				}
+
+				meta.set("canon", canonObj);
+			}
+			// ================ NIKON ================
+			else if (makeLower.find("nikon") != std::string::npos)
+			{
+				val nikonObj = val::object();
+				const libraw_nikon_makernotes_t &cNikon =
+					processor_->imgdata.makernotes.nikon;
+
+				nikonObj.set("ExposureBracketValue", cNikon.ExposureBracketValue);
+				nikonObj.set("ActiveDLighting",	  cNikon.ActiveDLighting);
+				nikonObj.set("ShootingMode",		 (int)cNikon.ShootingMode);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 7; i++) {
+						arr.set(i, cNikon.ImageStabilization[i]);
+					}
+					nikonObj.set("ImageStabilization", arr);
+				}
+
+				nikonObj.set("VibrationReduction",   (int)cNikon.VibrationReduction);
+				nikonObj.set("FlashSetting",		 std::string(cNikon.FlashSetting));
+				nikonObj.set("FlashType",		   std::string(cNikon.FlashType));
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, cNikon.FlashExposureCompensation[i]);
+					}
+					nikonObj.set("FlashExposureCompensation", arr);
+				}
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, cNikon.ExternalFlashExposureComp[i]);
+					}
+					nikonObj.set("ExternalFlashExposureComp", arr);
+				}
+
+				nikonObj.set("FlashExposureBracketValue0",
+							cNikon.FlashExposureBracketValue[0]);
+				nikonObj.set("FlashExposureBracketValue1",
+							cNikon.FlashExposureBracketValue[1]);
+				nikonObj.set("FlashExposureBracketValue2",
+							cNikon.FlashExposureBracketValue[2]);
+				nikonObj.set("FlashExposureBracketValue3",
+							cNikon.FlashExposureBracketValue[3]);
+
+				nikonObj.set("FlashMode",				(int)cNikon.FlashMode);
+				nikonObj.set("FlashExposureCompensation2", 
+													(int)cNikon.FlashExposureCompensation2);
+				nikonObj.set("FlashExposureCompensation3", 
+													(int)cNikon.FlashExposureCompensation3);
+				nikonObj.set("FlashExposureCompensation4", 
+													(int)cNikon.FlashExposureCompensation4);
+				nikonObj.set("FlashSource",			 (int)cNikon.FlashSource);
+				nikonObj.set("FlashFirmware0",		  (int)cNikon.FlashFirmware[0]);
+				nikonObj.set("FlashFirmware1",		  (int)cNikon.FlashFirmware[1]);
+				nikonObj.set("ExternalFlashFlags",	  (int)cNikon.ExternalFlashFlags);
+				nikonObj.set("FlashControlCommanderMode",(int)cNikon.FlashControlCommanderMode);
+				nikonObj.set("FlashOutputAndCompensation",(int)cNikon.FlashOutputAndCompensation);
+				nikonObj.set("FlashFocalLength",		(int)cNikon.FlashFocalLength);
+				nikonObj.set("FlashGNDistance",		 (int)cNikon.FlashGNDistance);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, (int)cNikon.FlashGroupOutputAndCompensation[i]);
+					}
+					nikonObj.set("FlashGroupOutputAndCompensation", arr);
+				}
+
+				nikonObj.set("FlashGroupControlMode0", (int)cNikon.FlashGroupControlMode[0]);
+				nikonObj.set("FlashGroupControlMode1", (int)cNikon.FlashGroupControlMode[1]);
+				nikonObj.set("FlashGroupControlMode2", (int)cNikon.FlashGroupControlMode[2]);
+				nikonObj.set("FlashGroupControlMode3", (int)cNikon.FlashGroupControlMode[3]);
+
+				nikonObj.set("FlashColorFilter",	 (int)cNikon.FlashColorFilter);
+				nikonObj.set("NEFCompression",	   (int)cNikon.NEFCompression);
+				nikonObj.set("ExposureMode",		 cNikon.ExposureMode);
+				nikonObj.set("ExposureProgram",	  cNikon.ExposureProgram);
+				nikonObj.set("nMEshots",			 cNikon.nMEshots);
+				nikonObj.set("MEgainOn",			 (int)cNikon.MEgainOn);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, cNikon.ME_WB[i]);
+					}
+					nikonObj.set("ME_WB", arr);
+				}
+
+				nikonObj.set("AFFineTune",	   (int)cNikon.AFFineTune);
+				nikonObj.set("AFFineTuneIndex",  (int)cNikon.AFFineTuneIndex);
+				nikonObj.set("AFFineTuneAdj",	(int)cNikon.AFFineTuneAdj);
+				nikonObj.set("LensDataVersion",  cNikon.LensDataVersion);
+				nikonObj.set("FlashInfoVersion", cNikon.FlashInfoVersion);
+				nikonObj.set("ColorBalanceVersion", cNikon.ColorBalanceVersion);
+				nikonObj.set("key", (int)cNikon.key);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 4; i++) {
+						arr.set(i, cNikon.NEFBitDepth[i]);
+					}
+					nikonObj.set("NEFBitDepth", arr);
+				}
+
+				nikonObj.set("HighSpeedCropFormat",  (int)cNikon.HighSpeedCropFormat);
+				val hsc = val::object();
+				hsc.set("cleft",   cNikon.SensorHighSpeedCrop.cleft);
+				hsc.set("ctop",	cNikon.SensorHighSpeedCrop.ctop);
+				hsc.set("cwidth",  cNikon.SensorHighSpeedCrop.cwidth);
+				hsc.set("cheight", cNikon.SensorHighSpeedCrop.cheight);
+				nikonObj.set("SensorHighSpeedCrop", hsc);
+
+				nikonObj.set("SensorWidth",  (int)cNikon.SensorWidth);
+				nikonObj.set("SensorHeight", (int)cNikon.SensorHeight);
+				nikonObj.set("Active_D_Lighting", (int)cNikon.Active_D_Lighting);
+				nikonObj.set("ShotInfoVersion",   cNikon.ShotInfoVersion);
+				nikonObj.set("MakernotesFlip",	cNikon.MakernotesFlip);
+				nikonObj.set("RollAngle",		 cNikon.RollAngle);
+				nikonObj.set("PitchAngle",		cNikon.PitchAngle);
+				nikonObj.set("YawAngle",		  cNikon.YawAngle);
+
+				meta.set("nikon", nikonObj);
+			}
+			// ================ FUJI ================
+			else if (makeLower.find("fuji") != std::string::npos ||
+					makeLower.find("fujifilm") != std::string::npos)
+			{
+				val fujiObj = val::object();
+				const libraw_fuji_info_t &cFuji =
+					processor_->imgdata.makernotes.fuji;
+
+				fujiObj.set("ExpoMidPointShift",		cFuji.ExpoMidPointShift);
+				fujiObj.set("DynamicRange",			 cFuji.DynamicRange);
+				fujiObj.set("FilmMode",				 cFuji.FilmMode);
+				fujiObj.set("DynamicRangeSetting",	  cFuji.DynamicRangeSetting);
+				fujiObj.set("DevelopmentDynamicRange",  cFuji.DevelopmentDynamicRange);
+				fujiObj.set("AutoDynamicRange",		 cFuji.AutoDynamicRange);
+				fujiObj.set("DRangePriority",		   cFuji.DRangePriority);
+				fujiObj.set("DRangePriorityAuto",	   cFuji.DRangePriorityAuto);
+				fujiObj.set("DRangePriorityFixed",	  cFuji.DRangePriorityFixed);
+				fujiObj.set("BrightnessCompensation",   cFuji.BrightnessCompensation);
+				fujiObj.set("FocusMode",				cFuji.FocusMode);
+				fujiObj.set("AFMode",				   cFuji.AFMode);
+
+				{
+					val arr = val::array();
+					arr.set(0, cFuji.FocusPixel[0]);
+					arr.set(1, cFuji.FocusPixel[1]);
+					fujiObj.set("FocusPixel", arr);
+				}
+
+				fujiObj.set("PrioritySettings",		 cFuji.PrioritySettings);
+				fujiObj.set("FocusSettings",			cFuji.FocusSettings);
+				fujiObj.set("AF_C_Settings",			cFuji.AF_C_Settings);
+				fujiObj.set("FocusWarning",			 cFuji.FocusWarning);
+
+				{
+					val arr = val::array();
+					arr.set(0, cFuji.ImageStabilization[0]);
+					arr.set(1, cFuji.ImageStabilization[1]);
+					arr.set(2, cFuji.ImageStabilization[2]);
+					fujiObj.set("ImageStabilization", arr);
+				}
+
+				fujiObj.set("FlashMode",		cFuji.FlashMode);
+				fujiObj.set("WB_Preset",		cFuji.WB_Preset);
+				fujiObj.set("ShutterType",	  cFuji.ShutterType);
+				fujiObj.set("ExrMode",		  cFuji.ExrMode);
+				fujiObj.set("Macro",		   (int)cFuji.Macro);
+				fujiObj.set("Rating",		 (int)cFuji.Rating);
+				fujiObj.set("CropMode",	   (int)cFuji.CropMode);
+
+				fujiObj.set("SerialSignature", std::string(cFuji.SerialSignature));
+				fujiObj.set("SensorID",		std::string(cFuji.SensorID));
+				fujiObj.set("RAFVersion",	  std::string(cFuji.RAFVersion));
+				fujiObj.set("RAFDataGeneration", cFuji.RAFDataGeneration);
+				fujiObj.set("RAFDataVersion",	cFuji.RAFDataVersion);
+				fujiObj.set("isTSNERDTS",		cFuji.isTSNERDTS);
+				fujiObj.set("DriveMode",		 (int)cFuji.DriveMode);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 9; i++) {
+						arr.set(i, cFuji.BlackLevel[i]);
+					}
+					fujiObj.set("BlackLevel", arr);
+				}
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 32; i++) {
+						arr.set(i, cFuji.RAFData_ImageSizeTable[i]);
+					}
+					fujiObj.set("RAFData_ImageSizeTable", arr);
+				}
+				fujiObj.set("AutoBracketing",	cFuji.AutoBracketing);
+				fujiObj.set("SequenceNumber",	cFuji.SequenceNumber);
+				fujiObj.set("SeriesLength",	  cFuji.SeriesLength);
+
+				{
+					val arr = val::array();
+					arr.set(0, cFuji.PixelShiftOffset[0]);
+					arr.set(1, cFuji.PixelShiftOffset[1]);
+					fujiObj.set("PixelShiftOffset", arr);
+				}
+
+				fujiObj.set("ImageCount", cFuji.ImageCount);
+
+				meta.set("fuji", fujiObj);
+			}
+			// ================ SONY ================
+			else if (makeLower.find("sony") != std::string::npos)
+			{
+				val sonyObj = val::object();
+				const libraw_sony_info_t &cSony =
+					processor_->imgdata.makernotes.sony;
+
+				sonyObj.set("CameraType",		 (int)cSony.CameraType);
+				sonyObj.set("Sony0x9400_version", (int)cSony.Sony0x9400_version);
+				sonyObj.set("Sony0x9400_ReleaseMode2",
+							(int)cSony.Sony0x9400_ReleaseMode2);
+				sonyObj.set("Sony0x9400_SequenceImageNumber",
+							cSony.Sony0x9400_SequenceImageNumber);
+				sonyObj.set("Sony0x9400_SequenceLength1",
+							(int)cSony.Sony0x9400_SequenceLength1);
+				sonyObj.set("Sony0x9400_SequenceFileNumber",
+							cSony.Sony0x9400_SequenceFileNumber);
+				sonyObj.set("Sony0x9400_SequenceLength2",
+							(int)cSony.Sony0x9400_SequenceLength2);
+				sonyObj.set("AFAreaModeSetting",	 (int)cSony.AFAreaModeSetting);
+				sonyObj.set("AFAreaMode",			(int)cSony.AFAreaMode);
+				{
+					val arr = val::array();
+					arr.set(0, cSony.FlexibleSpotPosition[0]);
+					arr.set(1, cSony.FlexibleSpotPosition[1]);
+					sonyObj.set("FlexibleSpotPosition", arr);
+				}
+				sonyObj.set("AFPointSelected",	  (int)cSony.AFPointSelected);
+				sonyObj.set("AFPointSelected_0x201e",(int)cSony.AFPointSelected_0x201e);
+				sonyObj.set("AFType",			   (int)cSony.AFType);
+
+				{
+					val arr = val::array();
+					arr.set(0, cSony.FocusLocation[0]);
+					arr.set(1, cSony.FocusLocation[1]);
+					arr.set(2, cSony.FocusLocation[2]);
+					arr.set(3, cSony.FocusLocation[3]);
+					sonyObj.set("FocusLocation", arr);
+				}
+
+				sonyObj.set("FocusPosition",	  (int)cSony.FocusPosition);
+				sonyObj.set("AFMicroAdjValue",	(int)cSony.AFMicroAdjValue);
+				sonyObj.set("AFMicroAdjOn",	   (int)cSony.AFMicroAdjOn);
+				sonyObj.set("AFMicroAdjRegisteredLenses",
+							(int)cSony.AFMicroAdjRegisteredLenses);
+				sonyObj.set("VariableLowPassFilter",
+							(int)cSony.VariableLowPassFilter);
+				sonyObj.set("LongExposureNoiseReduction",
+							cSony.LongExposureNoiseReduction);
+				sonyObj.set("HighISONoiseReduction",
+							(int)cSony.HighISONoiseReduction);
+
+				{
+					val arr = val::array();
+					arr.set(0, cSony.HDR[0]);
+					arr.set(1, cSony.HDR[1]);
+					sonyObj.set("HDR", arr);
+				}
+
+				sonyObj.set("group2010",		(int)cSony.group2010);
+				sonyObj.set("group9050",		(int)cSony.group9050);
+				sonyObj.set("real_iso_offset",  (int)cSony.real_iso_offset);
+				sonyObj.set("MeteringMode_offset",(int)cSony.MeteringMode_offset);
+				sonyObj.set("ExposureProgram_offset",(int)cSony.ExposureProgram_offset);
+				sonyObj.set("ReleaseMode2_offset",(int)cSony.ReleaseMode2_offset);
+				sonyObj.set("MinoltaCamID",	  cSony.MinoltaCamID);
+				sonyObj.set("firmware",		  cSony.firmware);
+				sonyObj.set("ImageCount3_offset",(int)cSony.ImageCount3_offset);
+				sonyObj.set("ImageCount3",	   cSony.ImageCount3);
+				sonyObj.set("ElectronicFrontCurtainShutter",
+							cSony.ElectronicFrontCurtainShutter);
+				sonyObj.set("MeteringMode2",	 (int)cSony.MeteringMode2);
+				sonyObj.set("SonyDateTime",	  std::string(cSony.SonyDateTime));
+				sonyObj.set("ShotNumberSincePowerUp",
+							cSony.ShotNumberSincePowerUp);
+				sonyObj.set("PixelShiftGroupPrefix",   cSony.PixelShiftGroupPrefix);
+				sonyObj.set("PixelShiftGroupID",	   cSony.PixelShiftGroupID);
+				sonyObj.set("nShotsInPixelShiftGroup", (int)cSony.nShotsInPixelShiftGroup);
+				sonyObj.set("numInPixelShiftGroup",	(int)cSony.numInPixelShiftGroup);
+				sonyObj.set("prd_ImageHeight",		 cSony.prd_ImageHeight);
+				sonyObj.set("prd_ImageWidth",		  cSony.prd_ImageWidth);
+				sonyObj.set("prd_Total_bps",		   cSony.prd_Total_bps);
+				sonyObj.set("prd_Active_bps",		  cSony.prd_Active_bps);
+				sonyObj.set("prd_StorageMethod",	   cSony.prd_StorageMethod);
+				sonyObj.set("prd_BayerPattern",		cSony.prd_BayerPattern);
+				sonyObj.set("SonyRawFileType",		 (int)cSony.SonyRawFileType);
+				sonyObj.set("RAWFileType",			 (int)cSony.RAWFileType);
+				sonyObj.set("RawSizeType",			 (int)cSony.RawSizeType);
+				sonyObj.set("Quality",				 cSony.Quality);
+				sonyObj.set("FileFormat",			  cSony.FileFormat);
+				sonyObj.set("MetaVersion",			 std::string(cSony.MetaVersion));
+
+				meta.set("sony", sonyObj);
+			}
+			// ================ PANASONIC ================
+			else if (makeLower.find("panasonic") != std::string::npos)
+			{
+				val panObj = val::object();
+				const libraw_panasonic_makernotes_t &cPan =
+					processor_->imgdata.makernotes.panasonic;
+
+				panObj.set("Compression",	   (int)cPan.Compression);
+				panObj.set("BlackLevelDim",	 (int)cPan.BlackLevelDim);
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 8; i++) {
+						arr.set(i, cPan.BlackLevel[i]);
+					}
+					panObj.set("BlackLevel", arr);
+				}
+
+				panObj.set("Multishot",	  cPan.Multishot);
+				panObj.set("gamma",		  cPan.gamma);
+
+				{
+					val arr = val::array();
+					arr.set(0, cPan.HighISOMultiplier[0]);
+					arr.set(1, cPan.HighISOMultiplier[1]);
+					arr.set(2, cPan.HighISOMultiplier[2]);
+					panObj.set("HighISOMultiplier", arr);
+				}
+
+				panObj.set("FocusStepNear",	 cPan.FocusStepNear);
+				panObj.set("FocusStepCount",	cPan.FocusStepCount);
+				panObj.set("ZoomPosition",	  cPan.ZoomPosition);
+				panObj.set("LensManufacturer",  cPan.LensManufacturer);
+
+				meta.set("panasonic", panObj);
+			}
+			// ================ OLYMPUS ================
+			else if (makeLower.find("olympus") != std::string::npos)
+			{
+				val olyObj = val::object();
+				const libraw_olympus_makernotes_t &cOly =
+					processor_->imgdata.makernotes.olympus;
+
+				{
+					val arr = val::array();
+					arr.set(0, cOly.CameraType2[0]);
+					arr.set(1, cOly.CameraType2[1]);
+					arr.set(2, cOly.CameraType2[2]);
+					arr.set(3, cOly.CameraType2[3]);
+					arr.set(4, cOly.CameraType2[4]);
+					arr.set(5, cOly.CameraType2[5]);
+					olyObj.set("CameraType2", arr);
+				}
+				olyObj.set("ValidBits",		(int)cOly.ValidBits);
+
+				{
+					val arr = val::array();
+					arr.set(0, cOly.DriveMode[0]);
+					arr.set(1, cOly.DriveMode[1]);
+					arr.set(2, cOly.DriveMode[2]);
+					arr.set(3, cOly.DriveMode[3]);
+					arr.set(4, cOly.DriveMode[4]);
+					olyObj.set("DriveMode", arr);
+				}
+
+				olyObj.set("ColorSpace",  (int)cOly.ColorSpace);
+				{
+					val arr = val::array();
+					arr.set(0, cOly.FocusMode[0]);
+					arr.set(1, cOly.FocusMode[1]);
+					olyObj.set("FocusMode", arr);
+				}
+				olyObj.set("AutoFocus",		(int)cOly.AutoFocus);
+				olyObj.set("AFPoint",		 (int)cOly.AFPoint);
+				{
+					val arr = val::array();
+					for (int i = 0; i < 64; i++) {
+						arr.set(i, cOly.AFAreas[i]);
+					}
+					olyObj.set("AFAreas", arr);
+				}
+				{
+					val arr = val::array();
+					arr.set(0, cOly.AFPointSelected[0]);
+					arr.set(1, cOly.AFPointSelected[1]);
+					olyObj.set("AFPointSelected", arr);
+				}
+
+				olyObj.set("AFResult", (int)cOly.AFResult);
+				olyObj.set("AFFineTune", (int)cOly.AFFineTune);
+
+				{
+					val arr = val::array();
+					arr.set(0, (int)cOly.AFFineTuneAdj[0]);
+					arr.set(1, (int)cOly.AFFineTuneAdj[1]);
+					arr.set(2, (int)cOly.AFFineTuneAdj[2]);
+					olyObj.set("AFFineTuneAdj", arr);
+				}
+
+				// Many more fields exist in the struct if you want them all.
+				olyObj.set("AspectFrameLeft",  (int)cOly.AspectFrame[0]);
+				olyObj.set("AspectFrameTop",   (int)cOly.AspectFrame[1]);
+				olyObj.set("AspectFrameWidth", (int)cOly.AspectFrame[2]);
+				olyObj.set("AspectFrameHeight",(int)cOly.AspectFrame[3]);
+				olyObj.set("Panorama_mode",	cOly.Panorama_mode);
+				olyObj.set("Panorama_frameNum",cOly.Panorama_frameNum);
+
+				meta.set("olympus", olyObj);
+			}
+			// ================ PENTAX ================
+			else if (makeLower.find("pentax") != std::string::npos)
+			{
+				val pentaxObj = val::object();
+				const libraw_pentax_makernotes_t &cPent =
+					processor_->imgdata.makernotes.pentax;
 
 				{
 					val arr = val::array();
@@ -701,274 +2197,1699 @@ public:
 					arr.set(3, cPent.DriveMode[3]);
 					pentaxObj.set("DriveMode", arr);
 				}
-				{
-					val arr = val::array();
-					arr.set(0, cPent.FocusMode[0]);
-					arr.set(1, cPent.FocusMode[1]);
-					pentaxObj.set("FocusMode", arr);
+				{
+					val arr = val::array();
+					arr.set(0, cPent.FocusMode[0]);
+					arr.set(1, cPent.FocusMode[1]);
+					pentaxObj.set("FocusMode", arr);
+				}
+				{
+					val arr = val::array();
+					arr.set(0, cPent.AFPointSelected[0]);
+					arr.set(1, cPent.AFPointSelected[1]);
+					pentaxObj.set("AFPointSelected", arr);
+				}
+				pentaxObj.set("AFPointSelected_Area", (int)cPent.AFPointSelected_Area);
+				pentaxObj.set("AFPointsInFocus_version", cPent.AFPointsInFocus_version);
+				pentaxObj.set("AFPointsInFocus",	   (unsigned)cPent.AFPointsInFocus);
+				pentaxObj.set("FocusPosition",		 cPent.FocusPosition);
+				pentaxObj.set("AFAdjustment",		  cPent.AFAdjustment);
+				pentaxObj.set("AFPointMode",		   (int)cPent.AFPointMode);
+				pentaxObj.set("MultiExposure",		 (int)cPent.MultiExposure);
+				pentaxObj.set("Quality",			   cPent.Quality);
+
+				meta.set("pentax", pentaxObj);
+			}
+			// ================ HASSELBLAD ================
+			else if (makeLower.find("hasselblad") != std::string::npos)
+			{
+				val hassObj = val::object();
+				const libraw_hasselblad_makernotes_t &cHass =
+					processor_->imgdata.makernotes.hasselblad;
+
+				hassObj.set("BaseISO",		  cHass.BaseISO);
+				hassObj.set("Gain",			cHass.Gain);
+				hassObj.set("Sensor",		  std::string(cHass.Sensor));
+				hassObj.set("SensorUnit",	  std::string(cHass.SensorUnit));
+				hassObj.set("HostBody",		std::string(cHass.HostBody));
+				hassObj.set("SensorCode",	  cHass.SensorCode);
+				hassObj.set("SensorSubCode",   cHass.SensorSubCode);
+				hassObj.set("CoatingCode",	 cHass.CoatingCode);
+				hassObj.set("uncropped",	   cHass.uncropped);
+				hassObj.set("CaptureSequenceInitiator",
+							std::string(cHass.CaptureSequenceInitiator));
+				hassObj.set("SensorUnitConnector",
+							std::string(cHass.SensorUnitConnector));
+				hassObj.set("format",		  cHass.format);
+				{
+					val arr = val::array();
+					arr.set(0, cHass.nIFD_CM[0]);
+					arr.set(1, cHass.nIFD_CM[1]);
+					hassObj.set("nIFD_CM", arr);
+				}
+				{
+					val arr = val::array();
+					arr.set(0, cHass.RecommendedCrop[0]);
+					arr.set(1, cHass.RecommendedCrop[1]);
+					hassObj.set("RecommendedCrop", arr);
+				}
+				{
+					// 4x3 matrix
+					val outer = val::array();
+					for (int i = 0; i < 4; i++) {
+						val row = val::array();
+						for (int j = 0; j < 3; j++) {
+							row.set(j, cHass.mnColorMatrix[i][j]);
+						}
+						outer.set(i, row);
+					}
+					hassObj.set("mnColorMatrix", outer);
+				}
+
+				meta.set("hasselblad", hassObj);
+			}
+			// ================ RICOH ================
+			else if (makeLower.find("ricoh") != std::string::npos)
+			{
+				val ricohObj = val::object();
+				const libraw_ricoh_makernotes_t &cRicoh =
+					processor_->imgdata.makernotes.ricoh;
+
+				ricohObj.set("AFStatus",		 cRicoh.AFStatus);
+
+				{
+					val arrX = val::array();
+					arrX.set(0, cRicoh.AFAreaXPosition[0]);
+					arrX.set(1, cRicoh.AFAreaXPosition[1]);
+					ricohObj.set("AFAreaXPosition", arrX);
+				}
+				{
+					val arrY = val::array();
+					arrY.set(0, cRicoh.AFAreaYPosition[0]);
+					arrY.set(1, cRicoh.AFAreaYPosition[1]);
+					ricohObj.set("AFAreaYPosition", arrY);
+				}
+				ricohObj.set("AFAreaMode",		 (int)cRicoh.AFAreaMode);
+				ricohObj.set("SensorWidth",		cRicoh.SensorWidth);
+				ricohObj.set("SensorHeight",	   cRicoh.SensorHeight);
+				ricohObj.set("CroppedImageWidth",  cRicoh.CroppedImageWidth);
+				ricohObj.set("CroppedImageHeight", cRicoh.CroppedImageHeight);
+				ricohObj.set("WideAdapter",		cRicoh.WideAdapter);
+				ricohObj.set("CropMode",		   cRicoh.CropMode);
+				ricohObj.set("NDFilter",		   cRicoh.NDFilter);
+				ricohObj.set("AutoBracketing",	 cRicoh.AutoBracketing);
+				ricohObj.set("MacroMode",		  cRicoh.MacroMode);
+				ricohObj.set("FlashMode",		  cRicoh.FlashMode);
+				ricohObj.set("FlashExposureComp",  cRicoh.FlashExposureComp);
+				ricohObj.set("ManualFlashOutput",  cRicoh.ManualFlashOutput);
+
+				meta.set("ricoh", ricohObj);
+			}
+			// ================ SAMSUNG ================
+			else if (makeLower.find("samsung") != std::string::npos)
+			{
+				val samsungObj = val::object();
+				const libraw_samsung_makernotes_t &cSamsung =
+					processor_->imgdata.makernotes.samsung;
+
+				{
+					val arr = val::array();
+					arr.set(0, cSamsung.ImageSizeFull[0]);
+					arr.set(1, cSamsung.ImageSizeFull[1]);
+					arr.set(2, cSamsung.ImageSizeFull[2]);
+					arr.set(3, cSamsung.ImageSizeFull[3]);
+					samsungObj.set("ImageSizeFull", arr);
+				}
+				{
+					val arr = val::array();
+					arr.set(0, cSamsung.ImageSizeCrop[0]);
+					arr.set(1, cSamsung.ImageSizeCrop[1]);
+					arr.set(2, cSamsung.ImageSizeCrop[2]);
+					arr.set(3, cSamsung.ImageSizeCrop[3]);
+					samsungObj.set("ImageSizeCrop", arr);
+				}
+
+				{
+					val arr = val::array();
+					for (int i = 0; i < 11; i++) {
+						arr.set(i, cSamsung.key[i]);
+					}
+					samsungObj.set("key", arr);
+				}
+
+				samsungObj.set("ColorSpace0", cSamsung.ColorSpace[0]);
+				samsungObj.set("ColorSpace1", cSamsung.ColorSpace[1]);
+
+				samsungObj.set("DigitalGain", cSamsung.DigitalGain);
+				samsungObj.set("DeviceType",  cSamsung.DeviceType);
+				samsungObj.set("LensFirmware", std::string(cSamsung.LensFirmware));
+
+				meta.set("samsung", samsungObj);
+			}
+			// ================ KODAK ================
+			else if (makeLower.find("kodak") != std::string::npos)
+			{
+				val kodakObj = val::object();
+				const libraw_kodak_makernotes_t &cKodak =
+					processor_->imgdata.makernotes.kodak;
+
+				kodakObj.set("BlackLevelTop",	  cKodak.BlackLevelTop);
+				kodakObj.set("BlackLevelBottom",   cKodak.BlackLevelBottom);
+				kodakObj.set("offset_left",		cKodak.offset_left);
+				kodakObj.set("offset_top",		 cKodak.offset_top);
+				kodakObj.set("clipBlack",		  cKodak.clipBlack);
+				kodakObj.set("clipWhite",		  cKodak.clipWhite);
+
+				kodakObj.set("val018percent", cKodak.val018percent);
+				kodakObj.set("val100percent", cKodak.val100percent);
+				kodakObj.set("val170percent", cKodak.val170percent);
+				kodakObj.set("MakerNoteKodak8a", cKodak.MakerNoteKodak8a);
+				kodakObj.set("ISOCalibrationGain", cKodak.ISOCalibrationGain);
+				kodakObj.set("AnalogISO", cKodak.AnalogISO);
+
+				meta.set("kodak", kodakObj);
+			}
+			// ================ PHASE ONE (p1) ================
+			else if (makeLower.find("phase one") != std::string::npos)
+			{
+				val p1Obj = val::object();
+				const libraw_p1_makernotes_t &cP1 = processor_->imgdata.makernotes.phaseone;
+
+				p1Obj.set("Software",	   std::string(cP1.Software));
+				p1Obj.set("SystemType",	 std::string(cP1.SystemType));
+				p1Obj.set("FirmwareString", std::string(cP1.FirmwareString));
+				p1Obj.set("SystemModel",	std::string(cP1.SystemModel));
+
+				meta.set("p1", p1Obj);
+			}	
+		}
+		return meta;
+	}
+
+	val imageData() {
+		if (!processor_) {
+			return val::undefined();
+		}
+		ensureIdle();
+
+		Bitmap bitmap;
+		if (!renderBitmap(bitmap)) {
+			return val::undefined();
+		}
+
+		return bitmapObject(bitmap);
+	}
+
+	/**
+	 * The output bitmap in bands of `rows` rows (default 256), top to bottom:
+	 * `onBand({y, width, height, colors, bits, data})` for each band, `data`
+	 * being a view of a band buffer that the next band overwrites. With the
+	 * deferred color conversion each band is converted from the working image
+	 * when it is due, so the whole output never exists at once; otherwise (and
+	 * at a target size) the bitmap imageData() returns is handed out in bands.
+	 */
+	val streamRows(val options, val onBand) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		const int bandRows = std::max(1, settingOr(options, "rows", 256));
+		ensureProcessed();
+
+		int width, height, colors, bps;
+		processor_->outputFormat(&width, &height, &colors, &bps);
+		const bool scaledOutput = scaledWidth && (scaledWidth < width || scaledHeight < height);
+		const uint8_t* pixels = nullptr;
+		std::vector<uint8_t> band;
+		if (processor_->rowsOnDemand() && !scaledOutput) {
+			processor_->beginRows();
+			fullWhitePoint = processor_->whitePoint;
+			std::vector<uint8_t>().swap(output);	// not needed by this output
+		} else {
+			Bitmap bitmap;
+			if (!renderBitmap(bitmap)) {
+				throw std::runtime_error("LibRaw: copy_mem_image() failed");
+			}
+			pixels = bitmap.data;
+			width = bitmap.width;
+			height = bitmap.height;
+		}
+
+		const size_t rowBytes = size_t(width) * colors * (bps / 8);
+		const double outputStart = emscripten_get_now();
+		int bands = 0;
+		for (int y = 0; y < height; y += bandRows, bands++) {
+			const int rows = std::min(bandRows, height - y);
+			const uint8_t* data = pixels + size_t(y) * rowBytes;
+			if (!pixels) {
+				band.resize(size_t(rows) * rowBytes);
+				processor_->copyRows(band.data(), int(rowBytes), y, y + rows);
+				data = band.data();
+			}
+			val bandObj = val::object();
+			bandObj.set("y",      y);
+			bandObj.set("width",  width);
+			bandObj.set("height", rows);
+			bandObj.set("colors", colors);
+			bandObj.set("bits",   bps);
+			if (bps == 16) {
+				bandObj.set("data", val(typed_memory_view(size_t(rows) * rowBytes / 2, reinterpret_cast<const uint16_t*>(data))));
+			} else {
+				bandObj.set("data", val(typed_memory_view(size_t(rows) * rowBytes, data)));
+			}
+			onBand(bandObj);
+		}
+		if (!pixels) {
+			processor_->timings.emplace_back("output", emscripten_get_now() - outputStart);
+		}
+
+		val summary = val::object();
+		summary.set("width",  width);
+		summary.set("height", height);
+		summary.set("colors", colors);
+		summary.set("bits",   bps);
+		summary.set("bands",  bands);
+		return summary;
+	}
+
+	/**
+	 * Mip levels of the rendered image, cut into tiles for tiled viewers.
+	 * Level 0 is what imageData() returns, every next level halves the
+	 * previous one with a 2x2 box filter, down to a level that fits in a
+	 * single tile (or `levels` levels). Each level is built from the one
+	 * above, so the full-size bitmap is read once.
+	 */
+	val pyramid(val options) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		const int tileSize = std::max(1, settingOr(options, "tileSize", 256));
+		const int maxLevels = settingOr(options, "levels", 0);
+
+		Bitmap bitmap;
+		if (!renderBitmap(bitmap)) {
+			throw std::runtime_error("LibRaw: pyramid() couldn't render the image");
+		}
+		const double pyramidStart = emscripten_get_now();
+		const int colors = bitmap.colors, bytes = bitmap.bps / 8;
+
+		val levelsArr = val::array();
+		val tilesArr = val::array();
+		std::vector<uint8_t> previous, current, tile;
+		const uint8_t* level = bitmap.data;
+		int width = bitmap.width, height = bitmap.height;
+		for (int index = 0; ; index++) {
+			const int columns = (width + tileSize - 1) / tileSize;
+			const int rows = (height + tileSize - 1) / tileSize;
+			val levelObj = val::object();
+			levelObj.set("level",   index);
+			levelObj.set("width",   width);
+			levelObj.set("height",  height);
+			levelObj.set("columns", columns);
+			levelObj.set("rows",    rows);
+			levelsArr.call<void>("push", levelObj);
+
+			const size_t rowBytes = size_t(width) * colors * bytes;
+			for (int ty = 0; ty < rows; ty++) {
+				for (int tx = 0; tx < columns; tx++) {
+					const int tileWidth = std::min(tileSize, width - tx * tileSize);
+					const int tileHeight = std::min(tileSize, height - ty * tileSize);
+					const size_t tileRowBytes = size_t(tileWidth) * colors * bytes;
+					tile.resize(tileRowBytes * tileHeight);
+					for (int y = 0; y < tileHeight; y++) {
+						memcpy(&tile[y * tileRowBytes],
+							level + size_t(ty * tileSize + y) * rowBytes + size_t(tx) * tileSize * colors * bytes, tileRowBytes);
+					}
+					val tileObj = val::object();
+					tileObj.set("level",  index);
+					tileObj.set("column", tx);
+					tileObj.set("row",    ty);
+					tileObj.set("width",  tileWidth);
+					tileObj.set("height", tileHeight);
+					tileObj.set("data", toJSTypedArray(bitmap.bps, tile.size(), tile.data()));
+					tilesArr.call<void>("push", tileObj);
+				}
+			}
+
+			if ((width <= tileSize && height <= tileSize) || (maxLevels > 0 && index + 1 >= maxLevels) ||
+					(width == 1 && height == 1)) {
+				break;
+			}
+			const int nextWidth = (width + 1) / 2, nextHeight = (height + 1) / 2;
+			current.resize(size_t(nextWidth) * nextHeight * colors * bytes);
+			if (bytes == 2) {
+				boxHalve(reinterpret_cast<const uint16_t*>(level), width, height,
+					reinterpret_cast<uint16_t*>(current.data()), colors);
+			} else {
+				boxHalve(level, width, height, current.data(), colors);
+			}
+			previous.swap(current);
+			level = previous.data();
+			width = nextWidth;
+			height = nextHeight;
+		}
+		processor_->timings.emplace_back("pyramid", emscripten_get_now() - pyramidStart);
+
+		val resultObj = val::object();
+		resultObj.set("tileSize", tileSize);
+		resultObj.set("colors",   colors);
+		resultObj.set("bits",     bitmap.bps);
+		resultObj.set("levels",   levelsArr);
+		resultObj.set("tiles",    tilesArr);
+		return resultObj;
+	}
+    
+    val thumbnailData() {
+		if (!processor_) return val::undefined();
+		ensureIdle();
+		if (inputReleased) {
+			throw std::runtime_error("LibRaw: thumbnailData() after the file was released (streamingRelease), call it before imageData()");
+		}
+
+        // Call LibRaw's unpack_thumb function
+        int ret = processor_->unpack_thumb();
+
+        if (ret != LIBRAW_SUCCESS) return val::undefined();
+
+        // Get thumbnail data structure
+        libraw_processed_image_t *img = processor_->dcraw_make_mem_thumb();
+        
+        if (!img) return val::undefined();
+
+        val resultObj = val::object();
+
+        resultObj.set("data", toJSTypedArray(8, img->data_size, img->data));
+        resultObj.set("width", img->width);
+        resultObj.set("height", img->height);
+		
+        std::string formatStr = "unknown";
+        if (img->type == LIBRAW_IMAGE_JPEG) formatStr = "jpeg";
+        else if (img->type == LIBRAW_IMAGE_BITMAP) formatStr = "bitmap";
+        
+        resultObj.set("format", formatStr);
+        
+        LibRaw::dcraw_clear_mem(img);
+
+        return resultObj;
+    }
+
+	/**
+	 * Run unpack() + dcraw_process() on a dedicated pthread, so several
+	 * sessions can decode concurrently inside one module (libraw_r keeps each
+	 * LibRaw object independent). `callback(code, step)` is invoked on the main
+	 * runtime thread once done; imageData() then only builds the output.
+	 */
+	void processAsync(val callback) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		if (isProcessed) {
+			callback(LIBRAW_SUCCESS, std::string());
+			return;
+		}
+		joinProcessThread();
+		busy = true;
+		resume();
+		processCallback = callback;
+		processThread = std::thread([this]() {
+			const char* step = "unpack";
+			int ret;
+			{
+				const PoolJob running;
+				processor_->startTimings();
+				ret = unpackOnce();
+				if (ret == LIBRAW_SUCCESS) {
+					step = "dcraw_process";
+					ret = render();
+					processor_->endStage("finish");
 				}
-				{
-					val arr = val::array();
-					arr.set(0, cPent.AFPointSelected[0]);
-					arr.set(1, cPent.AFPointSelected[1]);
-					pentaxObj.set("AFPointSelected", arr);
+			}
+			// Embind values may only be touched on the thread that owns them
+			emscripten_proxy_async(emscripten_proxy_get_system_queue(),
+				emscripten_main_runtime_thread_id(), &WASMLibRaw::onProcessed,
+				new ProcessResult{this, ret, step});
+		});
+	}
+
+	bool isBusy() const {
+		return busy;
+	}
+
+	/**
+	 * Render the image and encode it in memory ({format: 'jpeg', quality,
+	 * progressive, optimize} or {format: 'png' | 'tiff', compression,
+	 * threads}; TIFF by default with outputTiff), in the background like
+	 * processAsync(): `onDone(error, result)` gets the file bytes, so only the
+	 * compressed image has to leave the module. PNG and TIFF keep 16-bit
+	 * output (outputBps: 16) and are compressed on `threads` pthreads.
+	 */
+	void encode(val options, val onDone) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		// outputTiff (-T) makes TIFF the default
+		const EncodeOptions encode = encodeOptions(options,
+			processor_->imgdata.params.output_tiff ? ImageFormat::TIFF : ImageFormat::JPEG);
+
+		std::shared_ptr<Bitmap> bitmap = std::make_shared<Bitmap>();
+		runAsync(onDone, [this, encode, bitmap]() {
+			if (!renderBitmap(*bitmap)) {
+				throw std::runtime_error("LibRaw: copy_mem_image() failed");
+			}
+			const double encodeStart = emscripten_get_now();
+			const size_t rowBytes = size_t(bitmap->width) * bitmap->colors * (bitmap->bps / 8);
+			std::string error;
+			const bool ok = encodeImage(bitmap->data, bitmap->width, bitmap->height, rowBytes, bitmap->colors, bitmap->bps,
+				encode, encoded, error);
+			processor_->timings.emplace_back("encode", emscripten_get_now() - encodeStart);
+			if (!ok) {
+				throw std::runtime_error(error);
+			}
+		}, [this, encode, bitmap]() {
+			val resultObj = val::object();
+			resultObj.set("format", std::string(formatName(encode.format)));
+			resultObj.set("width",  bitmap->width);
+			resultObj.set("height", bitmap->height);
+			resultObj.set("data", toJSTypedArray(8, encoded.size(), encoded.data()));
+			return resultObj;
+		});
+	}
+
+	/**
+	 * Render in two passes from raw data unpacked once: a quick preview
+	 * first, then the image at the requested quality. `settings` are applied
+	 * as if passed to open(), plus `preview`: 'half' (default, a half-size
+	 * render without demosaic) or 'thumb' (the embedded thumbnail, else a
+	 * half-size render). Runs in the background like processAsync():
+	 * `onPreview(preview)` gets the preview, then `onDone(error, image)` the
+	 * final imageData(). The preview is skipped when it wouldn't be faster
+	 * (already processed, half-size final render, no CFA).
+	 */
+	void renderProgressive(val settings, val onPreview, val onDone) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		const bool wantThumb = !settings.isUndefined() && !settings.isNull() && settings.hasOwnProperty("preview") &&
+			settings["preview"].as<std::string>() == "thumb";
+		if (!settings.isUndefined() && !settings.isNull()) {
+			applySettings(settings);
+			isProcessed = false;	// rendered with the previous settings
+		}
+
+		previewCallback = onPreview;
+		std::shared_ptr<Bitmap> bitmap = std::make_shared<Bitmap>();
+		runAsync(onDone, [this, wantThumb, bitmap]() {
+			runProgressive(wantThumb, *bitmap);
+		}, [this, bitmap]() {
+			return bitmapObject(*bitmap);
+		});
+	}
+
+	/**
+	 * Deep Zoom (DZI) tile set of the rendered image, encoded as JPEG or PNG
+	 * on `threads` pthreads ({format, quality, compression, tileSize, overlap,
+	 * threads}). Runs in the background like processAsync(): `onTile(tile)`
+	 * gets every tile as soon as it is encoded, then `onDone(error, info)`
+	 * (error is empty on success, info holds the .dzi descriptor). Levels are
+	 * numbered as in DZI: 0 is 1x1, the highest is the full image.
+	 */
+	void exportTiles(val options, val onTile, val onDone) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		TileExport job;
+		job.encode = encodeOptions(options, ImageFormat::JPEG);
+		if (job.encode.format == ImageFormat::TIFF) {
+			throw std::runtime_error("LibRaw: Deep Zoom tiles are JPEG or PNG");
+		}
+		job.tileSize = std::max(1, settingOr(options, "tileSize", 254));
+		job.overlap = std::max(0, std::min(job.tileSize / 2, settingOr(options, "overlap", 1)));
+		job.threads = jobThreads(settingOr(options, "threads", int(std::thread::hardware_concurrency())));
+		job.encode.threads = 1;	// tiles are already encoded in parallel
+
+		tileCallback = onTile;
+		std::shared_ptr<ExportResult> result = std::make_shared<ExportResult>();
+		runAsync(onDone, [this, job, result]() {
+			runTileExport(job, *result);
+		}, [job, result]() {
+			const char* format = formatName(job.encode.format);
+			char descriptor[320];
+			snprintf(descriptor, sizeof(descriptor),
+				"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+				"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"%s\" Overlap=\"%d\" TileSize=\"%d\">\n"
+				"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+				"</Image>\n", format, job.overlap, job.tileSize, result->width, result->height);
+			val info = val::object();
+			info.set("width",      result->width);
+			info.set("height",     result->height);
+			info.set("tileSize",   job.tileSize);
+			info.set("overlap",    job.overlap);
+			info.set("format",     std::string(format));
+			info.set("levels",     result->levels);
+			info.set("tiles",      result->tiles);
+			info.set("descriptor", std::string(descriptor));
+			return info;
+		});
+	}
+
+	/**
+	 * Render a window of the opened file: (x, y, width, height) in pixels of
+	 * the oriented full-size image, returned `scale` times smaller (0 < scale
+	 * <= 1). Only the window plus a demosaic margin goes through LibRaw
+	 * (cropbox), at half size when scale <= 0.5, from raw data unpacked once
+	 * for every region. The white point of the last full render is reused, so
+	 * regions match its brightness.
+	 */
+	val renderRegion(int x, int y, int width, int height, double scale) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		if (streamingRelease) {
+			throw std::runtime_error("LibRaw: renderRegion() needs the raw data, open() the file without streamingRelease");
+		}
+		processor_->startTimings();
+		int ret = unpackOnce();
+		if (ret != LIBRAW_SUCCESS) {
+			throw std::runtime_error("LibRaw: unpack() failed with code " + std::to_string(ret));
+		}
+		if (processor_->get_internal_data_pointer()->internal_output_params.fuji_width) {
+			throw std::runtime_error("LibRaw: renderRegion() doesn't support Fuji SuperCCD sensors");
+		}
+
+		int fullWidth, fullHeight, flip;
+		orientedFullSize(&fullWidth, &fullHeight, &flip);
+		x = std::max(0, std::min(x, fullWidth));
+		y = std::max(0, std::min(y, fullHeight));
+		width = std::min(width, fullWidth - x);
+		height = std::min(height, fullHeight - y);
+		if (width <= 0 || height <= 0) {
+			throw std::runtime_error("LibRaw: renderRegion() region is outside of the image");
+		}
+		scale = scale > 0 && scale < 1 ? scale : 1.0;
+		const int dstWidth = std::max(1, int(std::lround(width * scale)));
+		const int dstHeight = std::max(1, int(std::lround(height * scale)));
+
+		// Window plus margin (oriented), then the same rectangle on the sensor
+		const int margin = 16;
+		const int left = std::max(0, x - margin), top = std::max(0, y - margin);
+		const int right = std::min(fullWidth, x + width + margin), bottom = std::min(fullHeight, y + height + margin);
+		int cropX = left, cropY = top, cropWidth = right - left, cropHeight = bottom - top;
+		int sensorWidth = fullWidth, sensorHeight = fullHeight;
+		if (flip & 4) {
+			std::swap(cropX, cropY);
+			std::swap(cropWidth, cropHeight);
+			std::swap(sensorWidth, sensorHeight);
+		}
+		if (flip & 2) {
+			cropY = sensorHeight - cropY - cropHeight;
+		}
+		if (flip & 1) {
+			cropX = sensorWidth - cropX - cropWidth;
+		}
+
+		libraw_output_params_t &params = processor_->imgdata.params;
+		unsigned cropbox[4];
+		memcpy(cropbox, params.cropbox, sizeof(cropbox));
+		const int halfSize = params.half_size;
+		// raw2image_ex() aligns the crop origin down to the CFA period (up to
+		// 16 pixels) without growing the size: ask for that much more, it clips
+		// the size to the image
+		const int cfaAlignment = 16;
+		params.cropbox[0] = cropX;
+		params.cropbox[1] = cropY;
+		params.cropbox[2] = cropWidth + cfaAlignment;
+		params.cropbox[3] = cropHeight + cfaAlignment;
+		params.half_size = halfSize || (scale <= 0.5 && processor_->imgdata.idata.filters);
+		processor_->forcedWhitePoint = fullWhitePoint;
+		isProcessed = false;	// the processor now holds this region
+		ret = processor_->process();
+		processor_->endStage("finish");
+		memcpy(params.cropbox, cropbox, sizeof(cropbox));
+		params.half_size = halfSize;
+		if (ret != LIBRAW_SUCCESS) {
+			processor_->forcedWhitePoint = 0;
+			throw std::runtime_error("LibRaw: dcraw_process() failed with code " + std::to_string(ret));
+		}
+
+		// The crop raw2image_ex() applied, read back from the sizes it left,
+		// then oriented as the output
+		const libraw_image_sizes_t &cropped = processor_->imgdata.sizes;
+		const libraw_image_sizes_t &file = fileSizes();
+		int doneX = cropped.left_margin - file.left_margin, doneY = cropped.top_margin - file.top_margin;
+		int doneWidth = cropped.width, doneHeight = cropped.height;
+		if (flip & 1) {
+			doneX = sensorWidth - doneX - doneWidth;
+		}
+		if (flip & 2) {
+			doneY = sensorHeight - doneY - doneHeight;
+		}
+		if (flip & 4) {
+			std::swap(doneX, doneY);
+			std::swap(doneWidth, doneHeight);
+		}
+		if (doneX > x || doneY > y || doneX + doneWidth < x + width || doneY + doneHeight < y + height) {
+			processor_->forcedWhitePoint = 0;
+			throw std::runtime_error("LibRaw: renderRegion() crop doesn't cover the region");
+		}
+
+		int outWidth, outHeight, colors, bps;
+		processor_->outputFormat(&outWidth, &outHeight, &colors, &bps);
+		const int stride = outWidth * colors * (bps / 8);
+		const double outputStart = emscripten_get_now();
+		output.resize(size_t(stride) * outHeight);
+		ret = processor_->copyOutput(output.data(), stride);
+		processor_->forcedWhitePoint = 0;
+		if (ret != LIBRAW_SUCCESS) {
+			throw std::runtime_error("LibRaw: copy_mem_image() failed with code " + std::to_string(ret));
+		}
+
+		// Cut the margin off (the crop may have been binned) and scale
+		const double fx = double(outWidth) / doneWidth, fy = double(outHeight) / doneHeight;
+		const int srcX = std::min(outWidth - 1, int(std::lround((x - doneX) * fx)));
+		const int srcY = std::min(outHeight - 1, int(std::lround((y - doneY) * fy)));
+		const int srcWidth = std::max(1, std::min(outWidth - srcX, int(std::lround(width * fx))));
+		const int srcHeight = std::max(1, std::min(outHeight - srcY, int(std::lround(height * fy))));
+		const size_t dataSize = size_t(dstWidth) * dstHeight * colors * (bps / 8);
+		scaled.resize(dataSize);
+		if (bps == 16) {
+			const uint16_t* src = reinterpret_cast<const uint16_t*>(output.data()) + (size_t(srcY) * outWidth + srcX) * colors;
+			areaResample(src, srcWidth, srcHeight, size_t(outWidth) * colors,
+				reinterpret_cast<uint16_t*>(scaled.data()), dstWidth, dstHeight, colors);
+		} else {
+			const uint8_t* src = output.data() + (size_t(srcY) * outWidth + srcX) * colors;
+			areaResample(src, srcWidth, srcHeight, size_t(outWidth) * colors, scaled.data(), dstWidth, dstHeight, colors);
+		}
+		processor_->timings.emplace_back("output", emscripten_get_now() - outputStart);
+
+		val resultObj = val::object();
+		resultObj.set("x",      x);
+		resultObj.set("y",      y);
+		resultObj.set("width",  dstWidth);
+		resultObj.set("height", dstHeight);
+		resultObj.set("colors", colors);
+		resultObj.set("bits",   bps);
+		resultObj.set("dataSize", double(dataSize));
+		resultObj.set("data", toJSTypedArray(bps, dataSize, scaled.data()));
+		return resultObj;
+	}
+
+	/**
+	 * Quick preview for culling, binned from the raw mosaic: each 2x2 Bayer
+	 * or 3x3 X-Trans cell, or block of `factor` x `factor` cells ({factor},
+	 * default 1), becomes one sRGB pixel. Skips raw2image_ex(), LibRaw's
+	 * `image` and the demosaic, so only unpack() costs more than a pass over
+	 * the raw data. Other sensors (Foveon, linear DNG, SuperCCD) throw.
+	 */
+	val binnedPreview(val options) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		ensureIdle();
+		const int factor = std::max(1, std::min(16, settingOr(options, "factor", 1)));
+		processor_->startTimings();
+		int ret = unpackOnce();
+		if (ret != LIBRAW_SUCCESS) {
+			throw std::runtime_error("LibRaw: unpack() failed with code " + std::to_string(ret));
+		}
+		if (!processor_->hasRawData()) {
+			throw std::runtime_error("LibRaw: binnedPreview() needs the raw data, call it before imageData() with streamingRelease");
+		}
+		if (!processor_->binnable()) {
+			throw std::runtime_error("LibRaw: binnedPreview() needs Bayer or X-Trans raw data");
+		}
+
+		int width, height;
+		isProcessed = false;	// binnedPreview() resets the processor's sizes
+		processor_->binnedPreview(factor, scaled, &width, &height);
+		processor_->endStage("binning");
+
+		const int bps = processor_->imgdata.params.output_bps == 16 ? 16 : 8;
+		val resultObj = val::object();
+		resultObj.set("width",  width);
+		resultObj.set("height", height);
+		resultObj.set("colors", 3);
+		resultObj.set("bits",   bps);
+		resultObj.set("dataSize", double(scaled.size()));
+		resultObj.set("data", toJSTypedArray(bps, scaled.size(), scaled.data()));
+		return resultObj;
+	}
+
+	/**
+	 * Pre-flight estimate, in bytes, of the heap a full render of the opened
+	 * file needs with the current settings overridden by `settings`. Nothing is
+	 * allocated or changed. `peak` is what a scheduler should budget for.
+	 */
+	val estimateMemory(val settings) {
+		if (!processor_) {
+			throw std::runtime_error("LibRaw not initialized");
+		}
+		const libraw_data_t &d = processor_->imgdata;
+		const libraw_image_sizes_t &sizes = fileSizes();
+		if (!sizes.raw_width || !sizes.raw_height) {
+			throw std::runtime_error("LibRaw: estimateMemory() needs an opened file");
+		}
+		const libraw_output_params_t &params = d.params;
+		const unsigned filters = d.idata.filters;
+		int fullWidth, fullHeight, dstWidth = 0, dstHeight = 0;
+		const bool reduced = targetSize(settingOr(settings, "targetWidth", targetWidth),
+			settingOr(settings, "targetHeight", targetHeight), settingOr(settings, "maxDimension", maxDimension),
+			&fullWidth, &fullHeight, &dstWidth, &dstHeight);
+		// render() switches to half size for small enough targets
+		const int halfSize    = settingOr(settings, "halfSize", params.half_size) ||
+			(reduced && filters && dstWidth * 2 <= fullWidth && dstHeight * 2 <= fullHeight);
+		const int userQual    = settingOr(settings, "userQual", params.user_qual);
+		const int fbddNoiserd = settingOr(settings, "fbddNoiserd", params.fbdd_noiserd);
+		const int outputBps   = settingOr(settings, "outputBps", params.output_bps);
+		const int fujiRotate  = settingOr(settings, "useFujiRotate", params.use_fuji_rotate);
+		const int noInterp    = settingOr(settings, "noInterpolation", params.no_interpolation);
+		const double threshold = settings.isUndefined() || settings.isNull() || !settings.hasOwnProperty("threshold")
+			? params.threshold : settings["threshold"].as<double>();
+
+		const bool bayer = filters || d.idata.colors == 1;
+		const uint64_t fujiWidth = processor_->get_internal_data_pointer()->internal_output_params.fuji_width;
+
+		// Raw buffer (raw_alloc): one sample per pixel for CFA data, 4 otherwise
+		const uint64_t sampleBytes = processor_->is_floating_point() ? 4 : 2;
+		const uint64_t rawBytes = uint64_t(sizes.raw_width) * sizes.raw_height *
+			(bayer ? 1 : 4) * sampleBytes;
+
+		// 4-channel ushort working image, at half size when shrinking
+		const int shrink = filters && (halfSize || threshold > 0 || params.aber[0] != 1 || params.aber[2] != 1);
+		uint64_t width = sizes.width, height = sizes.height;
+		if (fujiWidth) {
+			// Fuji "rotated" sensors are processed on a 45-degree grid
+			width = height = fujiWidth + (sizes.height - fujiWidth) / 2 + 1;
+		}
+		const uint64_t iwidth = (width + shrink) >> shrink;
+		const uint64_t iheight = (height + shrink) >> shrink;
+		uint64_t pixels = iwidth * iheight;
+		uint64_t imageBytes = pixels * 8;
+		const bool compact = settingOr(settings, "compactProcessing", processor_->compactRequested) &&
+			!shrink && !noInterp && processor_->compactSupported(userQual);
+		if (compact) {
+			imageBytes = pixels * 3 * sizeof(ushort);
+		}
+		if (shrink && !halfSize) {
+			// pre_interpolate() expands the shrunk image back to full size
+			pixels = width * height;
+			imageBytes += pixels * 8;
+		}
+
+		// Largest temporary buffer of the processing stages
+		uint64_t scratch = uint64_t(LIBRAW_HISTOGRAM_SIZE) * 4 * sizeof(int);
+		if (threshold > 0) {
+			scratch = std::max(scratch, iwidth * iheight * 3 * sizeof(float)); // wavelet_denoise
+		}
+		if (filters && !noInterp && !halfSize && !compact) {
+			if (fbddNoiserd > 0 && d.idata.colors == 3) {
+				scratch = std::max(scratch, pixels * 3 * sizeof(float));
+			}
+			const int quality = userQual >= 0 ? userQual : (fujiWidth ? 2 : 3);
+			// Same selection order as dcraw_process()
+			const uint64_t tile = 512;
+			uint64_t demosaic = 0;
+			if (quality == 0 || quality == 1 || d.idata.colors > 3 || (quality == 2 && filters > 1000)) {
+				demosaic = 0;                                     // lin/vng/ppg: a few rows at most
+			} else if (filters == 9) {
+				demosaic = tile * tile * (4 * 11 + 6);            // xtrans_interpolate
+			} else if (quality == 4) {
+				demosaic = pixels * 2 * 3 * sizeof(float);        // dcb: two float images
+			} else if (quality == 11) {
+				demosaic = pixels * (3 * sizeof(float) + 1);      // dht: nraw + ndir
+			} else if (quality == 12) {
+				demosaic = pixels * (2 * 3 * sizeof(ushort) + 2 * 3 * sizeof(float) + 3); // aahd
+			} else {
+				demosaic = tile * tile * (2 * 3 * sizeof(ushort) + 2 * 3 * sizeof(short) + 2); // ahd
+			}
+			scratch = std::max(scratch, demosaic);
+		}
+		if (fujiWidth && fujiRotate) {
+			scratch = std::max(scratch, imageBytes);  // fuji_rotate/stretch build a new image
+		}
+
+		// Output bitmap (same pixel count after flips)
+		const int colors = d.idata.colors == 4 && params.output_color ? 3 : d.idata.colors;
+		uint64_t outputBytes = pixels * colors * (outputBps == 16 ? 2 : 1);
+		if (reduced) {
+			outputBytes += uint64_t(dstWidth) * dstHeight * colors * (outputBps == 16 ? 2 : 1);
+		}
+		const uint64_t inputBytes = buffer.size();
+		uint64_t peak = inputBytes + rawBytes + imageBytes + std::max(scratch, outputBytes);
+		if (settingOr(settings, "streamingRelease", streamingRelease)) {
+			// The file goes once unpacked, the raw data once copied into `image`
+			peak = std::max({inputBytes + rawBytes, rawBytes + imageBytes, imageBytes + std::max(scratch, outputBytes)});
+		}
+
+		val estimate = val::object();
+		estimate.set("input",   double(inputBytes));
+		estimate.set("raw",     double(rawBytes));
+		estimate.set("image",   double(imageBytes));
+		estimate.set("scratch", double(scratch));
+		estimate.set("output",  double(outputBytes));
+		estimate.set("peak",    double(peak));
+		estimate.set("limitMB", d.rawparams.max_raw_memory_mb);
+		return estimate;
+	}
+
+	/**
+	 * Milliseconds spent in each stage of the last decode of this file:
+	 * unpack, raw2image, preprocess, demosaic, convert, finish (fuji rotate,
+	 * stretch, histogram) and output (rendering the bitmap in imageData())
+	 */
+	val stageTimings() const {
+		val out = val::object();
+		for (const auto& stage : processor_->timings) {
+			out.set(stage.first, stage.second);
+		}
+		return out;
+	}
+
+	/**
+	 * What the last render chose to fit in timeBudgetMs, and the time it
+	 * predicted for processing and output (undefined without a budget)
+	 */
+	val budgetChoices() const {
+		if (!budgetApplied) {
+			return val::undefined();
+		}
+		val out = val::object();
+		out.set("timeBudgetMs",  timeBudgetMs);
+		out.set("predictedMs",   budgetChoice.predictedMs);
+		out.set("halfSize",      budgetChoice.halfSize != 0);
+		out.set("userQual",      budgetChoice.userQual);
+		out.set("dcbIterations", budgetChoice.dcbIterations);
+		out.set("fbddNoiserd",   budgetChoice.fbddNoiserd);
+		out.set("downscale",     budgetChoice.downscale);
+		return out;
+	}
+
+	/**
+	 * Identifier the camera recorded for this shot: the DNG RawDataUniqueID or
+	 * the EXIF ImageUniqueID (with the camera model). Empty if there is none.
+	 */
+	std::string uniqueId() {
+		const libraw_colordata_t &c = processor_->imgdata.color;
+		static const char hexDigits[] = "0123456789abcdef";
+		std::string rawId;
+		bool nonZero = false;
+		for (int i = 0; i < 16; i++) {
+			unsigned char b = (unsigned char)c.RawDataUniqueID[i];
+			nonZero |= b != 0;
+			rawId += hexDigits[b >> 4];
+			rawId += hexDigits[b & 15];
+		}
+		if (nonZero) {
+			return "raw-" + rawId;
+		}
+		if (c.ImageUniqueID[0]) {
+			return std::string("img-") + processor_->imgdata.idata.model + "-" +
+				std::string(c.ImageUniqueID, strnlen(c.ImageUniqueID, sizeof(c.ImageUniqueID)));
+		}
+		return std::string();
+	}
+
+	/**
+	 * xxHash64 of the opened file plus its size, as hex. Computed on first use
+	 * and kept until the next open().
+	 */
+	std::string contentHash() {
+		if (contentHashHex.empty()) {
+			if (inputReleased) {
+				throw std::runtime_error("LibRaw: contentHash() after the file was released (streamingRelease)");
+			}
+			char hex[40];
+			snprintf(hex, sizeof(hex), "%016llx-%llx",
+				(unsigned long long)xxh64::hash(buffer.data(), buffer.size()),
+				(unsigned long long)buffer.size());
+			contentHashHex = hex;
+		}
+		return contentHashHex;
+	}
+
+	/**
+	 * Preemption for processAsync(): the decode thread stops at the next
+	 * LibRaw stage boundary (progress callback) until resume() is called.
+	 */
+	void pause() {
+		std::lock_guard<std::mutex> lock(pauseMutex);
+		paused = true;
+	}
+
+	void resume() {
+		{
+			std::lock_guard<std::mutex> lock(pauseMutex);
+			paused = false;
+		}
+		pauseCond.notify_all();
+	}
+
+private:
+	struct ProcessResult {
+		WASMLibRaw* self;
+		int ret;
+		const char* step;
+	};
+
+	WASMProcessor* processor_ = nullptr;
+    std::vector<uint8_t> buffer;
+	// Kept between calls/files so repeated decodes reuse the same heap blocks
+	std::vector<uint8_t> output;
+	std::vector<uint8_t> scaled;
+	// Last encode() result
+	std::vector<uint8_t> encoded;
+	std::string contentHashHex;
+	bool isUnpacked = false;
+	// The processor holds the full render of the opened file (not a region)
+	bool isProcessed = false;
+	// streamingRelease: free the file and the raw data during the decode
+	bool streamingRelease = false;
+	bool inputReleased = false;
+	// Requested output bounds (0: none), and the size render() settled on
+	int targetWidth = 0, targetHeight = 0, maxDimension = 0;
+	int scaledWidth = 0, scaledHeight = 0;
+	// timeBudgetMs (0: none), and what render() chose for it last
+	double timeBudgetMs = 0;
+	RenderChoice budgetChoice{};
+	bool budgetApplied = false;
+	// Auto-brightness white point of the last full render, for renderRegion()
+	int fullWhitePoint = 0;
+	bool busy = false;
+	std::thread processThread;
+	val processCallback = val::undefined();
+	val tileCallback = val::undefined();
+	val previewCallback = val::undefined();
+	// Builds the result of the running runAsync() job
+	std::function<val()> asyncDone;
+	std::mutex pauseMutex;
+	std::condition_variable pauseCond;
+	bool paused = false;
+
+	// Sizes of the opened file. Renders change imgdata.sizes (half size, the
+	// crop of renderRegion()), unpack() keeps the originals.
+	const libraw_image_sizes_t& fileSizes() const {
+		const libraw_data_t &d = processor_->imgdata;
+		return isUnpacked ? d.rawdata.sizes : d.sizes;
+	}
+
+	// Size and orientation of the opened file's full render
+	void orientedFullSize(int* width, int* height, int* flip) const {
+		const libraw_data_t &d = processor_->imgdata;
+		const libraw_image_sizes_t &sizes = fileSizes();
+		*width = sizes.width;
+		*height = sizes.height;
+		*flip = d.params.user_flip >= 0 ? d.params.user_flip : sizes.flip;
+		if (*flip & 4) {
+			std::swap(*width, *height);
+		}
+	}
+
+	// Oriented size of the opened file's full render, and the size the bounds
+	// (0: none) reduce it to (false if they don't ask for a reduction)
+	bool targetSize(int targetWidth, int targetHeight, int maxDimension,
+			int* width, int* height, int* dstWidth, int* dstHeight) const {
+		int flip;
+		orientedFullSize(width, height, &flip);
+		double scale = 1.0;
+		if (maxDimension > 0) {
+			scale = std::min(scale, double(maxDimension) / std::max(*width, *height));
+		}
+		if (targetWidth > 0) {
+			scale = std::min(scale, double(targetWidth) / *width);
+		}
+		if (targetHeight > 0) {
+			scale = std::min(scale, double(targetHeight) / *height);
+		}
+		if (scale >= 1.0) {
+			return false;
+		}
+		*dstWidth = std::max(1, int(std::lround(*width * scale)));
+		*dstHeight = std::max(1, int(std::lround(*height * scale)));
+		return true;
+	}
+
+	// process(), at half size (a 2x2 CFA binning, no demosaic) when the target
+	// size is at most half of the full one, with the quality timeBudgetMs
+	// allows when set
+	int render() {
+		int width, height;
+		scaledWidth = scaledHeight = 0;
+		const bool reduced = targetSize(targetWidth, targetHeight, maxDimension, &width, &height, &scaledWidth, &scaledHeight);
+		libraw_output_params_t &params = processor_->imgdata.params;
+		const RenderChoice requested = currentChoice();
+		if (reduced && !params.half_size && processor_->imgdata.idata.filters &&
+				scaledWidth * 2 <= width && scaledHeight * 2 <= height) {
+			params.half_size = 1;
+		}
+		budgetApplied = timeBudgetMs > 0;
+		if (budgetApplied) {
+			budgetChoice = chooseForBudget(width, height);
+			params.half_size = budgetChoice.halfSize;
+			params.user_qual = budgetChoice.userQual;
+			params.dcb_iterations = budgetChoice.dcbIterations;
+			params.fbdd_noiserd = budgetChoice.fbddNoiserd;
+			if (budgetChoice.downscale > 1) {
+				const int w = std::max(1, width / budgetChoice.downscale), h = std::max(1, height / budgetChoice.downscale);
+				if (!scaledWidth || w < scaledWidth) {
+					scaledWidth = w;
+					scaledHeight = h;
 				}
-				pentaxObj.set("AFPointSelected_Area", (int)cPent.AFPointSelected_Area);
-				pentaxObj.set("AFPointsInFocus_version", cPent.AFPointsInFocus_version);
-				pentaxObj.set("AFPointsInFocus",	   (unsigned)cPent.AFPointsInFocus);
-				pentaxObj.set("FocusPosition",		 cPent.FocusPosition);
-				pentaxObj.set("AFAdjustment",		  cPent.AFAdjustment);
-				pentaxObj.set("AFPointMode",		   (int)cPent.AFPointMode);
-				pentaxObj.set("MultiExposure",		 (int)cPent.MultiExposure);
-				pentaxObj.set("Quality",			   cPent.Quality);
+			}
+		}
+
+		const RenderChoice applied = currentChoice();
+		const double start = emscripten_get_now();
+		const int ret = processor_->process();
+		if (ret == LIBRAW_SUCCESS) {
+			RenderCosts::instance().learn(processCostKey(applied), processCostPrior(applied),
+				emscripten_get_now() - start, double(width) * height);
+		}
+		params.half_size = requested.halfSize;
+		params.user_qual = requested.userQual;
+		params.dcb_iterations = requested.dcbIterations;
+		params.fbdd_noiserd = requested.fbddNoiserd;
+		return ret;
+	}
+
+	RenderChoice currentChoice() const {
+		const libraw_output_params_t &params = processor_->imgdata.params;
+		return RenderChoice{params.half_size, params.user_qual, params.dcb_iterations, params.fbdd_noiserd,
+			params.half_size ? 2 : 1, 0};
+	}
+
+	std::string processCostKey(const RenderChoice& choice) const {
+		const libraw_iparams_t &id = processor_->imgdata.idata;
+		std::string key = std::string(id.make) + " " + id.model;
+		if (choice.halfSize || !id.filters) {
+			return key + (choice.halfSize ? " half" : " full");
+		}
+		return key + " q" + std::to_string(choice.userQual < 0 ? 3 : choice.userQual) +
+			" d" + std::to_string(std::max(0, choice.dcbIterations)) + " n" + std::to_string(std::max(0, choice.fbddNoiserd));
+	}
+
+	// Rough ns per sensor pixel of a process() with `choice`
+	double processCostPrior(const RenderChoice& choice) const {
+		const unsigned filters = processor_->imgdata.idata.filters;
+		if (choice.halfSize && filters) {
+			return 6;
+		}
+		double ns = 15;	// raw2image, scaling, color conversion
+		if (!filters) {
+			return ns;
+		}
+		const int quality = choice.userQual < 0 ? 3 : choice.userQual;
+		if (filters == 9 && quality != 0) {
+			ns += 150;	// X-Trans 3-pass
+		} else if (quality == 0) {
+			ns += 10;	// linear
+		} else if (quality == 1) {
+			ns += 80;	// VNG
+		} else if (quality == 2) {
+			ns += 25;	// PPG
+		} else if (quality == 4) {
+			ns += 60 + 20 * std::max(0, choice.dcbIterations);	// DCB
+		} else if (quality == 11) {
+			ns += 100;	// DHT
+		} else {
+			ns += 70;	// AHD, AAHD
+		}
+		return ns + 30 * std::max(0, choice.fbddNoiserd);
+	}
+
+	// The best settings whose predicted process() plus output time fits in
+	// what is left of timeBudgetMs, else the fastest ones: the requested
+	// quality, then without FBDD noise reduction and DCB iterations, PPG,
+	// linear interpolation, half size, and half size downscaled by 2 and 4
+	RenderChoice chooseForBudget(int width, int height) {
+		const libraw_output_params_t &params = processor_->imgdata.params;
+		const bool cfa = processor_->imgdata.idata.filters != 0;
+		const RenderChoice current = currentChoice();
+		const int quality = current.userQual < 0 ? 3 : current.userQual;
+		const int iterations = std::max(0, current.dcbIterations), noiseReduction = std::max(0, current.fbddNoiserd);
+
+		std::vector<RenderChoice> ladder;
+		if (!params.half_size || !cfa) {
+			ladder.push_back({0, quality, iterations, noiseReduction, 1, 0});
+			if (cfa && noiseReduction) {
+				ladder.push_back({0, quality, iterations, 0, 1, 0});
+			}
+			if (cfa && quality == 4 && iterations) {
+				ladder.push_back({0, quality, 0, 0, 1, 0});
+			}
+			if (cfa && quality != 0 && quality != 2) {
+				ladder.push_back({0, 2, 0, 0, 1, 0});
+			}
+			if (cfa && quality != 0) {
+				ladder.push_back({0, 0, 0, 0, 1, 0});
+			}
+		}
+		for (int downscale = 2; downscale <= 8; downscale *= 2) {
+			ladder.push_back({cfa ? 1 : 0, quality, iterations, noiseReduction, downscale, 0});
+		}
+
+		const double remaining = timeBudgetMs - processor_->elapsed();	// unpack() already ran
+		const double sensorPixels = double(width) * height;
+		const double outputCost = RenderCosts::instance().perPixel("output", OUTPUT_COST_PRIOR);
+		for (RenderChoice& choice : ladder) {
+			const double outputPixels = choice.halfSize ? sensorPixels / 4 : sensorPixels;
+			choice.predictedMs = (RenderCosts::instance().perPixel(processCostKey(choice), processCostPrior(choice)) * sensorPixels +
+				outputCost * outputPixels) / 1e6;
+			if (choice.predictedMs <= remaining) {
+				return choice;
+			}
+		}
+		return ladder.back();
+	}
+
+	// ns per pixel of copyOutput() and resampling
+	static constexpr double OUTPUT_COST_PRIOR = 5;
+
+	static int onProgress(void* data, enum LibRaw_progress stage, int iteration, int expected) {
+		WASMLibRaw* self = static_cast<WASMLibRaw*>(data);
+		// Only decode threads may wait: blocking the main runtime thread would
+		// also block the resume() call
+		if (!emscripten_is_main_runtime_thread()) {
+			std::unique_lock<std::mutex> lock(self->pauseMutex);
+			self->pauseCond.wait(lock, [self] { return !self->paused; });
+		}
+		return 0;
+	}
+
+	static void onProcessed(void* arg) {
+		ProcessResult* result = static_cast<ProcessResult*>(arg);
+		WASMLibRaw* self = result->self;
+		self->joinProcessThread();
+		self->busy = false;
+		self->resume();
+		self->isProcessed = result->ret == LIBRAW_SUCCESS;
+
+		val callback = self->processCallback;
+		self->processCallback = val::undefined();
+		callback(result->ret, std::string(result->step));
+		delete result;
+	}
+
+	struct AsyncResult {
+		WASMLibRaw* self;
+		std::string error;
+	};
+
+	/**
+	 * Background job of encode(), renderProgressive() and exportTiles():
+	 * `job` runs on processThread and reports failures by throwing, then on
+	 * the main runtime thread the session is idle again and `callback(error,
+	 * value)` gets the value `onDone` builds, or an empty object on error.
+	 */
+	void runAsync(val callback, std::function<void()> job, std::function<val()> onDone) {
+		joinProcessThread();
+		busy = true;
+		resume();
+		processCallback = callback;
+		asyncDone = std::move(onDone);
+		processThread = std::thread([this, job]() {
+			AsyncResult* result = new AsyncResult{this, std::string()};
+			try {
+				const PoolJob running;
+				job();
+			} catch (const std::exception& e) {
+				result->error = e.what();
+			}
+			// Embind values may only be touched on the thread that owns them
+			emscripten_proxy_async(emscripten_proxy_get_system_queue(),
+				emscripten_main_runtime_thread_id(), &WASMLibRaw::onAsyncDone, result);
+		});
+	}
+
+	static void onAsyncDone(void* arg) {
+		AsyncResult* result = static_cast<AsyncResult*>(arg);
+		WASMLibRaw* self = result->self;
+		self->joinProcessThread();
+		self->busy = false;
+		self->resume();
+
+		std::function<val()> onDone = std::move(self->asyncDone);
+		self->asyncDone = nullptr;
+		val value = val::object();
+		if (result->error.empty()) {
+			try {
+				value = onDone();
+			} catch (const std::exception& e) {
+				result->error = e.what();
+			}
+		}
+		val callback = self->processCallback;
+		self->processCallback = val::undefined();
+		self->previewCallback = val::undefined();
+		self->tileCallback = val::undefined();
+		callback(result->error, value);
+		delete result;
+	}
 
-				meta.set("pentax", pentaxObj);
-			}
-			// ================ HASSELBLAD ================
-			else if (makeLower.find("hasselblad") != std::string::npos)
-			{
-				val hassObj = val::object();
-				const libraw_hasselblad_makernotes_t &cHass =
-					processor_->imgdata.makernotes.hasselblad;
+	void joinProcessThread() {
+		if (processThread.joinable()) {
+			processThread.join();
+		}
+	}
 
-				hassObj.set("BaseISO",		  cHass.BaseISO);
-				hassObj.set("Gain",			cHass.Gain);
-				hassObj.set("Sensor",		  std::string(cHass.Sensor));
-				hassObj.set("SensorUnit",	  std::string(cHass.SensorUnit));
-				hassObj.set("HostBody",		std::string(cHass.HostBody));
-				hassObj.set("SensorCode",	  cHass.SensorCode);
-				hassObj.set("SensorSubCode",   cHass.SensorSubCode);
-				hassObj.set("CoatingCode",	 cHass.CoatingCode);
-				hassObj.set("uncropped",	   cHass.uncropped);
-				hassObj.set("CaptureSequenceInitiator",
-							std::string(cHass.CaptureSequenceInitiator));
-				hassObj.set("SensorUnitConnector",
-							std::string(cHass.SensorUnitConnector));
-				hassObj.set("format",		  cHass.format);
-				{
-					val arr = val::array();
-					arr.set(0, cHass.nIFD_CM[0]);
-					arr.set(1, cHass.nIFD_CM[1]);
-					hassObj.set("nIFD_CM", arr);
-				}
-				{
-					val arr = val::array();
-					arr.set(0, cHass.RecommendedCrop[0]);
-					arr.set(1, cHass.RecommendedCrop[1]);
-					hassObj.set("RecommendedCrop", arr);
-				}
-				{
-					// 4x3 matrix
-					val outer = val::array();
-					for (int i = 0; i < 4; i++) {
-						val row = val::array();
-						for (int j = 0; j < 3; j++) {
-							row.set(j, cHass.mnColorMatrix[i][j]);
-						}
-						outer.set(i, row);
-					}
-					hassObj.set("mnColorMatrix", outer);
-				}
+	struct TileExport {
+		EncodeOptions encode;
+		int tileSize, overlap, threads;
+	};
 
-				meta.set("hasselblad", hassObj);
+	struct EncodedTile {
+		WASMLibRaw* self;
+		int level, column, row, width, height;
+		std::vector<uint8_t> data;
+	};
+
+	struct ExportResult {
+		int width = 0, height = 0, levels = 0, tiles = 0;
+	};
+
+	// `fallback` is the format used when options.format is missing
+	static EncodeOptions encodeOptions(const val& options, ImageFormat fallback) {
+		EncodeOptions encode;
+		encode.format = fallback;
+		if (!options.isUndefined() && !options.isNull() && options.hasOwnProperty("format")) {
+			const std::string format = options["format"].as<std::string>();
+			if (format == "png") {
+				encode.format = ImageFormat::PNG;
+			} else if (format == "tiff" || format == "tif") {
+				encode.format = ImageFormat::TIFF;
+			} else if (format == "jpeg" || format == "jpg") {
+				encode.format = ImageFormat::JPEG;
+			} else {
+				throw std::runtime_error("LibRaw: unsupported format '" + format + "' (jpeg, png, tiff)");
 			}
-			// ================ RICOH ================
-			else if (makeLower.find("ricoh") != std::string::npos)
-			{
-				val ricohObj = val::object();
-				const libraw_ricoh_makernotes_t &cRicoh =
-					processor_->imgdata.makernotes.ricoh;
+		}
+		encode.quality = std::max(1, std::min(100, settingOr(options, "quality", encode.quality)));
+		encode.compression = std::max(0, std::min(9, settingOr(options, "compression", encode.compression)));
+		encode.progressive = settingOr(options, "progressive", encode.progressive);
+		encode.optimize = settingOr(options, "optimize", encode.optimize);
+		encode.threads = jobThreads(settingOr(options, "threads", int(std::thread::hardware_concurrency())));
+		return encode;
+	}
 
-				ricohObj.set("AFStatus",		 cRicoh.AFStatus);
+	// Body of the exportTiles() job: render, then every level from the
+	// full size down, its tiles encoded by this thread and the helpers the
+	// pool grants (up to `threads` in all), and forwarded to the main thread
+	// (in order, from this thread only) as they finish
+	void runTileExport(const TileExport& job, ExportResult& result) {
+		Bitmap bitmap;
+		if (!renderBitmap(bitmap)) {
+			throw std::runtime_error("LibRaw: copy_mem_image() failed");
+		}
+
+		const double exportStart = emscripten_get_now();
+		const int colors = bitmap.colors, bps = bitmap.bps, pixelBytes = colors * bps / 8;
+		result.width = bitmap.width;
+		result.height = bitmap.height;
+		int maxLevel = 0;
+		while ((1 << maxLevel) < std::max(bitmap.width, bitmap.height)) {
+			maxLevel++;
+		}
+		result.levels = maxLevel + 1;
+
+		std::vector<uint8_t> previous, current;
+		const uint8_t* pixels = bitmap.data;
+		int width = bitmap.width, height = bitmap.height;
 
+		// One set of helpers for every level. Each level is published under
+		// `mutex` (a new generation) once no helper works on the previous one.
+		std::mutex mutex;
+		std::condition_variable wake, doneCond;
+		int generation = 0, working = 0;
+		bool stop = false;
+		int level = maxLevel, columns = 0, count = 0, finished = 0;
+		size_t rowBytes = 0;
+		std::atomic<int> nextTile{0};
+		std::vector<EncodedTile*> done;
+		std::string error;
+		// Encodes tile `i` of the current level into `done`
+		auto encodeTile = [&](int i, std::vector<uint8_t>& data, std::string& tileError) {
+			const int column = i % columns, row = i / columns;
+			// DZI tiles overlap their neighbours by `overlap` pixels
+			const int x0 = std::max(0, column * job.tileSize - job.overlap);
+			const int y0 = std::max(0, row * job.tileSize - job.overlap);
+			const int x1 = std::min(width, (column + 1) * job.tileSize + job.overlap);
+			const int y1 = std::min(height, (row + 1) * job.tileSize + job.overlap);
+			const bool ok = encodeImage(pixels + size_t(y0) * rowBytes + size_t(x0) * pixelBytes,
+				x1 - x0, y1 - y0, rowBytes, colors, bps, job.encode, data, tileError);
+			std::lock_guard<std::mutex> lock(mutex);
+			finished++;
+			if (ok) {
+				done.push_back(new EncodedTile{this, level, column, row, x1 - x0, y1 - y0, std::move(data)});
+			} else if (error.empty()) {
+				error = tileError;
+				nextTile = count;	// stop the other threads
+			}
+			doneCond.notify_one();
+		};
+		auto encodeTiles = [&]() {
+			std::vector<uint8_t> data;
+			std::string tileError;
+			for (int seen = 0;;) {
 				{
-					val arrX = val::array();
-					arrX.set(0, cRicoh.AFAreaXPosition[0]);
-					arrX.set(1, cRicoh.AFAreaXPosition[1]);
-					ricohObj.set("AFAreaXPosition", arrX);
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [&] { return stop || generation != seen; });
+					if (stop) {
+						return;
+					}
+					seen = generation;
+					working++;
 				}
-				{
-					val arrY = val::array();
-					arrY.set(0, cRicoh.AFAreaYPosition[0]);
-					arrY.set(1, cRicoh.AFAreaYPosition[1]);
-					ricohObj.set("AFAreaYPosition", arrY);
+				for (int i; (i = nextTile++) < count;) {
+					encodeTile(i, data, tileError);
 				}
-				ricohObj.set("AFAreaMode",		 (int)cRicoh.AFAreaMode);
-				ricohObj.set("SensorWidth",		cRicoh.SensorWidth);
-				ricohObj.set("SensorHeight",	   cRicoh.SensorHeight);
-				ricohObj.set("CroppedImageWidth",  cRicoh.CroppedImageWidth);
-				ricohObj.set("CroppedImageHeight", cRicoh.CroppedImageHeight);
-				ricohObj.set("WideAdapter",		cRicoh.WideAdapter);
-				ricohObj.set("CropMode",		   cRicoh.CropMode);
-				ricohObj.set("NDFilter",		   cRicoh.NDFilter);
-				ricohObj.set("AutoBracketing",	 cRicoh.AutoBracketing);
-				ricohObj.set("MacroMode",		  cRicoh.MacroMode);
-				ricohObj.set("FlashMode",		  cRicoh.FlashMode);
-				ricohObj.set("FlashExposureComp",  cRicoh.FlashExposureComp);
-				ricohObj.set("ManualFlashOutput",  cRicoh.ManualFlashOutput);
-
-				meta.set("ricoh", ricohObj);
+				std::lock_guard<std::mutex> lock(mutex);
+				working--;
+				doneCond.notify_one();
 			}
-			// ================ SAMSUNG ================
-			else if (makeLower.find("samsung") != std::string::npos)
+		};
+		std::vector<std::thread> helpers;
+		auto stopHelpers = [&]() {
 			{
-				val samsungObj = val::object();
-				const libraw_samsung_makernotes_t &cSamsung =
-					processor_->imgdata.makernotes.samsung;
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			wake.notify_all();
+			for (std::thread& helper : helpers) {
+				helper.join();
+			}
+		};
+		// The pool may have no thread to spare, this one encodes tiles too
+		const PoolThreads granted(job.threads - 1);
+		for (int i = 0; i < granted.count; i++) {
+			helpers.emplace_back(encodeTiles);
+		}
+		std::vector<uint8_t> data;
+		std::string tileError;
 
+		try {
+			for (; level >= 0; level--) {
 				{
-					val arr = val::array();
-					arr.set(0, cSamsung.ImageSizeFull[0]);
-					arr.set(1, cSamsung.ImageSizeFull[1]);
-					arr.set(2, cSamsung.ImageSizeFull[2]);
-					arr.set(3, cSamsung.ImageSizeFull[3]);
-					samsungObj.set("ImageSizeFull", arr);
+					// A helper may still be leaving the previous level
+					std::unique_lock<std::mutex> lock(mutex);
+					doneCond.wait(lock, [&] { return !working; });
+					columns = (width + job.tileSize - 1) / job.tileSize;
+					count = columns * ((height + job.tileSize - 1) / job.tileSize);
+					rowBytes = size_t(width) * pixelBytes;
+					finished = 0;
+					nextTile = 0;
+					generation++;
 				}
-				{
-					val arr = val::array();
-					arr.set(0, cSamsung.ImageSizeCrop[0]);
-					arr.set(1, cSamsung.ImageSizeCrop[1]);
-					arr.set(2, cSamsung.ImageSizeCrop[2]);
-					arr.set(3, cSamsung.ImageSizeCrop[3]);
-					samsungObj.set("ImageSizeCrop", arr);
+				wake.notify_all();
+				for (bool levelDone = false; !levelDone;) {
+					const int i = nextTile++;
+					if (i < count) {
+						encodeTile(i, data, tileError);
+					}
+					std::vector<EncodedTile*> ready;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						doneCond.wait(lock, [&] { return i < count || !done.empty() || ((finished >= count || !error.empty()) && !working); });
+						ready.swap(done);
+						levelDone = (finished >= count || !error.empty()) && !working && done.empty();
+					}
+					for (EncodedTile* tile : ready) {
+						result.tiles++;
+						emscripten_proxy_async(emscripten_proxy_get_system_queue(),
+							emscripten_main_runtime_thread_id(), &WASMLibRaw::onTileEncoded, tile);
+					}
+				}
+				if (!error.empty()) {
+					break;
 				}
 
-				{
-					val arr = val::array();
-					for (int i = 0; i < 11; i++) {
-						arr.set(i, cSamsung.key[i]);
+				if (level > 0) {
+					const int nextWidth = (width + 1) / 2, nextHeight = (height + 1) / 2;
+					current.resize(size_t(nextWidth) * nextHeight * pixelBytes);
+					if (bps == 16) {
+						boxHalve(reinterpret_cast<const uint16_t*>(pixels), width, height,
+							reinterpret_cast<uint16_t*>(current.data()), colors);
+					} else {
+						boxHalve(pixels, width, height, current.data(), colors);
 					}
-					samsungObj.set("key", arr);
+					previous.swap(current);
+					pixels = previous.data();
+					width = nextWidth;
+					height = nextHeight;
 				}
-
-				samsungObj.set("ColorSpace0", cSamsung.ColorSpace[0]);
-				samsungObj.set("ColorSpace1", cSamsung.ColorSpace[1]);
-
-				samsungObj.set("DigitalGain", cSamsung.DigitalGain);
-				samsungObj.set("DeviceType",  cSamsung.DeviceType);
-				samsungObj.set("LensFirmware", std::string(cSamsung.LensFirmware));
-
-				meta.set("samsung", samsungObj);
 			}
-			// ================ KODAK ================
-			else if (makeLower.find("kodak") != std::string::npos)
-			{
-				val kodakObj = val::object();
-				const libraw_kodak_makernotes_t &cKodak =
-					processor_->imgdata.makernotes.kodak;
+		} catch (...) {
+			stopHelpers();
+			throw;
+		}
+		stopHelpers();
+		if (!error.empty()) {
+			throw std::runtime_error(error);
+		}
+		processor_->timings.emplace_back("tiles", emscripten_get_now() - exportStart);
+	}
 
-				kodakObj.set("BlackLevelTop",	  cKodak.BlackLevelTop);
-				kodakObj.set("BlackLevelBottom",   cKodak.BlackLevelBottom);
-				kodakObj.set("offset_left",		cKodak.offset_left);
-				kodakObj.set("offset_top",		 cKodak.offset_top);
-				kodakObj.set("clipBlack",		  cKodak.clipBlack);
-				kodakObj.set("clipWhite",		  cKodak.clipWhite);
+	// The image imageData() returns, in `output` or `scaled`
+	struct Bitmap {
+		uint8_t* data = nullptr;
+		int width = 0, height = 0, colors = 0, bps = 0;
+		size_t dataSize = 0;
+	};
 
-				kodakObj.set("val018percent", cKodak.val018percent);
-				kodakObj.set("val100percent", cKodak.val100percent);
-				kodakObj.set("val170percent", cKodak.val170percent);
-				kodakObj.set("MakerNoteKodak8a", cKodak.MakerNoteKodak8a);
-				kodakObj.set("ISOCalibrationGain", cKodak.ISOCalibrationGain);
-				kodakObj.set("AnalogISO", cKodak.AnalogISO);
+	struct ProgressivePreview {
+		WASMLibRaw* self;
+		const char* source;	// "thumb" or "half"
+		std::string format;	// "bitmap", or "jpeg" for a JPEG thumbnail
+		int width, height, colors, bps;
+		std::vector<uint8_t> data;
+	};
 
-				meta.set("kodak", kodakObj);
+	// Body of the renderProgressive() thread
+	void runProgressive(bool wantThumb, Bitmap& bitmap) {
+		ProgressivePreview* preview = nullptr;
+		libraw_output_params_t &params = processor_->imgdata.params;
+		processor_->startTimings();
+		if (!isProcessed && wantThumb && !inputReleased && processor_->unpack_thumb() == LIBRAW_SUCCESS) {
+			libraw_processed_image_t* thumb = processor_->dcraw_make_mem_thumb();
+			if (thumb && (thumb->type == LIBRAW_IMAGE_JPEG || thumb->type == LIBRAW_IMAGE_BITMAP)) {
+				const bool jpeg = thumb->type == LIBRAW_IMAGE_JPEG;
+				preview = new ProgressivePreview{this, "thumb", jpeg ? "jpeg" : "bitmap", thumb->width, thumb->height,
+					jpeg ? 0 : thumb->colors, jpeg ? 0 : thumb->bits,
+					std::vector<uint8_t>(thumb->data, thumb->data + thumb->data_size)};
 			}
-			// ================ PHASE ONE (p1) ================
-			else if (makeLower.find("phase one") != std::string::npos)
-			{
-				val p1Obj = val::object();
-				const libraw_p1_makernotes_t &cP1 = processor_->imgdata.makernotes.phaseone;
+			if (thumb) {
+				LibRaw::dcraw_clear_mem(thumb);
+			}
+			processor_->endStage("thumb");
+		}
+		int ret = unpackOnce();
+		if (ret != LIBRAW_SUCCESS) {
+			delete preview;
+			throw std::runtime_error("LibRaw: unpack() failed with code " + std::to_string(ret));
+		}
 
-				p1Obj.set("Software",	   std::string(cP1.Software));
-				p1Obj.set("SystemType",	 std::string(cP1.SystemType));
-				p1Obj.set("FirmwareString", std::string(cP1.FirmwareString));
-				p1Obj.set("SystemModel",	std::string(cP1.SystemModel));
+		// No preview when the final render is half size anyway (render()
+		// halves for small targets)
+		int width, height, targetW = 0, targetH = 0;
+		const bool finalHalf = params.half_size || (targetSize(targetWidth, targetHeight, maxDimension,
+			&width, &height, &targetW, &targetH) && targetW * 2 <= width && targetH * 2 <= height);
+		if (!preview && !isProcessed && !finalHalf && processor_->imgdata.idata.filters) {
+			// Half-size pass, keeping the raw data (streamingRelease) for the
+			// final one; its stages are reported as a single "preview" stage
+			const size_t stages = processor_->timings.size();
+			const double previewStart = emscripten_get_now();
+			const bool releaseRaw = processor_->releaseRawAfterCopy;
+			processor_->releaseRawAfterCopy = false;
+			params.half_size = 1;
+			ret = render();
+			params.half_size = 0;
+			processor_->releaseRawAfterCopy = releaseRaw;
+			if (ret != LIBRAW_SUCCESS) {
+				throw std::runtime_error("LibRaw: dcraw_process() failed with code " + std::to_string(ret));
+			}
+			isProcessed = true;
+			Bitmap half;
+			const bool ok = renderBitmap(half);
+			isProcessed = false;
+			if (!ok) {
+				throw std::runtime_error("LibRaw: copy_mem_image() failed");
+			}
+			preview = new ProgressivePreview{this, "half", "bitmap", half.width, half.height, half.colors, half.bps,
+				std::vector<uint8_t>(half.data, half.data + half.dataSize)};
+			processor_->timings.resize(stages);
+			processor_->timings.emplace_back("preview", emscripten_get_now() - previewStart);
+		}
+		if (preview) {
+			emscripten_proxy_async(emscripten_proxy_get_system_queue(),
+				emscripten_main_runtime_thread_id(), &WASMLibRaw::onProgressivePreview, preview);
+		}
 
-				meta.set("p1", p1Obj);
-			}	
+		if (!isProcessed) {
+			ret = render();
+			if (ret != LIBRAW_SUCCESS) {
+				throw std::runtime_error("LibRaw: dcraw_process() failed with code " + std::to_string(ret));
+			}
+			isProcessed = true;
+			processor_->endStage("finish");
+		}
+		if (!renderBitmap(bitmap)) {
+			throw std::runtime_error("LibRaw: copy_mem_image() failed");
 		}
-		return meta;
 	}
 
-	val imageData() {
-		if (!processor_) {
-			return val::undefined();
+	static void onProgressivePreview(void* arg) {
+		ProgressivePreview* preview = static_cast<ProgressivePreview*>(arg);
+		val previewObj = val::object();
+		previewObj.set("source", std::string(preview->source));
+		previewObj.set("format", preview->format);
+		previewObj.set("width",  preview->width);
+		previewObj.set("height", preview->height);
+		if (preview->format == "bitmap") {
+			previewObj.set("colors", preview->colors);
+			previewObj.set("bits",   preview->bps);
 		}
+		previewObj.set("data", preview->self->toJSTypedArray(preview->format == "bitmap" ? preview->bps : 8,
+			preview->data.size(), preview->data.data()));
+		preview->self->previewCallback(previewObj);
+		delete preview;
+	}
 
-		// If not yet unpacked/processed, do it now
-		if (!isUnpacked) {
-			isUnpacked = true;
+	static void onTileEncoded(void* arg) {
+		EncodedTile* tile = static_cast<EncodedTile*>(arg);
+		val tileObj = val::object();
+		tileObj.set("level",  tile->level);
+		tileObj.set("column", tile->column);
+		tileObj.set("row",    tile->row);
+		tileObj.set("width",  tile->width);
+		tileObj.set("height", tile->height);
+		tileObj.set("data", tile->self->toJSTypedArray(8, tile->data.size(), tile->data.data()));
+		tile->self->tileCallback(tileObj);
+		delete tile;
+	}
 
-			int ret = processor_->unpack();
+	// imageData() result of a bitmap
+	val bitmapObject(const Bitmap& bitmap) {
+		val resultObj = val::object();
+		resultObj.set("height", bitmap.height);
+		resultObj.set("width",  bitmap.width);
+		resultObj.set("colors", bitmap.colors);
+		resultObj.set("bits",   bitmap.bps);
+		resultObj.set("dataSize", double(bitmap.dataSize));
+		resultObj.set("data", toJSTypedArray(bitmap.bps, bitmap.dataSize, bitmap.data));
+		return resultObj;
+	}
+
+	// Unpacks and processes the file if not done yet
+	void ensureProcessed() {
+		if (!isProcessed) {
+			processor_->startTimings();
+			int ret = unpackOnce();
 			if (ret != LIBRAW_SUCCESS) {
 				throw std::runtime_error("LibRaw: unpack() failed with code " + std::to_string(ret));
 			}
 
-			ret = processor_->dcraw_process();
+			ret = render();
 			if (ret != LIBRAW_SUCCESS) {
 				throw std::runtime_error("LibRaw: dcraw_process() failed with code " + std::to_string(ret));
 			}
+			// Only now: after a failure (or a throw, e.g. memoryLimitMB) the
+			// next call processes again instead of reading an empty image
+			isProcessed = true;
+			processor_->endStage("finish");
 		}
+	}
 
-		// Make a processed image in memory
-		libraw_processed_image_t* out = nullptr;
-		out = processor_->dcraw_make_mem_image();
-		if (!out) {
-			// If dcraw_make_mem_image() fails or returns null,
-			// we return undefined or throw an error
-			return val::undefined();
-		}
-
-		// Prepare a JS object to hold all the result fields
-		val resultObj = val::object();
-
-		// Store the basic image info
-		resultObj.set("height", out->height);
-		resultObj.set("width",  out->width);
-		resultObj.set("colors", out->colors);
-		resultObj.set("bits",   out->bits);
-        resultObj.set("dataSize", (unsigned int)out->data_size);
-        resultObj.set("data", toJSTypedArray(out->bits, out->data_size, out->data));
+	// The processed file's output bitmap (reduced to the target size, if any)
+	bool renderBitmap(Bitmap& bitmap) {
+		ensureProcessed();
 
-		processor_->dcraw_clear_mem(out);
+		// Render into the reusable output buffer instead of a fresh
+		// dcraw_make_mem_image() allocation per call
+		int width, height, colors, bps;
+		processor_->outputFormat(&width, &height, &colors, &bps);
+		const int stride = width * colors * (bps / 8);
+		size_t dataSize = size_t(stride) * height;
+		const double outputStart = emscripten_get_now();
+		output.resize(dataSize);
 
-		return resultObj;
-	}
-    
-    val thumbnailData() {
-		if (!processor_) return val::undefined();
+		int ret = processor_->copyOutput(output.data(), stride);
+		if (ret != LIBRAW_SUCCESS) {
+			return false;
+		}
+		processor_->timings.emplace_back("output", emscripten_get_now() - outputStart);
+		fullWhitePoint = processor_->whitePoint;
+		const double outputPixels = double(width) * height;
 
-        // Call LibRaw's unpack_thumb function
-        int ret = processor_->unpack_thumb();
+		// targetWidth/targetHeight/maxDimension: only the reduced image leaves the heap
+		uint8_t* data = output.data();
+		if (scaledWidth && (scaledWidth < width || scaledHeight < height)) {
+			const double resampleStart = emscripten_get_now();
+			const int dstWidth = std::min(scaledWidth, width), dstHeight = std::min(scaledHeight, height);
+			dataSize = size_t(dstWidth) * dstHeight * colors * (bps / 8);
+			scaled.resize(dataSize);
+			if (bps == 16) {
+				areaResample(reinterpret_cast<const uint16_t*>(output.data()), width, height, size_t(width) * colors,
+					reinterpret_cast<uint16_t*>(scaled.data()), dstWidth, dstHeight, colors);
+			} else {
+				areaResample(output.data(), width, height, size_t(width) * colors,
+					scaled.data(), dstWidth, dstHeight, colors);
+			}
+			processor_->timings.emplace_back("resample", emscripten_get_now() - resampleStart);
+			width = dstWidth;
+			height = dstHeight;
+			data = scaled.data();
+		}
 
-        if (ret != LIBRAW_SUCCESS) return val::undefined();
+		RenderCosts::instance().learn("output", OUTPUT_COST_PRIOR, emscripten_get_now() - outputStart, outputPixels);
 
-        // Get thumbnail data structure
-        libraw_processed_image_t *img = processor_->dcraw_make_mem_thumb();
-        
-        if (!img) return val::undefined();
+		bitmap.data = data;
+		bitmap.width = width;
+		bitmap.height = height;
+		bitmap.colors = colors;
+		bitmap.bps = bps;
+		bitmap.dataSize = dataSize;
+		return true;
+	}
 
-        val resultObj = val::object();
+	// unpack(), unless an earlier render already did
+	int unpackOnce() {
+		if (isUnpacked) {
+			return LIBRAW_SUCCESS;
+		}
+		int ret = processor_->unpack();
+		if (ret == LIBRAW_SUCCESS) {
+			isUnpacked = true;
+			processor_->endStage("unpack");
+			releaseInputIfStreaming();
+		}
+		return ret;
+	}
 
-        resultObj.set("data", toJSTypedArray(8, img->data_size, img->data));
-        resultObj.set("width", img->width);
-        resultObj.set("height", img->height);
-		
-        std::string formatStr = "unknown";
-        if (img->type == LIBRAW_IMAGE_JPEG) formatStr = "jpeg";
-        else if (img->type == LIBRAW_IMAGE_BITMAP) formatStr = "bitmap";
-        
-        resultObj.set("format", formatStr);
-        
-        LibRaw::dcraw_clear_mem(img);
+	// After unpack() the file bytes are only needed again for thumbnails
+	void releaseInputIfStreaming() {
+		if (!streamingRelease) {
+			return;
+		}
+		processor_->recycle_datastream();
+		std::vector<uint8_t>().swap(buffer);
+		inputReleased = true;
+	}
 
-        return resultObj;
-    }
+	static int settingOr(const val& settings, const char* name, int fallback) {
+		if (settings.isUndefined() || settings.isNull() || !settings.hasOwnProperty(name)) {
+			return fallback;
+		}
+		return settings[name].as<int>();
+	}
 
-private:
-	LibRaw* processor_ = nullptr;
-    std::vector<uint8_t> buffer;
-	bool isUnpacked = false;
+	void ensureIdle() const {
+		if (busy) {
+			throw std::runtime_error("LibRaw: session is busy processing");
+		}
+	}
 
 	void applySettings(const val& settings) {
 		// If 'settings' is null or undefined, just skip
@@ -1125,6 +4046,28 @@ private:
 		if (settings.hasOwnProperty("noInterpolation")) {
 			params.no_interpolation = settings["noInterpolation"].as<int>();
 		}
+		if (settings.hasOwnProperty("memoryLimitMB")) {
+			processor_->imgdata.rawparams.max_raw_memory_mb = settings["memoryLimitMB"].as<unsigned>();
+		}
+		if (settings.hasOwnProperty("streamingRelease")) {
+			streamingRelease = settings["streamingRelease"].as<bool>();
+			processor_->releaseRawAfterCopy = streamingRelease;
+		}
+		if (settings.hasOwnProperty("targetWidth")) {
+			targetWidth = settings["targetWidth"].as<int>();
+		}
+		if (settings.hasOwnProperty("targetHeight")) {
+			targetHeight = settings["targetHeight"].as<int>();
+		}
+		if (settings.hasOwnProperty("maxDimension")) {
+			maxDimension = settings["maxDimension"].as<int>();
+		}
+		if (settings.hasOwnProperty("timeBudgetMs")) {
+			timeBudgetMs = settings["timeBudgetMs"].as<double>();
+		}
+		if (settings.hasOwnProperty("compactProcessing")) {
+			processor_->compactRequested = settings["compactProcessing"].as<bool>();
+		}
 
 		// -- STRINGS (C-strings) --
 		if (settings.hasOwnProperty("outputProfile") && settings["outputProfile"].typeOf().as<std::string>()=="string") {
@@ -1140,8 +4083,8 @@ private:
 			setStringMember(params.dark_frame, settings["darkFrame"].as<std::string>());
 		}
 	}
-	// Convert a JS Uint8Array to a std::vector<uint8_t>
-	std::vector<uint8_t> toNativeVector(const val &jsBufLike) {
+	// Copy a JS Uint8Array into a std::vector<uint8_t>, reusing its capacity
+	void copyToNativeVector(const val &jsBufLike, std::vector<uint8_t> &out) {
         const val Uint8Array = val::global("Uint8Array");
         const val ArrayBuffer = val::global("ArrayBuffer");
 
@@ -1154,27 +4097,27 @@ private:
                                         jsBufLike["byteOffset"],
                                         jsBufLike["byteLength"]));
 
-        const size_t n = u8["byteLength"].as<size_t>();
-        std::vector<uint8_t> out(n);
+        const size_t n = size_t(u8["byteLength"].as<double>());
+        out.resize(n);
 
         // Create a Uint8Array view into WASM memory and copy JS -> WASM in one go
         val wasmView = val(emscripten::typed_memory_view(out.size(), out.data()));
         wasmView.call<void>("set", u8);   // single memcpy under the hood
-
-        return out;
 	}
     
+    // Lengths go to JS as doubles: exact up to 2^53, and plain numbers (not
+    // BigInt) under MEMORY64 too
     val toJSTypedArray(size_t bits, size_t data_size, uint8_t *data) {
         if (bits == 16) {
-            unsigned length = (unsigned)data_size / 2;
+            const size_t length = data_size / 2;
             val typedArrayCtor = val::global("Uint16Array");
-            val typedArray = typedArrayCtor.new_(val(length));
+            val typedArray = typedArrayCtor.new_(val(double(length)));
             val memView = val(typed_memory_view(length, (uint16_t*)data));
             typedArray.call<void>("set", memView);
             return typedArray;
         } else {
             val typedArrayCtor = val::global("Uint8Array");
-            val typedArray = typedArrayCtor.new_(val((unsigned)data_size));
+            val typedArray = typedArrayCtor.new_(val(double(data_size)));
             val memView = val(typed_memory_view(data_size, (uint8_t*)data));
             typedArray.call<void>("set", memView);
             return typedArray;
@@ -1214,12 +4157,80 @@ private:
 	}
 };
 
+// Size and limit of the WASM heap (shared by every session), cheap enough to
+// go with every worker reply: used by the JS side for backpressure and worker
+// recycling. The heap never shrinks, so heapSize is also its high-water mark.
+val heapSummary() {
+	val stats = val::object();
+	stats.set("heapSize", double(emscripten_get_heap_size()));
+	stats.set("heapMax",  double(emscripten_get_heap_max()));
+	return stats;
+}
+
+// heapSummary() plus malloc's figures and the block pool, for memoryStats()
+val heapStats() {
+	size_t allocated, free;
+	heapUsage(allocated, free);
+	notePeakAllocated(allocated);
+	val stats = val::object();
+	stats.set("heapSize", double(emscripten_get_heap_size()));
+	stats.set("heapMax",  double(emscripten_get_heap_max()));
+	stats.set("allocated", double(allocated));
+	stats.set("free",      double(free));
+	stats.set("peakAllocated", double(peakAllocated.load()));
+
+	// Large LibRaw blocks kept for reuse (counted as allocated above)
+	size_t pooledBytes = 0, pooledBlocks = 0, poolMax = 0;
+	unsigned long long poolReuses = 0;
+#ifdef LIBRAW_WASM_BLOCKPOOL
+	libraw_blockpool::instance().stats(&pooledBytes, &pooledBlocks, &poolMax, &poolReuses);
+#endif
+	stats.set("pooled",       double(pooledBytes));
+	stats.set("pooledBlocks", double(pooledBlocks));
+	stats.set("poolMax",      double(poolMax));
+	stats.set("poolReuses",   double(poolReuses));
+	return stats;
+}
+
+// Byte budget of LibRaw's block pool; 0 returns every pooled block to malloc
+void configurePool(double maxBytes) {
+#ifdef LIBRAW_WASM_BLOCKPOOL
+	libraw_blockpool::instance().set_limit(size_t(maxBytes));
+#endif
+}
+
+void resetHeapPeak() {
+	size_t allocated, free;
+	heapUsage(allocated, free);
+	peakAllocated = allocated;
+}
+
 EMSCRIPTEN_BINDINGS(libraw_module) {
+	function("heapSummary", &heapSummary);
+	function("heapStats", &heapStats);
+	function("resetHeapPeak", &resetHeapPeak);
+	function("configurePool", &configurePool);
 	register_vector<uint8_t>("VectorUint8");
 	class_<WASMLibRaw>("LibRaw")
 		.constructor<>()
 		.function("open", &WASMLibRaw::open)
 		.function("metadata", &WASMLibRaw::metadata)
         .function("imageData", &WASMLibRaw::imageData)
-		.function("thumbnailData", &WASMLibRaw::thumbnailData);
+		.function("thumbnailData", &WASMLibRaw::thumbnailData)
+		.function("processAsync", &WASMLibRaw::processAsync)
+		.function("isBusy", &WASMLibRaw::isBusy)
+		.function("estimateMemory", &WASMLibRaw::estimateMemory)
+		.function("renderRegion", &WASMLibRaw::renderRegion)
+		.function("binnedPreview", &WASMLibRaw::binnedPreview)
+		.function("pyramid", &WASMLibRaw::pyramid)
+		.function("streamRows", &WASMLibRaw::streamRows)
+		.function("exportTiles", &WASMLibRaw::exportTiles)
+		.function("encode", &WASMLibRaw::encode)
+		.function("renderProgressive", &WASMLibRaw::renderProgressive)
+		.function("stageTimings", &WASMLibRaw::stageTimings)
+		.function("budgetChoices", &WASMLibRaw::budgetChoices)
+		.function("contentHash", &WASMLibRaw::contentHash)
+		.function("uniqueId", &WASMLibRaw::uniqueId)
+		.function("pause", &WASMLibRaw::pause)
+		.function("resume", &WASMLibRaw::resume);
 }
@@ -0,0 +1,352 @@
+/* -*- C++ -*-
+ * File: libraw_alloc.h
+ * Copyright 2008-2025 LibRaw LLC (info@libraw.org)
+ * Created: Sat Mar  22, 2008
+ *
+ * LibRaw C++ interface
+ *
+LibRaw is free software; you can redistribute it and/or modify
+it under the terms of the one of two licenses as you choose:
+
+1. GNU LESSER GENERAL PUBLIC LICENSE version 2.1
+   (See file LICENSE.LGPL provided in LibRaw distribution archive for details).
+
+2. COMMON DEVELOPMENT AND DISTRIBUTION LICENSE (CDDL) Version 1.0
+   (See file LICENSE.CDDL provided in LibRaw distribution archive for details).
+
+ */
+
+/*
+ * libraw-wasm patch (copied over the LibRaw source by compileLibraw.sh):
+ *  - allocations of LIBRAW_POOL_MIN_SIZE bytes or more (raw_alloc, image,
+ *    demosaic buffers...) are rounded to a size class and, once freed, kept in
+ *    a pool shared by every LibRaw object instead of going back to malloc. The
+ *    pool survives recycle(), so the next file reuses the same blocks instead
+ *    of fragmenting the (never shrinking) WASM heap.
+ *  - live pointers are tracked in a hash map instead of a linear scan of the
+ *    512-slot mems array. The LIBRAW_MSIZE limit is still enforced.
+ */
+
+#ifndef __LIBRAW_ALLOC_H
+#define __LIBRAW_ALLOC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "libraw_const.h"
+
+#ifdef __cplusplus
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define LIBRAW_MSIZE 512
+
+/* Lets code built against this header use libraw_blockpool */
+#define LIBRAW_WASM_BLOCKPOOL 1
+
+#ifndef LIBRAW_POOL_MIN_SIZE
+#define LIBRAW_POOL_MIN_SIZE (1 << 20)
+#endif
+#ifndef LIBRAW_POOL_DEFAULT_LIMIT
+#define LIBRAW_POOL_DEFAULT_LIMIT (256 << 20)
+#endif
+
+class DllDef libraw_blockpool
+{
+public:
+  /* 8 classes per power of two: at most 12.5% rounding overhead */
+  enum
+  {
+    SUBCLASS_BITS = 3,
+    SUBCLASSES = 1 << SUBCLASS_BITS,
+    CLASSES = 64 * SUBCLASSES
+  };
+
+  static libraw_blockpool &instance()
+  {
+    /* never destroyed: LibRaw objects may outlive static destructors */
+    static libraw_blockpool *pool = new libraw_blockpool();
+    return *pool;
+  }
+
+  /* Size class of an allocation, -1 if it isn't pooled */
+  static int size_class(size_t sz)
+  {
+    if (sz < LIBRAW_POOL_MIN_SIZE)
+      return -1;
+    int e = 0;
+    while (e < 63 && (((unsigned long long)1) << (e + 1)) <= sz)
+      e++;
+    unsigned long long base = ((unsigned long long)1) << e;
+    unsigned long long step = base >> SUBCLASS_BITS;
+    unsigned long long sub = (sz - base + step - 1) / step;
+    int cls = e * SUBCLASSES + (int)sub; /* sub == SUBCLASSES is the next power */
+    if (cls >= CLASSES || class_size(cls) < sz ||
+        class_size(cls) > (unsigned long long)(size_t)-1)
+      return -1;
+    return cls;
+  }
+
+  static unsigned long long class_size(int cls)
+  {
+    unsigned long long base = ((unsigned long long)1) << (cls / SUBCLASSES);
+    return base + (cls % SUBCLASSES) * (base >> SUBCLASS_BITS);
+  }
+
+  /* A free block of class `cls`, or a new one */
+  void *take(int cls, bool zero)
+  {
+    size_t sz = (size_t)class_size(cls);
+    void *ptr = NULL;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      std::vector<block> &blocks = free_blocks[cls];
+      if (!blocks.empty())
+      {
+        ptr = blocks.back().ptr;
+        blocks.pop_back();
+        bytes -= sz;
+        count--;
+        reused++;
+      }
+    }
+    if (!ptr)
+      return zero ? ::calloc(sz, 1) : ::malloc(sz);
+    if (zero)
+      memset(ptr, 0, sz);
+    return ptr;
+  }
+
+  /* Keep a freed block for reuse, evicting the least recently freed ones
+     beyond the limit */
+  void give(void *ptr, int cls)
+  {
+    size_t sz = (size_t)class_size(cls);
+    std::vector<void *> evicted;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (sz > limit)
+      {
+        evicted.push_back(ptr);
+      }
+      else
+      {
+        block b = {ptr, ++clock};
+        free_blocks[cls].push_back(b);
+        bytes += sz;
+        count++;
+        while (bytes > limit)
+          evicted.push_back(evict_oldest());
+      }
+    }
+    for (size_t i = 0; i < evicted.size(); i++)
+      ::free(evicted[i]);
+  }
+
+  void set_limit(size_t maxbytes)
+  {
+    std::vector<void *> evicted;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      limit = maxbytes;
+      while (bytes > limit)
+        evicted.push_back(evict_oldest());
+    }
+    for (size_t i = 0; i < evicted.size(); i++)
+      ::free(evicted[i]);
+  }
+
+  /* Return every pooled block to malloc */
+  void trim()
+  {
+    size_t keep = limit;
+    set_limit(0);
+    std::lock_guard<std::mutex> guard(lock);
+    limit = keep;
+  }
+
+  void stats(size_t *pooled_bytes, size_t *pooled_blocks, size_t *max_bytes,
+             unsigned long long *reuses)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    *pooled_bytes = bytes;
+    *pooled_blocks = count;
+    *max_bytes = limit;
+    *reuses = reused;
+  }
+
+private:
+  struct block
+  {
+    void *ptr;
+    unsigned long long stamp;
+  };
+
+  libraw_blockpool()
+      : bytes(0), count(0), limit(LIBRAW_POOL_DEFAULT_LIMIT), clock(0),
+        reused(0)
+  {
+  }
+
+  /* Caller holds the lock and bytes > 0 */
+  void *evict_oldest()
+  {
+    int oldest = -1;
+    for (int cls = 0; cls < CLASSES; cls++)
+      if (!free_blocks[cls].empty() &&
+          (oldest < 0 || free_blocks[cls].front().stamp <
+                             free_blocks[oldest].front().stamp))
+        oldest = cls;
+    std::vector<block> &blocks = free_blocks[oldest];
+    void *ptr = blocks.front().ptr;
+    blocks.erase(blocks.begin());
+    bytes -= (size_t)class_size(oldest);
+    count--;
+    return ptr;
+  }
+
+  std::mutex lock;
+  std::vector<block> free_blocks[CLASSES];
+  size_t bytes, count, limit;
+  unsigned long long clock, reused;
+};
+
+class DllDef libraw_memmgr
+{
+public:
+  libraw_memmgr(unsigned ee) : extra_bytes(ee) { mems.reserve(LIBRAW_MSIZE); }
+  ~libraw_memmgr() { cleanup(); }
+  void *malloc(size_t sz)
+  {
+#ifdef LIBRAW_USE_CALLOC_INSTEAD_OF_MALLOC
+    return alloc(sz + extra_bytes, true);
+#else
+    return alloc(sz + extra_bytes, false);
+#endif
+  }
+  void *calloc(size_t n, size_t sz)
+  {
+    size_t items = n + (extra_bytes + sz - 1) / (sz ? sz : 1);
+    if (sz && items > ((size_t)-1) / sz)
+      return NULL;
+    return alloc(items * sz, true);
+  }
+  void *realloc(void *ptr, size_t newsz)
+  {
+    if (!ptr)
+      return malloc(newsz);
+    size_t want = newsz + extra_bytes;
+    entry old = {0, -1};
+    bool tracked = false;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      std::unordered_map<void *, entry>::iterator it = mems.find(ptr);
+      if (it != mems.end())
+      {
+        old = it->second;
+        tracked = true;
+      }
+    }
+    if (!tracked || (old.cls < 0 && libraw_blockpool::size_class(want) < 0))
+    {
+      /* small to small: plain realloc */
+      void *ret = ::realloc(ptr, want);
+      if (ret)
+      {
+        forget_ptr(ptr);
+        mem_ptr(ret, want, -1);
+      }
+      return ret;
+    }
+    if (old.cls >= 0 && want <= libraw_blockpool::class_size(old.cls))
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      mems[ptr].size = want;
+      return ptr;
+    }
+    void *ret = alloc(want, false);
+    if (ret)
+    {
+      memcpy(ret, ptr, old.size < want ? old.size : want);
+      free(ptr);
+    }
+    return ret;
+  }
+  void free(void *ptr)
+  {
+    if (!ptr)
+      return;
+    release(ptr, forget_ptr(ptr));
+  }
+  void cleanup(void)
+  {
+    std::unordered_map<void *, entry> live;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      live.swap(mems);
+      mems.reserve(LIBRAW_MSIZE);
+    }
+    for (std::unordered_map<void *, entry>::iterator it = live.begin();
+         it != live.end(); ++it)
+      release(it->first, it->second.cls);
+  }
+
+private:
+  struct entry
+  {
+    size_t size;
+    int cls; /* pool size class, -1 for plain malloc blocks */
+  };
+
+  std::unordered_map<void *, entry> mems;
+  std::mutex lock;
+  unsigned extra_bytes;
+
+  void *alloc(size_t sz, bool zero)
+  {
+    int cls = libraw_blockpool::size_class(sz);
+    void *ptr;
+    if (cls >= 0)
+      ptr = libraw_blockpool::instance().take(cls, zero);
+    else
+      ptr = zero ? ::calloc(sz, 1) : ::malloc(sz);
+    mem_ptr(ptr, sz, cls);
+    return ptr;
+  }
+  void release(void *ptr, int cls)
+  {
+    if (cls >= 0)
+      libraw_blockpool::instance().give(ptr, cls);
+    else
+      ::free(ptr);
+  }
+  void mem_ptr(void *ptr, size_t sz, int cls)
+  {
+    if (!ptr)
+      return;
+    std::lock_guard<std::mutex> guard(lock);
+    entry e = {sz, cls};
+    mems[ptr] = e;
+#ifdef LIBRAW_MEMPOOL_CHECK
+    /* ptr stays tracked, to be free'ed at cleanup */
+    if (mems.size() >= LIBRAW_MSIZE)
+      throw LIBRAW_EXCEPTION_MEMPOOL;
+#endif
+  }
+  /* Returns the pool size class of the forgotten block */
+  int forget_ptr(void *ptr)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<void *, entry>::iterator it = mems.find(ptr);
+    if (it == mems.end())
+      return -1;
+    int cls = it->second.cls;
+    mems.erase(it);
+    return cls;
+  }
+};
+
+#endif /* C++ */
+
+#endif
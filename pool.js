@@ -0,0 +1,129 @@
+import LibRaw from './index.js';
+
+const MB = 1024 * 1024;
+
+async function toUint8Array(input) {
+	if (input instanceof Uint8Array) {
+		return input;
+	}
+	if (input instanceof ArrayBuffer) {
+		return new Uint8Array(input);
+	}
+	if (ArrayBuffer.isView(input)) {
+		return new Uint8Array(input.buffer, input.byteOffset, input.byteLength);
+	}
+	if (typeof input?.arrayBuffer === 'function') { // Blob/File: read only once admitted
+		return new Uint8Array(await input.arrayBuffer());
+	}
+	throw new Error('LibRawPool: unsupported input, expected a buffer or a Blob');
+}
+
+function resultBytes(result) {
+	return (result.image?.data?.byteLength || 0) + (result.thumb?.data?.byteLength || 0);
+}
+
+/**
+ * A fixed set of LibRaw workers fed from an (async) iterable of files
+ */
+export default class LibRawPool {
+	constructor({size, recycleHeapAbove = 0} = {}) {
+		size = size || globalThis.navigator?.hardwareConcurrency || 4;
+		this.workers = Array.from({length: size}, () => ({raw: new LibRaw({recycleHeapAbove}), busy: false}));
+	}
+
+	// An idle worker, preferring the ones with enough heap headroom. When every
+	// worker is idle one is always returned so the pipeline can't stall.
+	pickWorker(minHeapHeadroom) {
+		const idle = this.workers.filter(w => !w.busy);
+		const headroom = w => w.raw.heap ? w.raw.heap.heapMax - w.raw.heap.heapSize : Infinity;
+		const roomy = idle.find(w => headroom(w) >= minHeapHeadroom);
+		if (roomy || idle.length < this.workers.length) {
+			return roomy;
+		}
+		return idle.reduce((best, w) => headroom(w) > headroom(best) ? w : best, idle[0]);
+	}
+
+	/**
+	 * Decode files from a sync or async iterable, yielding results in completion
+	 * order (`result.index` is the input position). New files are only pulled
+	 * while fewer than `maxInFlight` files and `maxBytesInFlight` bytes (inputs
+	 * being decoded plus results not yet consumed) are outstanding, and while a
+	 * worker has `minHeapHeadroom` bytes of heap left, so a slow consumer keeps
+	 * memory steady instead of queueing unbounded work.
+	 */
+	async *process(files, {
+		settings,
+		outputs = ['metadata', 'image'],
+		fullMetadata = false,
+		maxInFlight = this.workers.length * 2,
+		maxBytesInFlight = 512 * MB,
+		minHeapHeadroom = 256 * MB,
+	} = {}) {
+		const iterator = (files[Symbol.asyncIterator] || files[Symbol.iterator]).call(files);
+		const finished = [];
+		let inFlight = 0;
+		let bytesInFlight = 0;
+		let index = 0;
+		let exhausted = false;
+		let notify = () => {};
+
+		const dispatch = (worker, input, job) => {
+			worker.busy = true;
+			worker.raw.processBatch([input], settings, {outputs, fullMetadata})
+				.then(([result]) => result, err => ({error: err.message}))
+				.then(result => {
+					worker.busy = false;
+					result.index = job.index;
+					// The input has been released by the worker, the output is now held
+					const bytes = resultBytes(result);
+					bytesInFlight += bytes - job.bytes;
+					finished.push({result, bytes});
+					notify();
+				});
+		};
+
+		try {
+			while (true) {
+				while (!exhausted && inFlight < maxInFlight && (inFlight === 0 || bytesInFlight < maxBytesInFlight)) {
+					const worker = this.pickWorker(minHeapHeadroom);
+					if (!worker) {
+						break;
+					}
+					const next = await iterator.next();
+					if (next.done) {
+						exhausted = true;
+						break;
+					}
+					const input = await toUint8Array(next.value);
+					const job = {index: index++, bytes: input.byteLength};
+					inFlight++;
+					bytesInFlight += job.bytes;
+					dispatch(worker, input, job);
+				}
+
+				if (finished.length) {
+					const {result, bytes} = finished.shift();
+					yield result;
+					// Only released once the consumer asks for the next result
+					inFlight--;
+					bytesInFlight -= bytes;
+				} else if (exhausted && inFlight === 0) {
+					return;
+				} else {
+					await new Promise(resolve => notify = resolve);
+				}
+			}
+		} finally {
+			if (!exhausted) {
+				await iterator.return?.();
+			}
+		}
+	}
+
+	/**
+	 * Terminate every worker of the pool
+	 */
+	async close() {
+		await Promise.all(this.workers.map(w => w.raw.close()));
+	}
+}
@@ -0,0 +1,127 @@
+// Persistent tier for previews and metadata. Entries survive reloads: in the
+// browser they live in the Origin Private File System (read/written through
+// sync access handles, so this must run in a dedicated worker), on Node in a
+// plain directory.
+
+// Entry layout: [u32 LE JSON length][JSON][optional binary payload (`data`)]
+export function encodeEntry(value) {
+	const {data, ...rest} = value;
+	const json = new TextEncoder().encode(JSON.stringify({...rest, hasData: ArrayBuffer.isView(data)}));
+	const payload = ArrayBuffer.isView(data) ? new Uint8Array(data.buffer, data.byteOffset, data.byteLength) : new Uint8Array(0);
+	const entry = new Uint8Array(4 + json.byteLength + payload.byteLength);
+	new DataView(entry.buffer).setUint32(0, json.byteLength, true);
+	entry.set(json, 4);
+	entry.set(payload, 4 + json.byteLength);
+	return entry;
+}
+
+export function decodeEntry(entry) {
+	const length = new DataView(entry.buffer, entry.byteOffset, entry.byteLength).getUint32(0, true);
+	const {hasData, ...value} = JSON.parse(new TextDecoder().decode(entry.subarray(4, 4 + length)));
+	if (hasData) {
+		value.data = entry.slice(4 + length);
+	}
+	return value;
+}
+
+function fileName(key, kind) {
+	return encodeURIComponent(`${key}.${kind}`).replace(/\*/g, '%2A');
+}
+
+class OPFSStore {
+	constructor(directory) {
+		this.directory = directory;
+	}
+
+	async read(key, kind) {
+		let handle;
+		try {
+			const file = await this.directory.getFileHandle(fileName(key, kind));
+			handle = await file.createSyncAccessHandle();
+			const entry = new Uint8Array(handle.getSize());
+			handle.read(entry, {at: 0});
+			return entry;
+		} catch {
+			return undefined; // missing, or locked by a concurrent writer
+		} finally {
+			handle?.close();
+		}
+	}
+
+	async write(key, kind, entry) {
+		let handle;
+		try {
+			const file = await this.directory.getFileHandle(fileName(key, kind), {create: true});
+			handle = await file.createSyncAccessHandle();
+			handle.truncate(0);
+			handle.write(entry, {at: 0});
+			handle.flush();
+		} finally {
+			handle?.close();
+		}
+	}
+
+	async clear() {
+		for await (const name of this.directory.keys()) {
+			await this.directory.removeEntry(name);
+		}
+	}
+}
+
+class NodeStore {
+	constructor(fs, path, directory) {
+		this.fs = fs;
+		this.path = path;
+		this.directory = directory;
+		fs.mkdirSync(directory, {recursive: true});
+	}
+
+	file(key, kind) {
+		return this.path.join(this.directory, fileName(key, kind));
+	}
+
+	readSync(key, kind) {
+		try {
+			return new Uint8Array(this.fs.readFileSync(this.file(key, kind)));
+		} catch {
+			return undefined;
+		}
+	}
+
+	writeSync(key, kind, entry) {
+		// Write then rename, so readers never see a partial entry
+		const file = this.file(key, kind);
+		const tmp = `${file}.${process.pid}.tmp`;
+		this.fs.writeFileSync(tmp, entry);
+		this.fs.renameSync(tmp, file);
+	}
+
+	async read(key, kind) {
+		return this.readSync(key, kind);
+	}
+
+	async write(key, kind, entry) {
+		this.writeSync(key, kind, entry);
+	}
+
+	async clear() {
+		this.fs.rmSync(this.directory, {recursive: true, force: true});
+		this.fs.mkdirSync(this.directory, {recursive: true});
+	}
+}
+
+/**
+ * Open the persistent store: `directory` is a filesystem path on Node, or the
+ * name of an OPFS directory in the browser (default 'libraw-previews').
+ */
+export async function openPersistentStore({directory = 'libraw-previews'} = {}) {
+	if (globalThis.process?.versions?.node) {
+		const [fs, path] = await Promise.all([import('node:fs'), import('node:path')]);
+		return new NodeStore(fs, path, directory);
+	}
+	if (!globalThis.navigator?.storage?.getDirectory) {
+		throw new Error('LibRaw: no persistent storage available (OPFS or Node.js required)');
+	}
+	const root = await navigator.storage.getDirectory();
+	return new OPFSStore(await root.getDirectoryHandle(directory, {create: true}));
+}
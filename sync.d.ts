@@ -0,0 +1,30 @@
+import type { BatchOptions, BatchResult, BinnedPreviewOptions, BudgetChoices, EncodedImage, EncodedTile, EncodeOptions, LibRawOptions, MemoryEstimate, ProgressiveOptions, ProgressivePreview, Pyramid, PyramidOptions, RawImageData, RegionImageData, RowBand, StreamedImage, StreamRowsOptions, ThumbnailImageData, TileExportOptions, TileSet } from './index';
+
+declare class LibRawSync {
+  /** Loads the WASM module (shared by all instances) and creates a processor */
+  static create(): Promise<LibRawSync>;
+  /** Budget of the module's pool of large LibRaw blocks; 0 empties it */
+  static configurePool(options: { maxBytes: number }): Promise<void>;
+  /** Persists previews/metadata in `directory` (Node); null disables it */
+  configurePersistentCache(options?: { directory?: string } | null): Promise<void>;
+  open(data: Uint8Array, options?: LibRawOptions): void;
+  estimateMemory(options?: LibRawOptions): MemoryEstimate;
+  metadata(fullOutput?: boolean): unknown;
+  imageData(): RawImageData | undefined;
+  budgetChoices(): BudgetChoices | undefined;
+  renderProgressive(settings?: ProgressiveOptions, handlers?: { onPreview?: (preview: ProgressivePreview) => void }): Promise<RawImageData>;
+  /** `band.data` is a view into the module's heap, overwritten by the next band */
+  streamRows(options: StreamRowsOptions | undefined, handlers: { onBand: (band: RowBand) => void }): StreamedImage;
+  pyramid(options?: PyramidOptions): Pyramid;
+  encode(options?: EncodeOptions): Promise<EncodedImage>;
+  exportTiles(options: TileExportOptions | undefined, handlers: { onTile: (tile: EncodedTile) => void }): Promise<TileSet>;
+  exportTiles(options?: TileExportOptions): Promise<TileSet & { tiles: EncodedTile[] }>;
+  renderRegion(x: number, y: number, width: number, height: number, scale?: number): RegionImageData;
+  binnedPreview(options?: BinnedPreviewOptions): RawImageData;
+  thumbnailData(): ThumbnailImageData | undefined;
+  processBatch(files: Uint8Array[], options?: LibRawOptions, batch?: BatchOptions): Generator<BatchResult>;
+  /** Frees the native processor; the instance can't be used afterwards */
+  delete(): void;
+}
+export { LibRawSync };
+export default LibRawSync;
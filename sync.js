@@ -0,0 +1,223 @@
+import LibRawModule from './libraw.js';
+import { formatMetadata } from './utils.js';
+import { openPersistentStore, encodeEntry, decodeEntry } from './store.js';
+
+let modulePromise;
+
+// One module instance per process/thread, shared by every LibRawSync object
+function loadModule() {
+	if (!modulePromise) {
+		modulePromise = LibRawModule();
+	}
+	return modulePromise;
+}
+
+/**
+ * In-thread counterpart of LibRaw: calls the Embind class directly instead of
+ * going through a Web Worker. Meant for CLI/server batch jobs that already run
+ * one process (or worker) per core.
+ */
+export default class LibRawSync {
+	/**
+	 * Load the WASM module (once) and return a ready-to-use instance
+	 */
+	static async create() {
+		return new LibRawSync(await loadModule());
+	}
+
+	constructor(module) {
+		if (!module?.LibRaw) {
+			throw new Error('LibRawSync: use `await LibRawSync.create()`');
+		}
+		this.raw = new module.LibRaw();
+		this.store = null;
+		this.persistentKey = null;	// store key of the opened file
+	}
+
+	/**
+	 * Keep previews and metadata in the directory `directory` on Node, keyed by
+	 * the camera's unique image ID (content hash as fallback), so revisiting a
+	 * folder skips their extraction. Applies to files opened afterwards. Pass
+	 * null to disable it.
+	 */
+	async configurePersistentCache(options = {}) {
+		this.store = options ? await openPersistentStore(options) : null;
+	}
+
+	/**
+	 * Byte budget of the module's pool of large LibRaw blocks, shared by every
+	 * LibRawSync instance. 0 releases every pooled block.
+	 */
+	static async configurePool({maxBytes}) {
+		(await loadModule()).configurePool(maxBytes);
+	}
+
+	persisted(kind, producer) {
+		const key = this.persistentKey;
+		if (!this.store?.readSync || !key) {
+			return producer();
+		}
+		const entry = this.store.readSync(key, kind);
+		if (entry) {
+			return decodeEntry(entry);
+		}
+		const value = producer();
+		if (value) {
+			this.store.writeSync(key, kind, encodeEntry(value));
+		}
+		return value;
+	}
+
+	/**
+	 * Open/parse the RAW data with optional settings
+	 */
+	open(buffer, settings) {
+		this.raw.open(buffer, settings);
+		// Hashed now: with streamingRelease the file bytes are gone after unpack
+		this.persistentKey = this.store ? (this.raw.uniqueId() || this.raw.contentHash()) : null;
+	}
+
+	/**
+	 * Estimate the heap, in bytes, a render of the opened file needs with
+	 * `settings` applied on top of the current ones
+	 */
+	estimateMemory(settings) {
+		return this.raw.estimateMemory(settings ?? null);
+	}
+
+	/**
+	 * Retrieve metadata
+	 */
+	metadata(fullOutput) {
+		return formatMetadata(this.persisted(`metadata:${!!fullOutput}`, () => this.raw.metadata(!!fullOutput)));
+	}
+
+	/**
+	 * Retrieve processed image data
+	 */
+	imageData() {
+		return this.raw.imageData();
+	}
+
+	/**
+	 * Settings the last render chose to fit in timeBudgetMs
+	 */
+	budgetChoices() {
+		return this.raw.budgetChoices();
+	}
+
+	/**
+	 * Render a quick preview for `onPreview`, then the full-quality image
+	 * (resolved), from raw data unpacked once, on a pthread
+	 */
+	renderProgressive(settings, {onPreview} = {}) {
+		return new Promise((resolve, reject) => {
+			this.raw.renderProgressive(settings ?? null, preview => onPreview?.(preview),
+				(error, image) => error ? reject(new Error(error)) : resolve(image));
+		});
+	}
+
+	/**
+	 * Render the image and pass it to `onBand` in horizontal bands of `rows`
+	 * rows ({rows}). `band.data` views the module's heap and is overwritten by
+	 * the next band: copy what has to outlive the callback.
+	 */
+	streamRows(options, {onBand}) {
+		return this.raw.streamRows(options ?? null, onBand);
+	}
+
+	/**
+	 * Render the image and cut it into mip levels of tiles ({levels, tileSize})
+	 */
+	pyramid(options) {
+		return this.raw.pyramid(options ?? null);
+	}
+
+	/**
+	 * Render the image and encode it ({format: 'jpeg', quality, progressive,
+	 * optimize} or {format: 'png'|'tiff', compression, threads}) on pthreads
+	 */
+	encode(options) {
+		return new Promise((resolve, reject) => {
+			this.raw.encode(options ?? null, (error, result) => error ? reject(new Error(error)) : resolve(result));
+		});
+	}
+
+	/**
+	 * Render the image as a Deep Zoom tile set, encoded on pthreads. Resolves
+	 * once every tile went to `onTile` (or into `tiles` without it).
+	 */
+	exportTiles(options, {onTile} = {}) {
+		const tiles = [];
+		return new Promise((resolve, reject) => {
+			this.raw.exportTiles(options ?? null, tile => onTile ? onTile(tile) : tiles.push(tile), (error, info) => {
+				if (error) {
+					reject(new Error(error));
+				} else {
+					resolve(onTile ? info : {...info, tiles});
+				}
+			});
+		});
+	}
+
+	/**
+	 * Render the (x, y, width, height) window of the oriented full-size image,
+	 * `scale` times smaller
+	 */
+	renderRegion(x, y, width, height, scale = 1) {
+		return this.raw.renderRegion(x, y, width, height, scale);
+	}
+
+	/**
+	 * Fast culling preview binned from the raw mosaic ({factor})
+	 */
+	binnedPreview(options) {
+		return this.raw.binnedPreview(options ?? null);
+	}
+
+	/**
+	 * Retrieve the embedded JPEG preview (Fast extraction)
+	 */
+	thumbnailData() {
+		return this.persisted('thumb', () => this.raw.thumbnailData());
+	}
+
+	/**
+	 * Process a list of files one after another, yielding each result as it is
+	 * ready. The native input/output buffers are reused between files, and each
+	 * file is released during its decode (`streamingRelease`) unless disabled.
+	 */
+	*processBatch(files, settings, {outputs = ['metadata', 'image'], fullMetadata = false} = {}) {
+		settings = {streamingRelease: true, ...settings};
+		for (let index = 0; index < files.length; index++) {
+			const result = {index};
+			try {
+				this.open(files[index], settings);
+				if (outputs.includes('metadata')) {
+					result.metadata = this.metadata(fullMetadata);
+				}
+				if (outputs.includes('thumb')) {
+					result.thumb = this.thumbnailData();
+				}
+				if (outputs.includes('image')) {
+					result.image = this.imageData();
+				}
+			} catch (err) {
+				result.error = err.message;
+			}
+			yield result;
+		}
+	}
+
+	/**
+	 * Release the native LibRaw processor. The instance is unusable afterwards.
+	 */
+	delete() {
+		if (this.raw) {
+			this.raw.delete();
+			this.raw = null;
+		}
+	}
+}
+
+export { LibRawSync };
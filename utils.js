@@ -0,0 +1,27 @@
+const THUMB_FORMATS = [
+	'unknown',
+	'jpeg',
+	'bitmap',
+	'bitmap16',
+	'layer',
+	'rollei',
+	'h265'
+];
+
+/**
+ * Normalize the raw metadata object returned by the WASM module
+ */
+export function formatMetadata(metadata) {
+	// Example: convert numeric thumb_format to a string
+	if (metadata?.hasOwnProperty('thumb_format')) {
+		metadata.thumb_format = THUMB_FORMATS[metadata.thumb_format] || 'unknown';
+	}
+	// Trim desc if present
+	if (metadata?.hasOwnProperty('desc')) {
+		metadata.desc = String(metadata.desc).trim();
+	}
+	if (metadata?.hasOwnProperty('timestamp')) {
+		metadata.timestamp = new Date(metadata.timestamp);
+	}
+	return metadata;
+}
@@ -1,36 +1,461 @@
 import LibRawModule from './libraw.js';
+import ResultCache, { settingsKey } from './cache.js';
+import { openPersistentStore, encodeEntry, decodeEntry } from './store.js';
 
 let ready;
+let module;
 let LibRawClass;
-let raw;
+// Every session is an independent LibRaw processor living in the same module
+// (one heap, one compiled instance). Session 0 is created up front.
+const sessions = new Map();
+let nextSession = 1;
+// Results shared by every session of this worker, keyed by file content and
+// settings. Disabled until configureCache() gives it a byte budget.
+const cache = new ResultCache();
+// Persistent tier for previews and metadata (OPFS), see configurePersistentCache()
+let store = null;
+// Settles once the last configurePersistentCache() is done: session calls
+// wait for it, so an open() posted right after it (e.g. replayed after a
+// recycle) is keyed for the new store
+let storeReady = Promise.resolve();
+
+// Bindings of libraw_wrapper.cpp this worker calls. A libraw.wasm built from
+// an older wrapper fails every request up front instead of half working.
+const BINDINGS = {
+	module: ['heapSummary', 'heapStats', 'resetHeapPeak', 'configurePool'],
+	LibRaw: ['open', 'metadata', 'imageData', 'thumbnailData', 'processAsync', 'isBusy', 'estimateMemory',
+		'renderRegion', 'binnedPreview', 'pyramid', 'streamRows', 'exportTiles', 'encode', 'renderProgressive',
+		'stageTimings', 'budgetChoices', 'contentHash', 'uniqueId', 'pause', 'resume'],
+};
+
+function checkBindings() {
+	const missing = [
+		...BINDINGS.module.filter(name => typeof module[name] !== 'function'),
+		...BINDINGS.LibRaw.filter(name => typeof module.LibRaw?.prototype[name] !== 'function'),
+	];
+	if (missing.length) {
+		throw new Error(`LibRaw: libraw.wasm is older than libraw_wrapper.cpp (missing ${missing.join(', ')}), rebuild it with compileLibraw.sh`);
+	}
+}
 
 async function initLibRaw() {
 	ready = (async () => {
-		const module = await LibRawModule();
+		module = await LibRawModule();
+		checkBindings();
 		LibRawClass = module.LibRaw;
-		raw = new LibRawClass();
+		sessions.set(0, createSession());
 	})();
 }
 
 initLibRaw();
 
+function createSession() {
+	return {
+		raw: new LibRawClass(),
+		busy: false,		// a request of this session is running
+		decoding: false,	// ...and it is decoding on a pthread
+		priority: 0,		// priority of the running request
+		paused: false,
+		waiting: false,		// ...but only waits for a result another session computes
+		deleted: false,
+		settings: null,		// settings of the opened file
+		contentKey: null,	// content hash of the opened file (cache enabled only)
+		persistentKey: null,	// camera unique ID, or the content hash
+		settingsKey: null,
+	};
+}
+
 function isTypedArray(obj) {
 	return ArrayBuffer.isView(obj) && !(obj instanceof DataView);
 }
 
+// Results handed out from the cache are copies: posting transfers (detaches)
+// their buffers, which must stay intact in the cache
+function copyOf(value) {
+	if (!value || typeof value !== 'object' || !isTypedArray(value.data)) {
+		return value;
+	}
+	return {...value, data: value.data.slice()};
+}
+
+// Results whose nested objects hold buffers made for this call only (tiles)
+const TRANSFER_DEPTH = {pyramid: 3};
+
+// Buffers of typed arrays found in `out` or in its direct child objects
+function transferablesOf(out, depth = 2) {
+	const transferList = [];
+	for (const key in out) {
+		const value = out[key];
+		if (isTypedArray(value))
+			transferList.push(value.buffer);
+		else if (depth > 1 && value && typeof value === 'object')
+			transferList.push(...transferablesOf(value, depth - 1));
+	}
+	return transferList;
+}
+
+// Heap size/limit posted with every reply (none if the module didn't load).
+// The full heapStats() walks the heap and is only run for memoryStats().
+function heapSummary() {
+	return module && LibRawClass ? module.heapSummary() : undefined;
+}
+
+// Decode on a pthread so other sessions keep being served meanwhile
+function processAsync(session) {
+	return new Promise((resolve, reject) => {
+		session.raw.processAsync((code, step) => {
+			session.decoding = false;
+			session.paused = false;
+			if (code === 0) {
+				resolve();
+			} else {
+				reject(new Error(`LibRaw: ${step}() failed with code ${code}`));
+			}
+		});
+		session.decoding = true;
+		updatePreemption();
+	});
+}
+
+//---------------------------------------------------------------------------
+// Scheduling: requests of one session run in order, one at a time. Across
+// sessions, the most urgent request (lowest priority number) starts first, and
+// decodes of less urgent requests are paused at the next LibRaw stage boundary
+// (LIBRAW_PROGRESS_*) while more urgent work is running or was seen recently.
+//---------------------------------------------------------------------------
+const PRIORITIES = {high: 0, normal: 1, low: 2};
+// Keep background decodes paused briefly after urgent work, so a burst of
+// interactive requests (e.g. a page of thumbnails) isn't interleaved with them
+const PREEMPT_LINGER_MS = 50;
+const pending = [];
+let nextSeq = 0;
+let urgentPriority = Infinity;
+let urgentUntil = 0;
+let lingerTimer = null;
+
+function enqueue(session, id, fn, args, priority) {
+	return new Promise((resolve, reject) => {
+		pending.push({seq: nextSeq++, session, id, fn, args, resolve, reject,
+			priority: PRIORITIES[priority] ?? PRIORITIES.normal});
+		schedule();
+	});
+}
+
+function schedule() {
+	// Only the oldest pending request of an idle session may start
+	const heads = new Map();
+	for (const request of pending) {
+		if (!request.session.busy && !heads.has(request.session)) {
+			heads.set(request.session, request);
+		}
+	}
+	const runnable = [...heads.values()].sort((a, b) => a.priority - b.priority || a.seq - b.seq);
+	for (const request of runnable) {
+		pending.splice(pending.indexOf(request), 1);
+		request.session.busy = true;
+		request.session.priority = request.priority;
+	}
+	updatePreemption(runnable);
+	for (const request of runnable) {
+		start(request);
+	}
+}
+
+async function start({session, id, fn, args, resolve, reject}) {
+	try {
+		resolve(await run(session, id, fn, args));
+	} catch (err) {
+		reject(err);
+	} finally {
+		session.busy = false;
+		if (session.deleted && !pending.some(r => r.session === session)) {
+			session.raw.delete();
+		}
+		schedule();
+	}
+}
+
+// A session's effective priority also covers requests queued behind it, so a
+// decode that blocks urgent work of its own session is never paused
+function effectivePriority(session) {
+	return pending.reduce((p, r) => r.session === session ? Math.min(p, r.priority) : p, session.priority);
+}
+
+function updatePreemption(starting = []) {
+	const running = [...sessions.values()].filter(s => s.busy && !s.paused && !s.waiting);
+	let urgent = Math.min(...running.map(effectivePriority), ...starting.map(r => r.priority));
+	const now = performance.now();
+	if (urgent <= urgentPriority || now >= urgentUntil) {
+		urgentPriority = urgent;
+		urgentUntil = now + PREEMPT_LINGER_MS;
+	} else {
+		urgent = urgentPriority;
+	}
+
+	let anyPaused = false;
+	for (const session of sessions.values()) {
+		if (!session.decoding) {
+			continue;
+		}
+		const shouldPause = effectivePriority(session) > urgent;
+		if (shouldPause !== session.paused) {
+			session.paused = shouldPause;
+			shouldPause ? session.raw.pause() : session.raw.resume();
+		}
+		anyPaused ||= shouldPause;
+	}
+	clearTimeout(lingerTimer);
+	if (anyPaused) {
+		// Re-evaluate once the linger window is over
+		lingerTimer = setTimeout(() => updatePreemption(), Math.max(0, urgentUntil - now) + 1);
+	}
+}
+
+// Worker-level calls, not bound to (nor queued behind) any session
+const controlFns = {
+	async createSession() {
+		const id = nextSession++;
+		sessions.set(id, createSession());
+		return id;
+	},
+	async configureCache(options) {
+		cache.configure(options);
+		return cache.stats();
+	},
+	async cacheStats() {
+		return cache.stats();
+	},
+	async heapStats() {
+		return module.heapStats();
+	},
+	async resetHeapPeak() {
+		module.resetHeapPeak();
+		return module.heapStats();
+	},
+	async configurePool({maxBytes}) {
+		module.configurePool(maxBytes);
+		return module.heapStats();
+	},
+	// Recreate the sessions of a recycled worker under their previous ids
+	async restoreSessions(ids) {
+		for (const id of ids) {
+			sessions.set(id, createSession());
+			nextSession = Math.max(nextSession, id + 1);
+		}
+	},
+	async configurePersistentCache(options) {
+		const opening = options ? openPersistentStore(options) : Promise.resolve(null);
+		storeReady = storeReady.then(() => opening).then(opened => {
+			store = opened;
+		}, () => {
+			store = null;
+		});
+		await opening;
+	},
+	async clearPersistentCache() {
+		await storeReady;
+		await store?.clear();
+	},
+	async deleteSession(id) {
+		const target = sessions.get(id);
+		if (!target || id === 0) {
+			return;
+		}
+		sessions.delete(id);
+		target.deleted = true;
+		// Never free a processor that is still running or has queued calls;
+		// start() frees it once the last one is done
+		if (!target.busy && !pending.some(r => r.session === target)) {
+			target.raw.delete();
+		}
+	},
+};
+
+// Serve from the persistent store, or produce and store in the background
+async function persisted(key, kind, producer) {
+	const entry = await store.read(key, kind);
+	if (entry) {
+		return decodeEntry(entry);
+	}
+	const value = await producer();
+	if (value) {
+		// Encoded right away: `value` buffers are transferred once posted
+		store.write(key, kind, encodeEntry(value)).catch(() => {});
+	}
+	return value;
+}
+
+function cached(session, kind, producer, persistent = false) {
+	if (persistent && store && session.persistentKey) {
+		const produce = producer;
+		producer = () => persisted(session.persistentKey, kind, produce);
+	}
+	if (!cache.enabled || !session.contentKey) {
+		return producer();
+	}
+	const key = `${session.contentKey}:${kind}`;
+	if (cache.inflight.has(key)) {
+		// Coalesced onto another session's decode: this session makes no
+		// progress of its own, so it must not preempt that decode
+		session.waiting = true;
+		updatePreemption();
+	}
+	return cache.getOrCreate(key, producer).then(copyOf).finally(() => {
+		session.waiting = false;
+	});
+}
+
+const sessionFns = {
+	async open(session, buffer, settings) {
+		session.raw.open(buffer, settings);
+		session.contentKey = cache.enabled ? session.raw.contentHash() : null;
+		session.persistentKey = store ? (session.raw.uniqueId() || session.raw.contentHash()) : null;
+		session.settings = settings;
+		session.settingsKey = settingsKey(settings);
+	},
+	async metadata(session, fullOutput) {
+		return cached(session, `metadata:${!!fullOutput}`, () => session.raw.metadata(fullOutput), true);
+	},
+	async thumbnailData(session) {
+		// The embedded preview doesn't depend on the settings
+		return cached(session, 'thumb', () => session.raw.thumbnailData(), true);
+	},
+	async imageData(session) {
+		return cached(session, `image:${session.settingsKey}`, async () => {
+			await processAsync(session);
+			return session.raw.imageData();
+		});
+	},
+	// Rendered and compressed on a pthread: only the file bytes are posted
+	async encode(session, options) {
+		return new Promise((resolve, reject) => {
+			session.raw.encode(options ?? null, (error, result) => {
+				session.decoding = false;
+				session.paused = false;
+				if (error) {
+					reject(new Error(error));
+				} else {
+					resolve(result);
+				}
+			});
+			session.decoding = true;
+			updatePreemption();
+		});
+	},
+	// Preview posted as soon as it is ready, then the final image. The
+	// settings apply on top of the opened ones, for later calls too.
+	async renderProgressive(session, id, settings) {
+		if (settings) {
+			session.settings = {...session.settings, ...settings};
+			session.settingsKey = settingsKey(session.settings);
+		}
+		return new Promise((resolve, reject) => {
+			session.raw.renderProgressive(settings ?? null, preview => {
+				self.postMessage({id, partial: preview}, [preview.data.buffer]);
+			}, (error, image) => {
+				session.decoding = false;
+				session.paused = false;
+				if (error) {
+					reject(new Error(error));
+				} else {
+					resolve(image);
+				}
+			});
+			session.decoding = true;
+			updatePreemption();
+		});
+	},
+	// Deep Zoom tiles, encoded on pthreads and posted one by one as they finish
+	async exportTiles(session, id, options) {
+		return new Promise((resolve, reject) => {
+			session.raw.exportTiles(options ?? null, tile => {
+				self.postMessage({id, partial: tile}, [tile.data.buffer]);
+			}, (error, info) => {
+				session.decoding = false;
+				session.paused = false;
+				if (error) {
+					reject(new Error(error));
+				} else {
+					resolve(info);
+				}
+			});
+			session.decoding = true;
+			updatePreemption();
+		});
+	},
+	// Bands are converted one at a time into a buffer the module reuses: each
+	// is copied out and posted before the next one is made
+	async streamRows(session, id, options) {
+		await processAsync(session);
+		return session.raw.streamRows(options ?? null, band => {
+			const data = band.data.slice();
+			self.postMessage({id, partial: {...band, data}}, [data.buffer]);
+		});
+	},
+	async pyramid(session, options) {
+		await processAsync(session);
+		return session.raw.pyramid(options ?? null);
+	},
+	// Runs a whole list of files in this session and posts each result as soon
+	// as it is ready. Nothing is rendered twice (thumbnails come first), so
+	// files and raw data are released during the decode by default: that
+	// lowers the peak of each decode, but the input buffer is then allocated
+	// again for every file. Only the output buffers are reused from one file
+	// to the next, unless settings pass streamingRelease: false.
+	async processBatch(session, id, files, settings, {outputs = ['metadata', 'image'], fullMetadata = false} = {}) {
+		settings = {streamingRelease: true, ...settings};
+		let processed = 0;
+		for (let index = 0; index < files.length; index++) {
+			const result = {index};
+			try {
+				await sessionFns.open(session, files[index], settings);
+				files[index] = null; // copied into the WASM heap, let GC reclaim it
+				if (outputs.includes('metadata')) {
+					result.metadata = await sessionFns.metadata(session, fullMetadata);
+				}
+				if (outputs.includes('thumb')) {
+					result.thumb = await sessionFns.thumbnailData(session);
+				}
+				if (outputs.includes('image')) {
+					result.image = await sessionFns.imageData(session);
+				}
+				processed++;
+			} catch (err) {
+				result.error = err.message;
+			}
+			self.postMessage({id, partial: result, heap: heapSummary()}, transferablesOf(result));
+		}
+		return {processed, failed: files.length - processed};
+	},
+};
+
+async function run(session, id, fn, args) {
+	if (fn === 'processBatch' || fn === 'exportTiles' || fn === 'streamRows' || fn === 'renderProgressive') {
+		return await sessionFns[fn](session, id, ...args);
+	}
+	if (sessionFns[fn]) {
+		return await sessionFns[fn](session, ...args);
+	}
+	return session.raw[fn](...args);
+}
+
 self.onmessage = async (event) => {
-	const {fn, args} = event.data;
+	const {id, session: sessionId = 0, fn, args, priority} = event.data;
 	try {
 		await ready;
-		const out = raw[fn](...args);
-		const transferList = [];
-		for (const key in out) {
-			const value = out[key];
-			if (isTypedArray(value))
-				transferList.push(value.buffer);
-		}
-		self.postMessage({out}, transferList);
+		let out;
+		if (controlFns[fn]) {
+			out = await controlFns[fn](...args);
+		} else {
+			const session = sessions.get(sessionId);
+			if (!session) {
+				throw new Error(`LibRaw: unknown session ${sessionId}`);
+			}
+			await storeReady;
+			out = await enqueue(session, id, fn, args, priority);
+		}
+		self.postMessage({id, out, heap: heapSummary()}, transferablesOf(out, TRANSFER_DEPTH[fn] ?? 1));
 	} catch (err) {
-		self.postMessage({error: err.message});
+		self.postMessage({id, error: err.message, heap: heapSummary()});
 	}
-};
\ No newline at end of file
+};